@@ -30,18 +30,18 @@
 
 /* Macros */
 #define DCWrite8(addr, val)	do {			\
-	*(vu8 *)(addr) = (val);				\
-	DCFlushRange((void *)(addr), sizeof(u8));	\
+	*(vu8 *)(uintptr_t)(addr) = (val);		\
+	DCFlushRange((void *)(uintptr_t)(addr), sizeof(u8));	\
 } while (0)
 
 #define DCWrite16(addr, val)	do {			\
-	*(vu16 *)(addr) = (val);			\
-	DCFlushRange((void *)(addr), sizeof(u16));	\
+	*(vu16 *)(uintptr_t)(addr) = (val);		\
+	DCFlushRange((void *)(uintptr_t)(addr), sizeof(u16));	\
 } while (0)
 
 #define DCWrite32(addr, val)	do {			\
-	*(vu32 *)(addr) = (val);			\
-	DCFlushRange((void *)(addr), sizeof(u32));	\
+	*(vu32 *)(uintptr_t)(addr) = (val);		\
+	DCFlushRange((void *)(uintptr_t)(addr), sizeof(u32));	\
 } while (0)
 
 
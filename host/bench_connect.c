@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "fake_wiimote_mgr.h"
+#include "wii_bt.h"
+
+/* Time from an input device showing up to the first data report reaching the emulated Wii,
+ * through the connection, the HID channels setup and the WPAD handshake. Without extension,
+ * the handshake reads the EEPROM calibration (42 bytes). With a Nunchuk, it reads the whole
+ * extension register block (256 bytes) instead, 16 bytes per read data reply.
+ *
+ * The number of read data replies sent per tick is a build option, so compare builds:
+ *   make host EXTRA_CFLAGS=-DREAD_DATA_REPLIES_PER_TICK=1 && ./build-host/bench_connect
+ *   make clean && make host && ./build-host/bench_connect */
+
+#define CONNECTIONS	10
+#define TIMEOUT_NS	(2 * 1000 * 1000 * 1000ull)
+
+static u64 samples[CONNECTIONS];
+
+static int cmp_u64(const void *a, const void *b)
+{
+	return (*(const u64 *)a > *(const u64 *)b) - (*(const u64 *)a < *(const u64 *)b);
+}
+
+static bool input_ready(void *arg)
+{
+	return wii_bt_get_wiimote(0)->input_ready;
+}
+
+static bool disconnected(void *arg)
+{
+	return !wii_bt_get_wiimote(0)->connected;
+}
+
+static int run(const char *name, enum wiimote_mgr_ext_u ext)
+{
+	static const input_device_ops_t input_ops;
+	fake_wiimote_t *wiimote;
+	u64 start, sum = 0;
+
+	for (int i = 0; i < CONNECTIONS; i++) {
+		start = host_time_ns();
+		wiimote = fake_wiimote_mgr_add_input_device(NULL, &input_ops);
+		if (!wiimote) {
+			printf("%s: no fake Wiimote available for connection %d\n", name, i);
+			return 1;
+		}
+		fake_wiimote_mgr_set_extension(wiimote, ext);
+		if (!wii_bt_run(TIMEOUT_NS, input_ready, NULL)) {
+			printf("%s: connection %d not reporting (connected: %d, HID ready: %d)\n", name, i,
+			       wii_bt_get_wiimote(0)->connected, wii_bt_get_wiimote(0)->hid_ready);
+			return 1;
+		}
+		samples[i] = wii_bt_get_wiimote(0)->input_ready_ns - start;
+		sum += samples[i];
+
+		fake_wiimote_mgr_remove_input_device(wiimote);
+		if (!wii_bt_run(TIMEOUT_NS, disconnected, NULL)) {
+			printf("%s: connection %d not closed\n", name, i);
+			return 1;
+		}
+	}
+
+	qsort(samples, CONNECTIONS, sizeof(samples[0]), cmp_u64);
+	printf("%-16s min %6.1f ms, median %6.1f ms, max %6.1f ms, mean %6.1f ms\n", name,
+	       samples[0] / 1e6, samples[CONNECTIONS / 2] / 1e6, samples[CONNECTIONS - 1] / 1e6,
+	       sum / CONNECTIONS / 1e6);
+	return 0;
+}
+
+int main(void)
+{
+	wii_bt_config_t config = {
+		.intr_buffers = 2,
+		.bulk_in_buffers = 4,
+	};
+
+	wii_bt_init(&config);
+	wii_bt_enable_page_scan(true);
+
+	if (run("no extension", WIIMOTE_MGR_EXT_NONE) || run("Nunchuk", WIIMOTE_MGR_EXT_NUNCHUK))
+		return 1;
+
+	return 0;
+}
@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include "host.h"
+#include "wiimote_crypto_ref.h"
+
+/* Extension encryption, word at a time (wiimote_crypto_encrypt()) against the byte loop
+ * it replaced, for the extension data sizes of the data reports and for register reads. */
+
+#define BYTES_PER_RUN	(4 * 1024 * 1024)
+
+typedef void (*encrypt_fn_t)(u8 *data, const struct wiimote_encryption_key_t *key, u32 addr,
+			     u32 size);
+
+static const u8 key_data[16] = {
+	0x9c, 0x21, 0x4f, 0xd8, 0x03, 0x76, 0xaa, 0x15,
+	0x6b, 0xf0, 0x31, 0xde, 0x60, 0xf2, 0x1d, 0xf9,
+};
+
+/* Nunchuk, 0x35 report (16), 0x3d report (21), register reads */
+static const u32 sizes[] = { 6, 16, 19, 21, 64, 256 };
+
+static u8 buf[256] __attribute__((aligned(4)));
+
+/* Nanoseconds per call, best of a few runs */
+static double time_calls(encrypt_fn_t fn, const struct wiimote_encryption_key_t *key, u32 size)
+{
+	u32 calls = BYTES_PER_RUN / size;
+	double best = 0;
+	u64 start;
+
+	for (int run = 0; run < 5; run++) {
+		start = host_time_ns();
+		for (u32 i = 0; i < calls; i++)
+			fn(buf, key, 0, size);
+		double ns = (double)(host_time_ns() - start) / calls;
+		if (!run || (ns < best))
+			best = ns;
+	}
+
+	return best;
+}
+
+/* Called through a pointer, like wiimote_crypto_encrypt() */
+static void __attribute__((noinline)) encrypt_ref(u8 *data, const struct wiimote_encryption_key_t *key,
+						  u32 addr, u32 size)
+{
+	wiimote_crypto_encrypt_ref(data, key, addr, size);
+}
+
+int main(void)
+{
+	struct wiimote_encryption_key_t key;
+	double byte_ns, word_ns;
+
+	wiimote_crypto_generate_key_from_extension_key_data(&key, key_data);
+
+	printf("%8s %12s %12s %8s\n", "size", "byte ns", "word ns", "speedup");
+	for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		byte_ns = time_calls(encrypt_ref, &key, sizes[i]);
+		word_ns = time_calls(wiimote_crypto_encrypt, &key, sizes[i]);
+		printf("%8u %12.1f %12.1f %7.2fx\n", sizes[i], byte_ns, word_ns, byte_ns / word_ns);
+	}
+
+	return 0;
+}
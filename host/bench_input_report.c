@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "fake_wiimote_mgr.h"
+#include "utils.h"
+#include "wii_bt.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC	1
+#endif
+
+/* Cost of sending one input report (a 0x35 data report) to the emulated Wii:
+ *  - prebuilt: hid_send_input_report(), which copies a prebuilt ACL/L2CAP/HID header
+ *  - layered: the path it replaced, where the HID report ID and then the HID type were each
+ *    prepended in a new stack buffer before l2cap_send_msg() built the L2CAP and ACL headers
+ * both when the Wii has a buffer posted (the report is built in place and ACKed, including the
+ * emulated Wii's handling of it) and when it has none (the report waits on the ReadyQ). */
+
+#define ITERATIONS	20000
+#define TIMEOUT_NS	(2 * 1000 * 1000 * 1000ull)
+#define BULK_IN_BUFFERS	4
+#define REPORT_SIZE	21
+
+static u64 ns_samples[ITERATIONS], cycle_samples[ITERATIONS];
+static u16 con_handle, dcid;
+static hid_input_report_hdr_t report_hdr;
+static u8 report[REPORT_SIZE];
+
+static inline u64 cycles(void)
+{
+#ifdef HAVE_RDTSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static int send_prebuilt(void)
+{
+	return hid_send_input_report(&report_hdr, INPUT_REPORT_ID_BTN_ACC_EXP, report, sizeof(report));
+}
+
+/* The layered path, as it was before the prebuilt header */
+static int send_hid_data(u16 hci_con_handle, u16 dcid, u8 hid_type, const void *data, u32 size)
+{
+	u8 buf[WIIMOTE_MAX_PAYLOAD];
+	assert(size <= (WIIMOTE_MAX_PAYLOAD - 1));
+	buf[0] = hid_type;
+	memcpy(&buf[1], data, size);
+	return l2cap_send_msg(hci_con_handle, dcid, buf, size + 1);
+}
+
+static int send_hid_input_report(u16 hci_con_handle, u16 dcid, u8 report_id, const void *data,
+				 u32 size)
+{
+	u8 buf[WIIMOTE_MAX_PAYLOAD - 1];
+	assert(size <= (WIIMOTE_MAX_PAYLOAD - 2));
+	buf[0] = report_id;
+	memcpy(&buf[1], data, size);
+	return send_hid_data(hci_con_handle, dcid, (HID_TYPE_DATA << 4) | HID_PARAM_INPUT, buf, size + 1);
+}
+
+static int __attribute__((noinline)) send_layered(void)
+{
+	return send_hid_input_report(con_handle, dcid, INPUT_REPORT_ID_BTN_ACC_EXP, report,
+				     sizeof(report));
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	return (*(const u64 *)a > *(const u64 *)b) - (*(const u64 *)a < *(const u64 *)b);
+}
+
+static void print_stats(const char *name)
+{
+	qsort(ns_samples, ITERATIONS, sizeof(ns_samples[0]), cmp_u64);
+	qsort(cycle_samples, ITERATIONS, sizeof(cycle_samples[0]), cmp_u64);
+	printf("%-20s median %5llu ns, p99 %5llu ns", name, ns_samples[ITERATIONS / 2],
+	       ns_samples[ITERATIONS * 99 / 100]);
+#ifdef HAVE_RDTSC
+	printf(", median %5llu cycles", cycle_samples[ITERATIONS / 2]);
+#endif
+	printf("\n");
+}
+
+/* The Wii has all its buffers posted, the report is built into one of them */
+static int bench_in_place(const char *name, int (*send)(void))
+{
+	u32 room;
+	u64 start_ns, start_cycles;
+
+	for (int i = 0; i < ITERATIONS; i++) {
+		/* Let the module take the buffers reposted by the emulated Wii */
+		wii_bt_pump();
+		room = usb_bulk_in_ready_queue_room();
+		start_ns = host_time_ns();
+		start_cycles = cycles();
+		send();
+		cycle_samples[i] = cycles() - start_cycles;
+		ns_samples[i] = host_time_ns() - start_ns;
+		if (usb_bulk_in_ready_queue_room() != room) {
+			printf("%s: report %d was queued\n", name, i);
+			return 1;
+		}
+	}
+
+	print_stats(name);
+	return 0;
+}
+
+/* The Wii has no buffer posted, the report waits on the ReadyQ */
+static int bench_ready_q(const char *name, int (*send)(void))
+{
+	u32 room;
+	u64 start_ns, start_cycles;
+
+	for (int i = 0; i < ITERATIONS; i++) {
+		wii_bt_pump();
+		/* Fill the posted buffers. They are reposted but stay in the OH1 queue until the
+		 * next pump. */
+		for (int j = 0; j < BULK_IN_BUFFERS; j++)
+			send();
+		room = usb_bulk_in_ready_queue_room();
+		start_ns = host_time_ns();
+		start_cycles = cycles();
+		send();
+		cycle_samples[i] = cycles() - start_cycles;
+		ns_samples[i] = host_time_ns() - start_ns;
+		if (usb_bulk_in_ready_queue_room() != room - 1) {
+			printf("%s: report %d was not queued\n", name, i);
+			return 1;
+		}
+	}
+	wii_bt_pump();
+
+	print_stats(name);
+	return 0;
+}
+
+static bool input_ready(void *arg)
+{
+	return wii_bt_get_wiimote(0)->input_ready;
+}
+
+static bool mode_acked(void *arg)
+{
+	return wii_bt_get_wiimote(0)->acks > 0;
+}
+
+int main(void)
+{
+	static const input_device_ops_t input_ops;
+	wii_bt_config_t config = {
+		.intr_buffers = 2,
+		.bulk_in_buffers = BULK_IN_BUFFERS,
+	};
+	struct wiimote_output_report_mode_t mode = { 0 };
+	wii_bt_wiimote_t *wm = wii_bt_get_wiimote(0);
+
+	wii_bt_init(&config);
+	wii_bt_enable_page_scan(true);
+	fake_wiimote_mgr_add_input_device(NULL, &input_ops);
+	if (!wii_bt_run(TIMEOUT_NS, input_ready, NULL)) {
+		printf("The fake Wiimote did not connect\n");
+		return 1;
+	}
+
+	/* No continuous reporting, so that the fake Wiimote stays quiet */
+	mode.ack = 1;
+	mode.mode = INPUT_REPORT_ID_BTN;
+	wii_bt_send_output_report(0, OUTPUT_REPORT_ID_REPORT_MODE, &mode, sizeof(mode));
+	wii_bt_run(TIMEOUT_NS, mode_acked, NULL);
+
+	/* Reports to the fake Wiimote's HID interrupt channel */
+	con_handle = wm->con_handle;
+	dcid = wm->intr_cid;
+	hid_input_report_hdr_init(&report_hdr, con_handle, dcid);
+	for (int i = 0; i < sizeof(report); i++)
+		report[i] = i;
+
+	if (bench_in_place("layered, in place", send_layered) ||
+	    bench_in_place("prebuilt, in place", send_prebuilt) ||
+	    bench_ready_q("layered, ReadyQ", send_layered) ||
+	    bench_ready_q("prebuilt, ReadyQ", send_prebuilt))
+		return 1;
+
+	return 0;
+}
@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "fake_wiimote_mgr.h"
+#include "wii_bt.h"
+
+/* Round trip time through the OH1 hooks, from the Wii sending a message to /dev/usb/oh1 to
+ * the module (or the emulated dongle) ACKing it:
+ *  - a status request sent to a fake Wiimote, answered with a status report that is built
+ *    into one of the ACL buffers posted by the Wii
+ *  - an HCI command that the module hands down to the dongle */
+
+#define ITERATIONS	20000
+#define TIMEOUT_NS	(2 * 1000 * 1000 * 1000ull)
+
+static u64 samples[ITERATIONS];
+
+static int cmp_u64(const void *a, const void *b)
+{
+	return (*(const u64 *)a > *(const u64 *)b) - (*(const u64 *)a < *(const u64 *)b);
+}
+
+static void print_stats(const char *name)
+{
+	u64 sum = 0;
+
+	for (int i = 0; i < ITERATIONS; i++)
+		sum += samples[i];
+	qsort(samples, ITERATIONS, sizeof(samples[0]), cmp_u64);
+	printf("%-24s min %6llu ns, median %6llu ns, p99 %6llu ns, mean %6llu ns\n", name,
+	       samples[0], samples[ITERATIONS / 2], samples[ITERATIONS * 99 / 100], sum / ITERATIONS);
+}
+
+static bool input_ready(void *arg)
+{
+	return wii_bt_get_wiimote(0)->input_ready;
+}
+
+static bool mode_acked(void *arg)
+{
+	return wii_bt_get_wiimote(0)->acks > 0;
+}
+
+int main(void)
+{
+	static const input_device_ops_t input_ops;
+	wii_bt_config_t config = {
+		.intr_buffers = 2,
+		.bulk_in_buffers = 4,
+	};
+	struct wiimote_output_report_mode_t mode = { 0 };
+	hci_write_scan_enable_cp scan = { .scan_enable = HCI_PAGE_SCAN_ENABLE };
+	wii_bt_wiimote_t *wm = wii_bt_get_wiimote(0);
+	u8 rumble = 0;
+	u32 status_reports;
+	u64 start;
+
+	wii_bt_init(&config);
+	wii_bt_enable_page_scan(true);
+	fake_wiimote_mgr_add_input_device(NULL, &input_ops);
+	if (!wii_bt_run(TIMEOUT_NS, input_ready, NULL)) {
+		printf("The fake Wiimote did not connect\n");
+		return 1;
+	}
+
+	/* Buttons only and no continuous reporting, so that the tick stays mostly idle */
+	mode.ack = 1;
+	mode.mode = INPUT_REPORT_ID_BTN;
+	wii_bt_send_output_report(0, OUTPUT_REPORT_ID_REPORT_MODE, &mode, sizeof(mode));
+	wii_bt_run(TIMEOUT_NS, mode_acked, NULL);
+
+	for (int i = 0; i < ITERATIONS; i++) {
+		status_reports = wm->status_reports;
+		start = host_time_ns();
+		wii_bt_send_output_report(0, OUTPUT_REPORT_ID_STATUS, &rumble, sizeof(rumble));
+		wii_bt_pump();
+		samples[i] = host_time_ns() - start;
+		if (wm->status_reports == status_reports) {
+			printf("Status request %d not answered\n", i);
+			return 1;
+		}
+	}
+	print_stats("status request/report");
+
+	for (int i = 0; i < ITERATIONS; i++) {
+		start = host_time_ns();
+		wii_bt_send_hci_cmd(HCI_CMD_WRITE_SCAN_ENABLE, &scan, sizeof(scan));
+		wii_bt_pump();
+		samples[i] = host_time_ns() - start;
+	}
+	print_stats("HCI command to dongle");
+
+	return 0;
+}
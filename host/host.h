@@ -0,0 +1,24 @@
+#ifndef HOST_H
+#define HOST_H
+
+#include "ipc.h"
+#include "types.h"
+
+/* In-process emulation of the cios-lib IOS syscalls, used by "make host" to run
+ * the module on a development machine (benchmarks, profiling, debugging). */
+
+/* Called by the emulated os_message_queue_ack() for every ipcmessage the module ACKs
+ * (that is, every message that would be returned to the PPC on real hardware). */
+typedef void (*host_ack_handler_t)(ipcmessage *msg, s32 result);
+void host_set_ack_handler(host_ack_handler_t handler);
+
+/* Monotonic clock, in nanoseconds */
+u64 host_time_ns(void);
+
+/* Exported by source/main.c */
+extern int orig_msg_queueid;
+int fakemote_main(void); /* main() is renamed on host builds */
+int OH1_IOS_ReceiveMessage_hook(int queueid, ipcmessage **ret_msg, u32 flags);
+int OH1_IOS_ResourceReply_hook(ipcmessage *ready_msg, int retval);
+
+#endif
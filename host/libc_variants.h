@@ -0,0 +1,67 @@
+#ifndef LIBC_VARIANTS_H
+#define LIBC_VARIANTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/* The module's memcpy, memset and memcmp (source/libc.c, word at a time) renamed so that they
+ * can sit next to the host libc, and the byte at a time loops they replaced. For the tests and
+ * benchmarks of libc.c. */
+
+/* Keep GCC from turning the loops back into calls to the host libc */
+#pragma GCC optimize("no-tree-loop-distribute-patterns")
+
+#define memset	word_memset
+#define memcpy	word_memcpy
+#define memcmp	word_memcmp
+#define strlen	word_strlen
+#define strnlen	word_strnlen
+#include "../source/libc.c"
+#undef memset
+#undef memcpy
+#undef memcmp
+#undef strlen
+#undef strnlen
+
+static inline void *byte_memset(void *s, int c, size_t n)
+{
+	char *p = s;
+
+	while (n) {
+		*p++ = c;
+		n--;
+	}
+
+	return s;
+}
+
+static inline void *byte_memcpy(void *dest, const void *src, size_t n)
+{
+	const char *s = src;
+	char *d = dest;
+
+	while (n) {
+		*d++ = *s++;
+		n--;
+	}
+
+	return dest;
+}
+
+static inline int byte_memcmp(const void *s1, const void *s2, size_t n)
+{
+	unsigned char u1, u2;
+
+	for (; n--; s1++, s2++) {
+		u1 = *(unsigned char *)s1;
+		u2 = *(unsigned char *)s2;
+		if (u1 != u2)
+			return u1 - u2;
+	}
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,519 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "host.h"
+#include "ios.h"
+#include "syscalls.h"
+#include "tools.h"
+
+/* Emulation of the IOS kernel primitives used by the module, backed by pthreads.
+ * Good enough to drive the OH1 hooks from a benchmark: it makes no attempt to
+ * mimic Starlet timings, only IOS semantics (queue ordering, heap placement). */
+
+#define HOST_MAX_QUEUES		16
+#define HOST_MAX_HEAPS		4
+#define HOST_MAX_TIMERS		4
+#define HOST_MAX_THREADS	4
+#define HOST_HEAP_ALIGN		32
+
+static pthread_mutex_t host_lock = PTHREAD_MUTEX_INITIALIZER;
+static host_ack_handler_t host_ack_handler;
+
+void host_set_ack_handler(host_ack_handler_t handler)
+{
+	host_ack_handler = handler;
+}
+
+u64 host_time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Message queues */
+
+static struct {
+	bool used;
+	void **msgs;
+	u32 size;
+	u32 head;
+	u32 count;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+} queues[HOST_MAX_QUEUES];
+
+static inline bool queue_is_valid(s32 queueid)
+{
+	return (queueid >= 0) && (queueid < HOST_MAX_QUEUES) && queues[queueid].used;
+}
+
+s32 os_message_queue_create(void *ptr, u32 id)
+{
+	s32 ret = IOS_ENOMEM;
+
+	/* The caller's buffer is sized for 32-bit pointers, use our own storage */
+	pthread_mutex_lock(&host_lock);
+	for (int i = 0; i < HOST_MAX_QUEUES; i++) {
+		if (queues[i].used)
+			continue;
+		queues[i].msgs = calloc(id, sizeof(void *));
+		if (!queues[i].msgs)
+			break;
+		queues[i].size = id;
+		queues[i].head = 0;
+		queues[i].count = 0;
+		pthread_mutex_init(&queues[i].lock, NULL);
+		pthread_cond_init(&queues[i].not_empty, NULL);
+		pthread_cond_init(&queues[i].not_full, NULL);
+		queues[i].used = true;
+		ret = i;
+		break;
+	}
+	pthread_mutex_unlock(&host_lock);
+
+	return ret;
+}
+
+s32 os_message_queue_destroy(s32 queueid)
+{
+	if (!queue_is_valid(queueid))
+		return IOS_EINVAL;
+
+	pthread_mutex_lock(&host_lock);
+	queues[queueid].used = false;
+	free(queues[queueid].msgs);
+	pthread_mutex_unlock(&host_lock);
+
+	return IOS_OK;
+}
+
+s32 os_message_queue_receive(s32 queueid, void *message, u32 flags)
+{
+	if (!queue_is_valid(queueid))
+		return IOS_EINVAL;
+
+	pthread_mutex_lock(&queues[queueid].lock);
+	while (queues[queueid].count == 0) {
+		if (flags == IOS_MESSAGE_NOBLOCK) {
+			pthread_mutex_unlock(&queues[queueid].lock);
+			return IOS_EQUEUEEMPTY;
+		}
+		pthread_cond_wait(&queues[queueid].not_empty, &queues[queueid].lock);
+	}
+	if (message)
+		*(void **)message = queues[queueid].msgs[queues[queueid].head];
+	queues[queueid].head = (queues[queueid].head + 1) % queues[queueid].size;
+	queues[queueid].count--;
+	pthread_cond_signal(&queues[queueid].not_full);
+	pthread_mutex_unlock(&queues[queueid].lock);
+
+	return IOS_OK;
+}
+
+static s32 queue_push(s32 queueid, void *message, s32 flags, bool front)
+{
+	u32 pos;
+
+	if (!queue_is_valid(queueid))
+		return IOS_EINVAL;
+
+	pthread_mutex_lock(&queues[queueid].lock);
+	while (queues[queueid].count == queues[queueid].size) {
+		if (flags == IOS_MESSAGE_NOBLOCK) {
+			pthread_mutex_unlock(&queues[queueid].lock);
+			return IOS_EQUEUEFULL;
+		}
+		pthread_cond_wait(&queues[queueid].not_full, &queues[queueid].lock);
+	}
+	if (front) {
+		queues[queueid].head = (queues[queueid].head + queues[queueid].size - 1) %
+				       queues[queueid].size;
+		pos = queues[queueid].head;
+	} else {
+		pos = (queues[queueid].head + queues[queueid].count) % queues[queueid].size;
+	}
+	queues[queueid].msgs[pos] = message;
+	queues[queueid].count++;
+	pthread_cond_signal(&queues[queueid].not_empty);
+	pthread_mutex_unlock(&queues[queueid].lock);
+
+	return IOS_OK;
+}
+
+s32 os_message_queue_send(s32 queueid, void *message, s32 flags)
+{
+	return queue_push(queueid, message, flags, false);
+}
+
+s32 os_message_queue_send_now(s32 queueid, void *message, s32 flags)
+{
+	return queue_push(queueid, message, flags, true);
+}
+
+s32 os_message_queue_ack(void *message, s32 result)
+{
+	ipcmessage *msg = message;
+
+	msg->result = result;
+	if (host_ack_handler)
+		host_ack_handler(msg, result);
+
+	return IOS_OK;
+}
+
+/* Heaps: first-fit allocator working inside the caller-provided buffer, so that
+ * address range checks on the heap memory behave like on IOS. */
+
+typedef struct {
+	u32 size; /* Including this header */
+	bool used;
+} ATTRIBUTE_ALIGN(HOST_HEAP_ALIGN) heap_block_t;
+
+static struct {
+	bool used;
+	u8 *base;
+	u32 size;
+} heaps[HOST_MAX_HEAPS];
+
+s32 os_heap_create(void *ptr, s32 size)
+{
+	heap_block_t *first;
+	s32 ret = IOS_ENOHEAP;
+
+	if (((uintptr_t)ptr % HOST_HEAP_ALIGN) || (size < 2 * sizeof(heap_block_t)))
+		return IOS_EINVAL;
+
+	pthread_mutex_lock(&host_lock);
+	for (int i = 0; i < HOST_MAX_HEAPS; i++) {
+		if (heaps[i].used)
+			continue;
+		heaps[i].base = ptr;
+		heaps[i].size = size & ~(HOST_HEAP_ALIGN - 1);
+		first = ptr;
+		first->size = heaps[i].size;
+		first->used = false;
+		heaps[i].used = true;
+		ret = i;
+		break;
+	}
+	pthread_mutex_unlock(&host_lock);
+
+	return ret;
+}
+
+s32 os_heap_destroy(s32 heap)
+{
+	if ((heap < 0) || (heap >= HOST_MAX_HEAPS))
+		return IOS_EINVAL;
+
+	heaps[heap].used = false;
+	return IOS_OK;
+}
+
+void *os_heap_alloc(s32 heap, u32 size)
+{
+	heap_block_t *blk, *next;
+	u8 *ptr, *end;
+	void *ret = NULL;
+
+	if ((heap < 0) || (heap >= HOST_MAX_HEAPS) || !heaps[heap].used || (size == 0))
+		return NULL;
+
+	size = sizeof(heap_block_t) + ((size + HOST_HEAP_ALIGN - 1) & ~(HOST_HEAP_ALIGN - 1));
+
+	pthread_mutex_lock(&host_lock);
+	ptr = heaps[heap].base;
+	end = ptr + heaps[heap].size;
+	while (ptr < end) {
+		blk = (heap_block_t *)ptr;
+		if (!blk->used) {
+			/* Coalesce with the following free blocks */
+			while ((ptr + blk->size < end) && !((heap_block_t *)(ptr + blk->size))->used)
+				blk->size += ((heap_block_t *)(ptr + blk->size))->size;
+			if (blk->size >= size) {
+				if (blk->size - size >= 2 * sizeof(heap_block_t)) {
+					next = (heap_block_t *)(ptr + size);
+					next->size = blk->size - size;
+					next->used = false;
+					blk->size = size;
+				}
+				blk->used = true;
+				ret = blk + 1;
+				break;
+			}
+		}
+		ptr += blk->size;
+	}
+	pthread_mutex_unlock(&host_lock);
+
+	return ret;
+}
+
+void *os_heap_alloc_aligned(s32 heap, s32 size, s32 align)
+{
+	/* Every block is already HOST_HEAP_ALIGN-aligned */
+	if (align > HOST_HEAP_ALIGN)
+		return NULL;
+	return os_heap_alloc(heap, size);
+}
+
+void os_heap_free(s32 heap, void *ptr)
+{
+	if (!ptr)
+		return;
+
+	pthread_mutex_lock(&host_lock);
+	((heap_block_t *)ptr - 1)->used = false;
+	pthread_mutex_unlock(&host_lock);
+}
+
+/* Timers: one thread per timer, sending the message to the queue on expiration */
+
+static struct {
+	bool used;
+	bool armed;
+	u64 deadline;
+	u64 period;
+	s32 queue;
+	s32 message;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+} timers[HOST_MAX_TIMERS];
+
+static void *timer_thread(void *arg)
+{
+	int id = (intptr_t)arg;
+	struct timespec ts;
+	u64 deadline;
+
+	pthread_mutex_lock(&timers[id].lock);
+	while (timers[id].used) {
+		if (!timers[id].armed) {
+			pthread_cond_wait(&timers[id].changed, &timers[id].lock);
+			continue;
+		}
+
+		deadline = timers[id].deadline;
+		ts.tv_sec = deadline / 1000000000ull;
+		ts.tv_nsec = deadline % 1000000000ull;
+		pthread_mutex_unlock(&timers[id].lock);
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		pthread_mutex_lock(&timers[id].lock);
+
+		/* Stopped or restarted while we slept */
+		if (!timers[id].armed || (timers[id].deadline != deadline))
+			continue;
+
+		os_message_queue_send(timers[id].queue, (void *)(intptr_t)timers[id].message,
+				      IOS_MESSAGE_NOBLOCK);
+		if (timers[id].period)
+			timers[id].deadline += timers[id].period;
+		else
+			timers[id].armed = false;
+	}
+	pthread_mutex_unlock(&timers[id].lock);
+
+	return NULL;
+}
+
+s32 os_create_timer(s32 time_us, s32 repeat_time_us, s32 message_queue, s32 message)
+{
+	s32 ret = IOS_ENOMEM;
+
+	pthread_mutex_lock(&host_lock);
+	for (int i = 0; i < HOST_MAX_TIMERS; i++) {
+		if (timers[i].used)
+			continue;
+		timers[i].deadline = host_time_ns() + (u64)time_us * 1000;
+		timers[i].period = (u64)repeat_time_us * 1000;
+		timers[i].queue = message_queue;
+		timers[i].message = message;
+		timers[i].armed = true;
+		timers[i].used = true;
+		pthread_mutex_init(&timers[i].lock, NULL);
+		pthread_cond_init(&timers[i].changed, NULL);
+		if (pthread_create(&timers[i].thread, NULL, timer_thread, (void *)(intptr_t)i)) {
+			timers[i].used = false;
+			break;
+		}
+		ret = i;
+		break;
+	}
+	pthread_mutex_unlock(&host_lock);
+
+	return ret;
+}
+
+s32 os_restart_timer(s32 timer_id, s32 time_us, s32 repeat_time_us)
+{
+	if ((timer_id < 0) || (timer_id >= HOST_MAX_TIMERS) || !timers[timer_id].used)
+		return IOS_EINVAL;
+
+	pthread_mutex_lock(&timers[timer_id].lock);
+	timers[timer_id].deadline = host_time_ns() + (u64)time_us * 1000;
+	timers[timer_id].period = (u64)repeat_time_us * 1000;
+	timers[timer_id].armed = true;
+	pthread_cond_signal(&timers[timer_id].changed);
+	pthread_mutex_unlock(&timers[timer_id].lock);
+
+	return IOS_OK;
+}
+
+s32 os_stop_timer(s32 timer_id)
+{
+	if ((timer_id < 0) || (timer_id >= HOST_MAX_TIMERS) || !timers[timer_id].used)
+		return IOS_EINVAL;
+
+	pthread_mutex_lock(&timers[timer_id].lock);
+	timers[timer_id].armed = false;
+	pthread_cond_signal(&timers[timer_id].changed);
+	pthread_mutex_unlock(&timers[timer_id].lock);
+
+	return IOS_OK;
+}
+
+s32 os_destroy_timer(s32 time_id)
+{
+	if ((time_id < 0) || (time_id >= HOST_MAX_TIMERS) || !timers[time_id].used)
+		return IOS_EINVAL;
+
+	pthread_mutex_lock(&timers[time_id].lock);
+	timers[time_id].used = false;
+	timers[time_id].armed = false;
+	pthread_cond_signal(&timers[time_id].changed);
+	pthread_mutex_unlock(&timers[time_id].lock);
+	pthread_join(timers[time_id].thread, NULL);
+
+	return IOS_OK;
+}
+
+/* Threads */
+
+static struct {
+	bool used;
+	int (*entry)(void *arg);
+	void *arg;
+	pthread_t thread;
+} threads[HOST_MAX_THREADS];
+
+static void *thread_entry(void *arg)
+{
+	int id = (intptr_t)arg;
+	return (void *)(intptr_t)threads[id].entry(threads[id].arg);
+}
+
+s32 os_thread_continue(s32 id)
+{
+	if ((id < 0) || (id >= HOST_MAX_THREADS) || !threads[id].used)
+		return IOS_EINVAL;
+
+	if (pthread_create(&threads[id].thread, NULL, thread_entry, (void *)(intptr_t)id))
+		return IOS_ENOMEM;
+	pthread_detach(threads[id].thread);
+
+	return IOS_OK;
+}
+
+s32 os_thread_create(int (*entry)(void *arg), void *arg, void *stack, u32 stacksize, u32 priority,
+		     s32 autostart)
+{
+	s32 ret = IOS_ENOMEM;
+
+	pthread_mutex_lock(&host_lock);
+	for (int i = 0; i < HOST_MAX_THREADS; i++) {
+		if (threads[i].used)
+			continue;
+		threads[i].entry = entry;
+		threads[i].arg = arg;
+		threads[i].used = true;
+		ret = i;
+		break;
+	}
+	pthread_mutex_unlock(&host_lock);
+
+	if ((ret >= 0) && autostart)
+		os_thread_continue(ret);
+
+	return ret;
+}
+
+/* Resource managers: there are no devices on the host */
+
+s32 os_open(const char *device, s32 mode)
+{
+	return IOS_ENOENT;
+}
+
+s32 os_close(s32 fd)
+{
+	return IOS_EINVAL;
+}
+
+s32 os_read(s32 fd, void *d, s32 len)
+{
+	return IOS_EINVAL;
+}
+
+s32 os_write(s32 fd, void *s, s32 len)
+{
+	return IOS_EINVAL;
+}
+
+s32 os_ioctl(s32 fd, s32 request, void *in, s32 bytes_in, void *out, s32 bytes_out)
+{
+	return IOS_EINVAL;
+}
+
+s32 os_ioctlv(s32 fd, s32 request, s32 bytes_in, s32 bytes_out, ioctlv *vector)
+{
+	return IOS_EINVAL;
+}
+
+s32 os_ioctl_async(s32 fd, s32 request, void *in, s32 bytes_in, void *out, s32 bytes_out, ...)
+{
+	return IOS_EINVAL;
+}
+
+s32 os_ioctlv_async(s32 fd, s32 request, s32 bytes_in, s32 bytes_out, ioctlv *vector, ...)
+{
+	return IOS_EINVAL;
+}
+
+/* Caches are coherent on the host */
+
+void __os_sync_before_read(void *ptr, s32 size)
+{
+	__sync_synchronize();
+}
+
+void __os_sync_after_write(void *ptr, s32 size)
+{
+	__sync_synchronize();
+}
+
+void DCInvalidateRange(void *ptr, int size)
+{
+	__sync_synchronize();
+}
+
+void DCFlushRange(void *ptr, int size)
+{
+	__sync_synchronize();
+}
+
+void svc_write(const char *str)
+{
+	fputs(str, stderr);
+}
+
+/* There is no OH1 module to patch on the host: the caller creates its own
+ * queue and stores it to orig_msg_queueid before driving the hooks. */
+s32 IOS_InitSystem(patcher patchers[], u32 size)
+{
+	return 0;
+}
@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include "fake_wiimote_mgr.h"
+#include "utils.h"
+#include "wii_bt.h"
+
+/* A fake Wiimote connects while the Wii has no ACL buffer posted and the injected messages
+ * are exhausted, so its HID channel connection requests can't be sent. They must be sent
+ * again once the Wii posts buffers, for the HID channels setup to complete. */
+
+#define TIMEOUT_NS	(2 * 1000 * 1000 * 1000ull)
+#define LINK_WAIT_NS	(100 * 1000 * 1000ull)
+/* Not a connection of the emulated Wii, which drops these packets */
+#define JUNK_CON_HANDLE	0x0abc
+#define JUNK_CID	0x0040
+
+static bool connected(void *arg)
+{
+	return wii_bt_get_wiimote(0)->connected;
+}
+
+static bool input_ready(void *arg)
+{
+	return wii_bt_get_wiimote(0)->input_ready;
+}
+
+int main(void)
+{
+	static const input_device_ops_t input_ops;
+	wii_bt_config_t config = {
+		.intr_buffers = 2,
+	};
+	static const u8 junk[16];
+	u32 queued = 0;
+
+	wii_bt_init(&config);
+	wii_bt_enable_page_scan(true);
+
+	/* Fill whatever runs out first, the ReadyQ or the injected messages */
+	while (l2cap_send_msg(JUNK_CON_HANDLE, JUNK_CID, junk, sizeof(junk)) == IOS_OK)
+		queued++;
+
+	fake_wiimote_mgr_add_input_device(NULL, &input_ops);
+	if (!wii_bt_run(TIMEOUT_NS, connected, NULL)) {
+		printf("FAIL: the fake Wiimote did not connect\n");
+		return 1;
+	}
+	/* Let a few ticks try to link */
+	wii_bt_run(LINK_WAIT_NS, input_ready, NULL);
+
+	wii_bt_post_buffers(EP_ACL_DATA_IN, 4);
+	if (!wii_bt_run(TIMEOUT_NS, input_ready, NULL)) {
+		printf("FAIL: no input report once the Wii posted buffers (HID ready: %d)\n",
+		       wii_bt_get_wiimote(0)->hid_ready);
+		return 1;
+	}
+
+	printf("OK: HID channels set up after %u queued messages were delivered\n", queued);
+	return 0;
+}
@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <string.h>
+#include "fake_wiimote_mgr.h"
+#include "wii_bt.h"
+
+/* A fake Wiimote connects to the emulated Wii, goes through the WPAD handshake and delivers
+ * its input. The connection request and the data reports are sent from the periodic timer
+ * tick, so this also checks that the tick reaches the OH1 thread. */
+
+#define TIMEOUT_NS	(2 * 1000 * 1000 * 1000ull)
+#define TEST_BUTTONS	0x0208
+
+static bool assigned;
+
+static int input_assigned(void *usrdata, fake_wiimote_t *wiimote)
+{
+	assigned = true;
+	return 0;
+}
+
+static const input_device_ops_t input_ops = {
+	.assigned = input_assigned,
+};
+
+static bool input_ready(void *arg)
+{
+	return wii_bt_get_wiimote(0)->input_ready;
+}
+
+static bool buttons_reported(void *arg)
+{
+	const wii_bt_wiimote_t *wm = wii_bt_get_wiimote(0);
+	u16 buttons;
+
+	memcpy(&buttons, wm->last_data_report, sizeof(buttons));
+	return buttons == TEST_BUTTONS;
+}
+
+int main(void)
+{
+	wii_bt_config_t config = {
+		.intr_buffers = 2,
+		.bulk_in_buffers = 4,
+	};
+	fake_wiimote_t *wiimote;
+
+	wii_bt_init(&config);
+	wii_bt_enable_page_scan(true);
+
+	wiimote = fake_wiimote_mgr_add_input_device(NULL, &input_ops);
+	if (!wiimote) {
+		printf("FAIL: no fake Wiimote available\n");
+		return 1;
+	}
+
+	if (!wii_bt_run(TIMEOUT_NS, input_ready, NULL)) {
+		printf("FAIL: no input report from the fake Wiimote (connected: %d, HID ready: %d)\n",
+		       wii_bt_get_wiimote(0)->connected, wii_bt_get_wiimote(0)->hid_ready);
+		return 1;
+	}
+	if (!assigned) {
+		printf("FAIL: the input device was not assigned to the fake Wiimote\n");
+		return 1;
+	}
+
+	fake_wiimote_mgr_report_input(wiimote, TEST_BUTTONS);
+	if (!wii_bt_run(TIMEOUT_NS, buttons_reported, NULL)) {
+		printf("FAIL: input change not reported\n");
+		return 1;
+	}
+
+	printf("OK: connected and reporting in %.1f ms\n",
+	       (wii_bt_get_wiimote(0)->input_ready_ns - wii_bt_get_wiimote(0)->con_req_ns) / 1e6);
+	return 0;
+}
@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <string.h>
+#include "wiimote_crypto_ref.h"
+
+/* wiimote_crypto_encrypt() against known answers and against the byte at a time reference.
+ * The known answers were computed with Dolphin's encryption loop, on key data that matches
+ * the key generated for three different sbox indices, at aligned and unaligned addresses. */
+
+static const struct {
+	u8 key_data[16];
+	u32 addr;
+	u32 size;
+	u8 plain[21];
+	u8 cipher[21];
+} vectors[] = {
+	{
+		.key_data = { 0x37, 0x8a, 0x19, 0xc2, 0x5e, 0x04, 0xb1, 0x7d,
+			      0xe3, 0x60, 0xb6, 0x5a, 0x80, 0xb6, 0xde, 0xf6 },
+		.addr = 0x00,
+		.size = 16,
+		.plain = { 0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+			   0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff },
+		.cipher = { 0x96, 0xf9, 0x12, 0x9d, 0xa7, 0x32, 0xb1, 0xde,
+			    0x0e, 0x71, 0xaa, 0x15, 0x2f, 0xba, 0x09, 0x46 },
+	},
+	{
+		.key_data = { 0x9c, 0x21, 0x4f, 0xd8, 0x03, 0x76, 0xaa, 0x15,
+			      0x6b, 0xf0, 0x31, 0xde, 0x60, 0xf2, 0x1d, 0xf9 },
+		.addr = 0x08,
+		.size = 21,
+		.plain = { 0x01, 0x12, 0x23, 0x34, 0x45, 0x56, 0x67, 0x78, 0x89, 0x9a, 0xab,
+			   0xbc, 0xcd, 0xde, 0xef, 0x00, 0x11, 0x22, 0x33, 0x44, 0x55 },
+		.cipher = { 0x59, 0x40, 0x4e, 0xc6, 0x7c, 0x5f, 0xe1, 0xea, 0xd1, 0xd8, 0xd6,
+			    0x4e, 0xf4, 0xe7, 0x69, 0x72, 0x49, 0x50, 0x5e, 0xd6, 0x6c },
+	},
+	{
+		.key_data = { 0x52, 0xe7, 0x0d, 0x98, 0x3c, 0xc1, 0x6f, 0xa4,
+			      0x11, 0x8e, 0x3d, 0xc4, 0xbc, 0x53, 0x05, 0xa4 },
+		.addr = 0xfd,
+		.size = 6,
+		.plain = { 0x02, 0x13, 0x24, 0x35, 0x46, 0x57 },
+		.cipher = { 0x2d, 0x2c, 0x85, 0xf1, 0x92, 0x12 },
+	},
+};
+
+#define MAX_SIZE	64
+#define GUARD		8
+#define GUARD_BYTE	0xa5
+
+static unsigned failures;
+
+#define CHECK(cond, fmt, ...)						\
+	do {								\
+		if (!(cond) && (failures++ < 10))			\
+			printf("FAIL: " fmt "\n", __VA_ARGS__);	\
+	} while (0)
+
+static void test_vectors(void)
+{
+	struct wiimote_encryption_key_t key;
+	u8 data[sizeof(vectors[0].plain)];
+
+	for (int v = 0; v < sizeof(vectors) / sizeof(vectors[0]); v++) {
+		wiimote_crypto_generate_key_from_extension_key_data(&key, vectors[v].key_data);
+		memcpy(data, vectors[v].plain, vectors[v].size);
+		wiimote_crypto_encrypt(data, &key, vectors[v].addr, vectors[v].size);
+		CHECK(!memcmp(data, vectors[v].cipher, vectors[v].size), "vector %d", v);
+	}
+}
+
+/* Every size, starting address (modulo the table size) and buffer alignment */
+static void test_against_ref(void)
+{
+	struct wiimote_encryption_key_t key;
+	u8 buf[GUARD + 4 + MAX_SIZE + GUARD], ref[sizeof(buf)];
+
+	wiimote_crypto_generate_key_from_extension_key_data(&key, vectors[1].key_data);
+
+	for (u32 size = 0; size <= MAX_SIZE; size++) {
+		for (u32 addr = 0; addr < 8; addr++) {
+			for (int align = 0; align < 4; align++) {
+				for (int i = 0; i < sizeof(buf); i++)
+					buf[i] = ref[i] = (i < GUARD + align) ? GUARD_BYTE : i * 37 + size;
+				wiimote_crypto_encrypt(&buf[GUARD + align], &key, addr, size);
+				wiimote_crypto_encrypt_ref(&ref[GUARD + align], &key, addr, size);
+				CHECK(!memcmp(buf, ref, sizeof(buf)), "size %u, address %u, alignment %d",
+				      size, addr, align);
+			}
+		}
+	}
+}
+
+int main(void)
+{
+	test_vectors();
+	test_against_ref();
+
+	if (failures) {
+		printf("FAIL: %u mismatches\n", failures);
+		return 1;
+	}
+
+	printf("OK: extension encryption matches the known answers and the byte loop\n");
+	return 0;
+}
@@ -0,0 +1,136 @@
+#include <signal.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include "fake_wiimote_mgr.h"
+#include "l2cap.h"
+#include "wii_bt.h"
+
+/* The USB HID worker writes the input state of a fake Wiimote while the OH1 thread, which has
+ * a higher priority, reads it for the data reports (seqlock). On the Wii the OH1 thread can
+ * preempt the worker anywhere, including in the middle of an update. Here a timer signal
+ * preempts the writer loop the same way and runs the OH1 side (tick and pump) from the
+ * handler. Every input update is internally consistent: the buttons n and the extension
+ * bytes n, n + 1, ... A report mixing two updates means a torn read got through. */
+
+#define TIMEOUT_NS	(2 * 1000 * 1000 * 1000ull)
+#define REPORTS		20000
+#define TICK_US		50
+#define EXT_BYTES	16
+#define WRITE_DELAY	50
+
+static fake_wiimote_t *wiimote;
+static volatile u32 reports;
+static u32 changes, torn;
+static u8 last_ext0;
+
+static void check_report(const void *data, u32 length)
+{
+	const hci_acldata_hdr_t *acl = data;
+	const l2cap_hdr_t *l2cap = (const void *)(acl + 1);
+	const u8 *payload = (const u8 *)(l2cap + 1);
+	const u8 *ext;
+
+	if ((length < sizeof(*acl) + sizeof(*l2cap) + 2 + 5 + EXT_BYTES) ||
+	    (payload[0] != ((HID_TYPE_DATA << 4) | HID_PARAM_INPUT)) ||
+	    (payload[1] != INPUT_REPORT_ID_BTN_ACC_EXP))
+		return;
+
+	/* Buttons (2), accelerometer (3), extension (16) */
+	ext = &payload[2 + 5];
+	reports++;
+	if (ext[0] != last_ext0) {
+		changes++;
+		last_ext0 = ext[0];
+	}
+	if (payload[2] != ext[0]) {
+		torn++;
+		return;
+	}
+	for (int i = 1; i < EXT_BYTES; i++) {
+		if (ext[i] != (u8)(ext[0] + i)) {
+			torn++;
+			return;
+		}
+	}
+}
+
+static void report_input(u32 n)
+{
+	u8 ext[EXT_BYTES];
+
+	for (int i = 0; i < EXT_BYTES; i++)
+		ext[i] = n + i;
+	fake_wiimote_mgr_report_input_ext(wiimote, n, ext, sizeof(ext));
+}
+
+static void oh1_preempt(int sig)
+{
+	fake_wiimote_mgr_tick_devices();
+	wii_bt_pump();
+}
+
+static bool input_ready(void *arg)
+{
+	return wii_bt_get_wiimote(0)->input_ready;
+}
+
+int main(void)
+{
+	static const input_device_ops_t input_ops;
+	wii_bt_config_t config = {
+		.intr_buffers = 2,
+		.bulk_in_buffers = 4,
+		.acl_data = check_report,
+	};
+	struct itimerval timer = {
+		.it_interval = { .tv_usec = TICK_US },
+		.it_value = { .tv_usec = TICK_US },
+	};
+	sigset_t alarm;
+
+	/* Only this thread plays the USB HID worker, not the ones of the host emulation */
+	sigemptyset(&alarm);
+	sigaddset(&alarm, SIGALRM);
+	pthread_sigmask(SIG_BLOCK, &alarm, NULL);
+
+	wii_bt_init(&config);
+	wii_bt_enable_page_scan(true);
+	wiimote = fake_wiimote_mgr_add_input_device(NULL, &input_ops);
+	/* The extension makes the emulated Wii ask for continuous reports with extension data */
+	fake_wiimote_mgr_set_extension(wiimote, WIIMOTE_MGR_EXT_NUNCHUK);
+	if (!wii_bt_run(TIMEOUT_NS, input_ready, NULL)) {
+		printf("FAIL: the fake Wiimote did not connect\n");
+		return 1;
+	}
+
+	/* Start from a consistent input state, once the reports already sent are delivered */
+	report_input(0);
+	fake_wiimote_mgr_tick_devices();
+	wii_bt_pump();
+	reports = 0;
+	torn = 0;
+
+	signal(SIGALRM, oh1_preempt);
+	setitimer(ITIMER_REAL, &timer, NULL);
+	pthread_sigmask(SIG_UNBLOCK, &alarm, NULL);
+	for (u32 n = 1; reports < REPORTS; n++) {
+		report_input(n);
+		/* Like a USB HID device, leave some time between the updates */
+		for (volatile int i = 0; i < WRITE_DELAY; i++)
+			;
+	}
+	pthread_sigmask(SIG_BLOCK, &alarm, NULL);
+
+	if (torn) {
+		printf("FAIL: %u of %u reports mix two input updates\n", torn, reports);
+		return 1;
+	}
+	/* The ticks that catch the writer in the middle of an update keep the previous snapshot */
+	if (changes < REPORTS / 10) {
+		printf("FAIL: only %u input changes reported in %u reports\n", changes, reports);
+		return 1;
+	}
+
+	printf("OK: %u reports, %u input changes, none torn\n", reports, changes);
+	return 0;
+}
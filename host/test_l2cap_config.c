@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <string.h>
+#include "fake_wiimote_mgr.h"
+#include "utils.h"
+#include "wii_bt.h"
+
+/* The emulated Wii sends a configuration request with more options than a configuration
+ * response can echo. The fake Wiimote must answer on the right channel, with the options
+ * that fit, copied from the request. */
+
+#define TIMEOUT_NS	(2 * 1000 * 1000 * 1000ull)
+#define OPTIONS_SIZE	300
+#define CFG_REQ_IDENT	0x42
+
+static u8 options[OPTIONS_SIZE];
+static u8 rsp_options[OPTIONS_SIZE];
+static u16 rsp_options_size;
+static u16 rsp_scid;
+static bool rsp_received;
+
+static void acl_data(const void *data, u32 length)
+{
+	const hci_acldata_hdr_t *acl = data;
+	const l2cap_hdr_t *l2cap = (const void *)(acl + 1);
+	const l2cap_cmd_hdr_t *cmd = (const void *)(l2cap + 1);
+	const l2cap_cfg_rsp_cp *rsp = (const void *)(cmd + 1);
+	u16 cmd_len;
+
+	if ((le16toh(l2cap->dcid) != L2CAP_SIGNAL_CID) || (cmd->code != L2CAP_CONFIG_RSP) ||
+	    (cmd->ident != CFG_REQ_IDENT))
+		return;
+
+	cmd_len = le16toh(cmd->length);
+	rsp_scid = le16toh(rsp->scid);
+	rsp_options_size = cmd_len - sizeof(*rsp);
+	memcpy(rsp_options, rsp + 1, rsp_options_size);
+	rsp_received = true;
+}
+
+static bool input_ready(void *arg)
+{
+	return wii_bt_get_wiimote(0)->input_ready;
+}
+
+static bool config_rsp_received(void *arg)
+{
+	return rsp_received;
+}
+
+int main(void)
+{
+	static const input_device_ops_t input_ops;
+	wii_bt_config_t config = {
+		.intr_buffers = 2,
+		.bulk_in_buffers = 4,
+		.acl_data = acl_data,
+	};
+	u8 buf[sizeof(l2cap_cmd_hdr_t) + sizeof(l2cap_cfg_req_cp) + OPTIONS_SIZE];
+	l2cap_cmd_hdr_t *cmd = (void *)buf;
+	l2cap_cfg_req_cp *req = (void *)(cmd + 1);
+	const wii_bt_wiimote_t *wm = wii_bt_get_wiimote(0);
+	u32 offset = 0;
+
+	wii_bt_init(&config);
+	wii_bt_enable_page_scan(true);
+	fake_wiimote_mgr_add_input_device(NULL, &input_ops);
+	if (!wii_bt_run(TIMEOUT_NS, input_ready, NULL)) {
+		printf("FAIL: the fake Wiimote did not connect\n");
+		return 1;
+	}
+
+	/* The MTU, then unknown options of 2 bytes */
+	options[offset++] = L2CAP_OPT_MTU;
+	options[offset++] = L2CAP_OPT_MTU_SIZE;
+	options[offset++] = 0xb9;
+	options[offset++] = 0x00;
+	for (; offset < OPTIONS_SIZE; offset += 4) {
+		options[offset] = 0x70 + (offset / 4) % 8;
+		options[offset + 1] = 2;
+		options[offset + 2] = offset;
+		options[offset + 3] = offset >> 8;
+	}
+
+	cmd->code = L2CAP_CONFIG_REQ;
+	cmd->ident = CFG_REQ_IDENT;
+	cmd->length = htole16(sizeof(*req) + OPTIONS_SIZE);
+	req->dcid = htole16(wm->cntl_remote_cid);
+	req->flags = 0;
+	memcpy(req + 1, options, OPTIONS_SIZE);
+	wii_bt_send_acl(wm->con_handle, L2CAP_SIGNAL_CID, buf, sizeof(buf));
+
+	if (!wii_bt_run(TIMEOUT_NS, config_rsp_received, NULL)) {
+		printf("FAIL: no configuration response\n");
+		return 1;
+	}
+	if (rsp_scid != wm->cntl_cid) {
+		printf("FAIL: configuration response for CID 0x%x, expected 0x%x\n", rsp_scid,
+		       wm->cntl_cid);
+		return 1;
+	}
+	if ((rsp_options_size == 0) || (rsp_options_size > L2CAP_CFG_RSP_MAX_OPTIONS) ||
+	    memcmp(rsp_options, options, rsp_options_size)) {
+		printf("FAIL: %u bytes of options echoed, not a prefix of the request's\n",
+		       rsp_options_size);
+		return 1;
+	}
+
+	printf("OK: %u of %u bytes of options echoed\n", rsp_options_size, OPTIONS_SIZE);
+	return 0;
+}
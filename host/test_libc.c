@@ -0,0 +1,114 @@
+#include "libc_variants.h"
+
+/* The word at a time memcpy, memset and memcmp of source/libc.c against the byte loops they
+ * replaced, for every size up to 4096 bytes and every source/destination alignment pair.
+ * Guard bytes around the destination catch writes out of bounds. */
+
+#define MAX_SIZE	4096
+#define ALIGNMENTS	4
+#define GUARD		16
+#define GUARD_BYTE	0xa5
+
+static unsigned char buf1[GUARD + ALIGNMENTS + MAX_SIZE + GUARD] __attribute__((aligned(16)));
+static unsigned char buf2[GUARD + ALIGNMENTS + MAX_SIZE + GUARD] __attribute__((aligned(16)));
+static unsigned char ref[GUARD + ALIGNMENTS + MAX_SIZE + GUARD] __attribute__((aligned(16)));
+static unsigned failures;
+
+#define CHECK(cond, fmt, ...)						\
+	do {								\
+		if (!(cond) && (failures++ < 10))			\
+			printf("FAIL: " fmt "\n", __VA_ARGS__);	\
+	} while (0)
+
+static void fill_pattern(unsigned char *p, size_t n, unsigned seed)
+{
+	for (size_t i = 0; i < n; i++)
+		p[i] = (i * 131 + seed * 7 + 1) & 0xff;
+}
+
+/* The part of the buffers a call of size n can touch, guards included */
+#define SPAN(n)		(GUARD + ALIGNMENTS + (n) + GUARD)
+
+static void test_memcpy(size_t n, int da, int sa)
+{
+	unsigned char *d = &buf1[GUARD + da];
+	const unsigned char *s = &buf2[GUARD + sa];
+
+	memset(buf1, GUARD_BYTE, SPAN(n));
+	memset(ref, GUARD_BYTE, SPAN(n));
+	fill_pattern(buf2, SPAN(n), n);
+	byte_memcpy(&ref[GUARD + da], s, n);
+
+	CHECK(word_memcpy(d, s, n) == d, "memcpy(%zu, %d, %d) return value", n, da, sa);
+	CHECK(!memcmp(buf1, ref, SPAN(n)), "memcpy(%zu, %d, %d) contents", n, da, sa);
+}
+
+static void test_memset(size_t n, int da, int c)
+{
+	unsigned char *d = &buf1[GUARD + da];
+
+	memset(buf1, GUARD_BYTE, SPAN(n));
+	memset(ref, GUARD_BYTE, SPAN(n));
+	byte_memset(&ref[GUARD + da], c, n);
+
+	CHECK(word_memset(d, c, n) == d, "memset(%zu, %d, %#x) return value", n, da, c);
+	CHECK(!memcmp(buf1, ref, SPAN(n)), "memset(%zu, %d, %#x) contents", n, da, c);
+}
+
+static int sign(int v)
+{
+	return (v > 0) - (v < 0);
+}
+
+static void test_memcmp_at(size_t n, unsigned char *p1, unsigned char *p2, size_t pos)
+{
+	unsigned char saved = p2[pos];
+
+	/* Both ways, and with the high bit set so that the byte comparison must be unsigned */
+	p2[pos] = p1[pos] ^ 0x80;
+	CHECK(sign(word_memcmp(p1, p2, n)) == sign(byte_memcmp(p1, p2, n)),
+	      "memcmp(%zu) difference at %zu", n, pos);
+	CHECK(sign(word_memcmp(p2, p1, n)) == sign(byte_memcmp(p2, p1, n)),
+	      "memcmp(%zu) difference at %zu, swapped", n, pos);
+	p2[pos] = saved;
+}
+
+static void test_memcmp(size_t n, int a1, int a2)
+{
+	unsigned char *p1 = &buf1[GUARD + a1];
+	unsigned char *p2 = &buf2[GUARD + a2];
+
+	fill_pattern(p1, n, n);
+	memcpy(p2, p1, n);
+
+	CHECK(word_memcmp(p1, p2, n) == 0, "memcmp(%zu, %d, %d) of equal buffers", n, a1, a2);
+
+	/* A difference in every byte of the head and of the last word, and in the middle */
+	for (size_t pos = 0; pos < n && pos < 2 * sizeof(word_t); pos++)
+		test_memcmp_at(n, p1, p2, pos);
+	test_memcmp_at(n, p1, p2, n / 2);
+	for (size_t pos = n - 1; pos >= 2 * sizeof(word_t) && pos >= n - sizeof(word_t); pos--)
+		test_memcmp_at(n, p1, p2, pos);
+}
+
+int main(void)
+{
+	for (size_t n = 1; n <= MAX_SIZE; n++) {
+		for (int a1 = 0; a1 < ALIGNMENTS; a1++) {
+			test_memset(n, a1, 0);
+			test_memset(n, a1, 0x1ff);
+			for (int a2 = 0; a2 < ALIGNMENTS; a2++) {
+				test_memcpy(n, a1, a2);
+				test_memcmp(n, a1, a2);
+			}
+		}
+	}
+
+	if (failures) {
+		printf("FAIL: %u mismatches\n", failures);
+		return 1;
+	}
+
+	printf("OK: memcpy, memset and memcmp match the byte loops up to %d bytes\n", MAX_SIZE);
+	return 0;
+}
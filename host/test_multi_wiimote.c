@@ -0,0 +1,51 @@
+#include <stdio.h>
+#include "fake_wiimote_mgr.h"
+#include "wii_bt.h"
+
+/* Two fake Wiimotes connect at once, the second one with a Nunchuk. Each must report its
+ * own extension state in the status report of the WPAD handshake, which then picks the
+ * data reporting mode with or without extension bytes. */
+
+#define TIMEOUT_NS	(2 * 1000 * 1000 * 1000ull)
+
+static bool both_input_ready(void *arg)
+{
+	return wii_bt_get_wiimote(0)->input_ready && wii_bt_get_wiimote(1)->input_ready;
+}
+
+int main(void)
+{
+	static const input_device_ops_t input_ops;
+	wii_bt_config_t config = {
+		.intr_buffers = 2,
+		.bulk_in_buffers = 4,
+	};
+	fake_wiimote_t *wiimote;
+
+	wii_bt_init(&config);
+	wii_bt_enable_page_scan(true);
+
+	if (!fake_wiimote_mgr_add_input_device(NULL, &input_ops) ||
+	    !(wiimote = fake_wiimote_mgr_add_input_device(NULL, &input_ops))) {
+		printf("FAIL: no fake Wiimote available\n");
+		return 1;
+	}
+	fake_wiimote_mgr_set_extension(wiimote, WIIMOTE_MGR_EXT_NUNCHUK);
+
+	if (!wii_bt_run(TIMEOUT_NS, both_input_ready, NULL)) {
+		printf("FAIL: no input report from both fake Wiimotes (%d, %d)\n",
+		       wii_bt_get_wiimote(0)->input_ready, wii_bt_get_wiimote(1)->input_ready);
+		return 1;
+	}
+
+	for (int i = 0; i < 2; i++) {
+		if (wii_bt_get_wiimote(i)->wpad_extension != (i == 1)) {
+			printf("FAIL: fake Wiimote %d reported %s extension\n", i,
+			       wii_bt_get_wiimote(i)->wpad_extension ? "an" : "no");
+			return 1;
+		}
+	}
+
+	printf("OK: both fake Wiimotes reported their own extension state\n");
+	return 0;
+}
@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include "fake_wiimote_mgr.h"
+#include "utils.h"
+#include "wii_bt.h"
+
+/* The emulated Wii reads the EEPROM while the bulk in ReadyQ is full, so the first read data
+ * reply can't be sent. It must be sent again on a later tick, without losing any data. */
+
+#define TIMEOUT_NS	(2 * 1000 * 1000 * 1000ull)
+#define READ_SIZE	0x40
+#define REPLIES		(READ_SIZE / 16)
+/* Not a connection of the emulated Wii, which drops these packets */
+#define JUNK_CON_HANDLE	0x0abc
+#define JUNK_CID	0x0040
+
+static u16 reply_addresses[REPLIES + 1];
+static u32 replies, bad_replies;
+
+static void acl_data(const void *data, u32 length)
+{
+	const hci_acldata_hdr_t *acl = data;
+	const l2cap_hdr_t *l2cap = (const void *)(acl + 1);
+	const u8 *payload = (const u8 *)(l2cap + 1);
+	const struct wiimote_input_report_read_data_t *reply = (const void *)&payload[2];
+
+	if ((le16toh(l2cap->dcid) != wii_bt_get_wiimote(0)->intr_cid) ||
+	    (payload[1] != INPUT_REPORT_ID_READ_DATA_REPLY))
+		return;
+
+	if (reply->error || (reply->size_minus_one != 15))
+		bad_replies++;
+	if (replies < ARRAY_SIZE(reply_addresses))
+		reply_addresses[replies] = reply->address;
+	replies++;
+}
+
+static bool input_ready(void *arg)
+{
+	return wii_bt_get_wiimote(0)->input_ready;
+}
+
+static bool mode_acked(void *arg)
+{
+	return wii_bt_get_wiimote(0)->acks > 0;
+}
+
+static bool all_replies(void *arg)
+{
+	return replies >= REPLIES;
+}
+
+int main(void)
+{
+	static const input_device_ops_t input_ops;
+	static const u8 junk[16];
+	wii_bt_config_t config = {
+		.intr_buffers = 2,
+		.bulk_in_buffers = 4,
+		.acl_data = acl_data,
+	};
+	struct wiimote_output_report_mode_t mode = { 0 };
+	struct wiimote_output_report_read_data_t read = { 0 };
+
+	wii_bt_init(&config);
+	wii_bt_enable_page_scan(true);
+	fake_wiimote_mgr_add_input_device(NULL, &input_ops);
+	if (!wii_bt_run(TIMEOUT_NS, input_ready, NULL)) {
+		printf("FAIL: the fake Wiimote did not connect\n");
+		return 1;
+	}
+
+	/* No continuous reporting, so that the fake Wiimote stays quiet */
+	mode.ack = 1;
+	mode.mode = INPUT_REPORT_ID_BTN;
+	wii_bt_send_output_report(0, OUTPUT_REPORT_ID_REPORT_MODE, &mode, sizeof(mode));
+	wii_bt_run(TIMEOUT_NS, mode_acked, NULL);
+	/* Leave out the replies of the handshake */
+	replies = bad_replies = 0;
+
+	/* The read request is queued to the OH1 thread before the buffers that the Wii posts
+	 * again once the junk below fills them */
+	read.space = ADDRESS_SPACE_EEPROM;
+	read.address = 0;
+	read.size = READ_SIZE;
+	wii_bt_send_output_report(0, OUTPUT_REPORT_ID_READ_DATA, &read, sizeof(read));
+	while (l2cap_send_msg(JUNK_CON_HANDLE, JUNK_CID, junk, sizeof(junk)) == IOS_OK)
+		;
+
+	if (!wii_bt_run(TIMEOUT_NS, all_replies, NULL)) {
+		printf("FAIL: %u read data replies out of %u\n", replies, REPLIES);
+		return 1;
+	}
+	/* Let a few more ticks run, in case the reply was sent twice */
+	wii_bt_run(TIMEOUT_NS / 20, all_replies, NULL);
+
+	if (replies != REPLIES || bad_replies) {
+		printf("FAIL: %u read data replies (%u bad), expected %u\n", replies, bad_replies,
+		       REPLIES);
+		return 1;
+	}
+	for (int i = 0; i < REPLIES; i++) {
+		if (reply_addresses[i] != i * 16) {
+			printf("FAIL: reply %d for address 0x%x, expected 0x%x\n", i,
+			       reply_addresses[i], i * 16);
+			return 1;
+		}
+	}
+
+	printf("OK: %u read data replies, none lost\n", replies);
+	return 0;
+}
@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <string.h>
+#include "utils.h"
+#include "wii_bt.h"
+
+/* Real HCI events from the dongle share the Wii's single event buffer with injected ones.
+ * The module has one hand down message for the events, which is completed by the dongle as
+ * soon as it's handed down, so it often has to wait on the real ReadyQ while an injected
+ * event takes the buffer. Every real event must reach the Wii once and in order, and the
+ * delivered counters must match what the Wii got, including the events built in place. */
+
+#define REAL_EVENTS	2000
+#define ROUNDS		(2 * REAL_EVENTS)
+#define REAL_ROUNDS	(REAL_EVENTS * (READY_WEIGHT_REAL + READY_WEIGHT_INJECTED) / READY_WEIGHT_REAL)
+
+static u32 real_sent, real_received, injected_sent, injected_received;
+static unsigned failures;
+
+#define CHECK(cond, fmt, ...)						\
+	do {								\
+		if (!(cond) && (failures++ < 10))			\
+			printf("FAIL: " fmt "\n", __VA_ARGS__);	\
+	} while (0)
+
+/* Vendor events carrying a sequence number, until REAL_EVENTS are out */
+static s32 dongle_read(u8 endpoint, void *data, u16 length)
+{
+	hci_event_hdr_t *hdr = data;
+
+	if ((endpoint != EP_HCI_EVENT) || (real_sent == REAL_EVENTS))
+		return 0;
+
+	hdr->event = HCI_EVENT_VENDOR;
+	hdr->length = sizeof(real_sent);
+	memcpy(hdr + 1, &real_sent, sizeof(real_sent));
+	real_sent++;
+	return sizeof(*hdr) + sizeof(real_sent);
+}
+
+static void hci_event(const void *data, u32 length)
+{
+	const hci_event_hdr_t *hdr = data;
+	u32 seq;
+
+	if (hdr->event == HCI_EVENT_COMMAND_STATUS) {
+		injected_received++;
+	} else if (hdr->event == HCI_EVENT_VENDOR) {
+		memcpy(&seq, hdr + 1, sizeof(seq));
+		CHECK(seq == real_received, "real event %u received as number %u", seq, real_received);
+		real_received++;
+	}
+}
+
+int main(void)
+{
+	wii_bt_config_t config = {
+		.intr_buffers = 1,
+		.no_repost = true,
+		.hci_event = hci_event,
+		.dongle_read = dongle_read,
+	};
+	ready_queue_stats_t stats;
+
+	wii_bt_init(&config);
+
+	/* One injected event and one host buffer per round, twice as many events as buffers
+	 * while the dongle has some */
+	for (int i = 0; i < ROUNDS; i++) {
+		if (enqueue_hci_event_command_status(HCI_CMD_RESET) == IOS_OK)
+			injected_sent++;
+		wii_bt_post_buffers(EP_HCI_EVENT, 1);
+		wii_bt_pump();
+	}
+	/* Drain the injected events left, then leave a buffer waiting on the PendingQ for the
+	 * last ones, which are built in place */
+	for (int i = 0; (i < ROUNDS) && (injected_received < injected_sent); i++) {
+		wii_bt_post_buffers(EP_HCI_EVENT, 1);
+		wii_bt_pump();
+	}
+	/* The real events get READY_WEIGHT_REAL buffers of every round */
+	for (int i = 0; i < REAL_ROUNDS; i++) {
+		wii_bt_post_buffers(EP_HCI_EVENT, 1);
+		wii_bt_pump();
+		if (enqueue_hci_event_command_status(HCI_CMD_RESET) == IOS_OK)
+			injected_sent++;
+	}
+	/* With a heavier injected weight, the real events can be out first */
+	for (int i = 0; (i < ROUNDS) && (injected_received < injected_sent); i++) {
+		wii_bt_post_buffers(EP_HCI_EVENT, 1);
+		wii_bt_pump();
+	}
+
+	CHECK(real_received == REAL_EVENTS, "%u real events received out of %u", real_received,
+	      REAL_EVENTS);
+	CHECK(injected_received == injected_sent, "%u injected events received out of %u",
+	      injected_received, injected_sent);
+
+	ready_queue_get_stats(&stats);
+	CHECK(stats.delivered[READY_CLASS_REAL_HCI_EVENT] == real_received,
+	      "%u real events delivered, %u received", stats.delivered[READY_CLASS_REAL_HCI_EVENT],
+	      real_received);
+	CHECK(stats.delivered[READY_CLASS_HCI_EVENT] == injected_received,
+	      "%u injected events delivered, %u received", stats.delivered[READY_CLASS_HCI_EVENT],
+	      injected_received);
+
+	if (failures) {
+		printf("FAIL: %u mismatches\n", failures);
+		return 1;
+	}
+
+	printf("OK: %u real and %u injected events delivered once and in order\n", real_received,
+	       injected_received);
+	return 0;
+}
@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <string.h>
+#include "utils.h"
+#include "wii_bt.h"
+
+/* The dongle always has a real HCI event for the module, and the injected event ReadyQ is kept
+ * full, so both sources always wait for the Wii's single event buffer. Deficit round-robin must
+ * share the buffers between them as READY_WEIGHT_REAL:READY_WEIGHT_INJECTED, starving neither.
+ * A real event waiting on the ReadyQ still owns its hand down message, so no read may be
+ * handed down to the dongle into its buffer before it's delivered. */
+
+#define WARMUP_ROUNDS	16
+#define ROUNDS		3000
+#define MAX_BUFFERS	4
+
+static u32 real_sent, real_received, injected_received;
+/* Real event last written into each buffer the dongle has seen */
+static struct {
+	void *data;
+	u32 seq;
+} buffers[MAX_BUFFERS];
+static u32 waited_rounds;
+static unsigned failures;
+
+#define CHECK(cond, fmt, ...)						\
+	do {								\
+		if (!(cond) && (failures++ < 10))			\
+			printf("FAIL: " fmt "\n", __VA_ARGS__);	\
+	} while (0)
+
+static s32 dongle_read(u8 endpoint, void *data, u16 length)
+{
+	hci_event_hdr_t *hdr = data;
+	int i;
+
+	if (endpoint != EP_HCI_EVENT)
+		return 0;
+
+	for (i = 0; (i < MAX_BUFFERS) && buffers[i].data && (buffers[i].data != data); i++)
+		;
+	if (i == MAX_BUFFERS) {
+		printf("FAIL: more than %d hand down buffers\n", MAX_BUFFERS);
+		failures++;
+		return 0;
+	}
+	CHECK(!buffers[i].data || (buffers[i].seq < real_received),
+	      "read handed down while real event %u still waits in its buffer", buffers[i].seq);
+	buffers[i].data = data;
+	buffers[i].seq = real_sent;
+
+	hdr->event = HCI_EVENT_VENDOR;
+	hdr->length = sizeof(real_sent);
+	memcpy(hdr + 1, &real_sent, sizeof(real_sent));
+	real_sent++;
+	return sizeof(*hdr) + sizeof(real_sent);
+}
+
+static void hci_event(const void *data, u32 length)
+{
+	const hci_event_hdr_t *hdr = data;
+	u32 seq;
+
+	if (hdr->event == HCI_EVENT_COMMAND_STATUS) {
+		injected_received++;
+	} else if (hdr->event == HCI_EVENT_VENDOR) {
+		memcpy(&seq, hdr + 1, sizeof(seq));
+		CHECK(seq == real_received, "real event %u received as number %u", seq, real_received);
+		real_received++;
+	}
+}
+
+/* One host buffer, with both sources waiting for it */
+static void fill_buffer(void)
+{
+	ready_queue_stats_t stats;
+
+	while (enqueue_hci_event_command_status(HCI_CMD_RESET) == IOS_OK)
+		;
+	wii_bt_post_buffers(EP_HCI_EVENT, 1);
+	wii_bt_pump();
+
+	ready_queue_get_stats(&stats);
+	if (stats.depth[READY_CLASS_REAL_HCI_EVENT])
+		waited_rounds++;
+}
+
+int main(void)
+{
+	wii_bt_config_t config = {
+		.intr_buffers = 1,
+		.no_repost = true,
+		.hci_event = hci_event,
+		.dongle_read = dongle_read,
+	};
+	const u32 weights = READY_WEIGHT_REAL + READY_WEIGHT_INJECTED;
+	u32 real, injected, expected;
+
+	wii_bt_init(&config);
+
+	for (int i = 0; i < WARMUP_ROUNDS; i++)
+		fill_buffer();
+	real = real_received;
+	injected = injected_received;
+	for (int i = 0; i < ROUNDS; i++)
+		fill_buffer();
+	real = real_received - real;
+	injected = injected_received - injected;
+
+	CHECK(real + injected == ROUNDS, "%u buffers filled out of %u", real + injected, ROUNDS);
+	/* Off by at most the part of a round in progress at either end */
+	expected = ROUNDS * READY_WEIGHT_REAL / weights;
+	CHECK((real + weights >= expected) && (real <= expected + weights),
+	      "%u real and %u injected events, expected a %u:%u ratio", real, injected,
+	      READY_WEIGHT_REAL, READY_WEIGHT_INJECTED);
+	CHECK(waited_rounds > 0, "%s", "no real event ever waited on the ReadyQ");
+
+	if (failures) {
+		printf("FAIL: %u mismatches\n", failures);
+		return 1;
+	}
+
+	printf("OK: %u real and %u injected events for weights %u:%u, real ones waited %u times\n",
+	       real, injected, READY_WEIGHT_REAL, READY_WEIGHT_INJECTED, waited_rounds);
+	return 0;
+}
@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include "utils.h"
+#include "wii_bt.h"
+
+/* The emulated Wii posts ACL buffers smaller than the messages injected for it. A message
+ * waiting on the ReadyQ must not be copied into a buffer too small for it, and a message
+ * injected while only such a buffer is posted must wait for a big enough one.
+ * wii_bt aborts if the module writes past the end of a buffer. */
+
+#define SHORT_SIZE	16
+#define MSG_SIZE	32
+/* Not a connection of the emulated Wii, which drops these packets */
+#define JUNK_CON_HANDLE	0x0abc
+#define JUNK_CID	0x0040
+
+static u32 acl_packets;
+
+static void acl_data(const void *data, u32 length)
+{
+	acl_packets++;
+}
+
+int main(void)
+{
+	static const u8 junk[MSG_SIZE];
+	wii_bt_config_t config = {
+		.intr_buffers = 2,
+		.no_repost = true,
+		.acl_data = acl_data,
+	};
+
+	wii_bt_init(&config);
+
+	/* Waiting on the ReadyQ: dropped rather than overflowing the short buffer */
+	if (l2cap_send_msg(JUNK_CON_HANDLE, JUNK_CID, junk, sizeof(junk)) != IOS_OK) {
+		printf("FAIL: message not injected\n");
+		return 1;
+	}
+	wii_bt_post_buffer(EP_ACL_DATA_IN, SHORT_SIZE);
+	wii_bt_pump();
+	if (acl_packets) {
+		printf("FAIL: message delivered into a short buffer\n");
+		return 1;
+	}
+
+	/* Short buffer on the PendingQ: the message waits for the next buffer */
+	wii_bt_post_buffer(EP_ACL_DATA_IN, SHORT_SIZE);
+	wii_bt_pump();
+	if (l2cap_send_msg(JUNK_CON_HANDLE, JUNK_CID, junk, sizeof(junk)) != IOS_OK) {
+		printf("FAIL: message not injected\n");
+		return 1;
+	}
+	if (acl_packets) {
+		printf("FAIL: message built into a short buffer\n");
+		return 1;
+	}
+	wii_bt_post_buffers(EP_ACL_DATA_IN, 1);
+	wii_bt_pump();
+	if (acl_packets != 1) {
+		printf("FAIL: %u messages delivered once a big enough buffer was posted\n",
+		       acl_packets);
+		return 1;
+	}
+
+	printf("OK: no message written to a buffer too small for it\n");
+	return 0;
+}
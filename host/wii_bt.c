@@ -0,0 +1,640 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "fake_wiimote_mgr.h"
+#include "ipc.h"
+#include "l2cap.h"
+#include "syscalls.h"
+#include "utils.h"
+#include "wii_bt.h"
+#include "wiimote.h"
+
+/* /dev/usb/oh1 requests, see handle_oh1_dev_ioctlv() */
+#define USBV0_IOCTLV_CTRLMSG	0
+#define USBV0_IOCTLV_BLKMSG	1
+#define USBV0_IOCTLV_INTRMSG	2
+
+/* ACL MTU of the Wii's Bluetooth controller (BCM2045) */
+#define WII_BT_ACL_MTU		339
+#define WII_BT_DATA_SIZE	(sizeof(hci_acldata_hdr_t) + WII_BT_ACL_MTU)
+#define WII_BT_MAX_MSGS		64
+#define WII_BT_MAX_READS	8
+#define WII_BT_QUEUE_SIZE	128
+
+/* First L2CAP channel ID of the Wii side, two per fake Wiimote. Out of the range used by
+ * the fake Wiimotes, so that a CID tells which side it belongs to. */
+#define WII_BT_FIRST_CID	0x1000
+
+/* WPAD handshake stages */
+enum {
+	WPAD_STAGE_STATUS,
+	WPAD_STAGE_READ,
+	WPAD_STAGE_REPORTING,
+};
+
+/* Bits of wii_bt_wiimote_t.cfg_done */
+#define CFG_CNTL_IN	BIT(0)
+#define CFG_INTR_IN	BIT(1)
+#define CFG_CNTL_OUT	BIT(2)
+#define CFG_INTR_OUT	BIT(3)
+#define CFG_DONE	(CFG_CNTL_IN | CFG_INTR_IN | CFG_CNTL_OUT | CFG_INTR_OUT)
+
+/* An ipcmessage sent by the Wii to /dev/usb/oh1 */
+typedef struct {
+	ipcmessage msg; /* Must be the first member */
+	ioctlv vectors[7];
+	bool used;
+	/* Bulk and interrupt messages */
+	u8 endpoint;
+	u16 length;
+	/* Control messages */
+	u8 bmRequestType;
+	u8 bRequest;
+	u16 wValue;
+	u16 wIndex;
+	u16 wLength;
+	u8 unknown;
+	u8 data[WII_BT_DATA_SIZE] ATTRIBUTE_ALIGN(32);
+} wii_bt_msg_t;
+
+static wii_bt_config_t config;
+static void *orig_msg_queue_data[WII_BT_QUEUE_SIZE];
+static wii_bt_msg_t msgs[WII_BT_MAX_MSGS];
+static wii_bt_wiimote_t wiimotes[MAX_FAKE_WIIMOTES];
+static bool wpad_handshake;
+static u8 signal_ident;
+
+/* Reads handed down to the dongle, never completed */
+static ipcmessage *dongle_reads[WII_BT_MAX_READS];
+
+static wii_bt_msg_t *msg_alloc(void)
+{
+	for (int i = 0; i < WII_BT_MAX_MSGS; i++) {
+		if (!msgs[i].used) {
+			memset(&msgs[i], 0, offsetof(wii_bt_msg_t, data));
+			msgs[i].used = true;
+			return &msgs[i];
+		}
+	}
+
+	fprintf(stderr, "wii_bt: out of messages\n");
+	abort();
+}
+
+static wii_bt_msg_t *msg_get(const ipcmessage *msg)
+{
+	if (((uintptr_t)msg < (uintptr_t)msgs) || ((uintptr_t)msg >= (uintptr_t)&msgs[WII_BT_MAX_MSGS]))
+		return NULL;
+	return &msgs[((uintptr_t)msg - (uintptr_t)msgs) / sizeof(*msgs)];
+}
+
+static void msg_send(wii_bt_msg_t *msg)
+{
+	if (os_message_queue_send(orig_msg_queueid, &msg->msg, IOS_MESSAGE_NOBLOCK) != IOS_OK) {
+		fprintf(stderr, "wii_bt: OH1 queue full\n");
+		abort();
+	}
+}
+
+static void msg_setup_bulk_intr(wii_bt_msg_t *msg, u32 command, u8 endpoint, u16 length)
+{
+	msg->endpoint = endpoint;
+	msg->length = length;
+	msg->vectors[0].data = &msg->endpoint;
+	msg->vectors[0].len = sizeof(msg->endpoint);
+	msg->vectors[1].data = &msg->length;
+	msg->vectors[1].len = sizeof(msg->length);
+	msg->vectors[2].data = msg->data;
+	msg->vectors[2].len = length;
+	msg->msg.command = IOS_IOCTLV;
+	msg->msg.ioctlv.command = command;
+	msg->msg.ioctlv.num_in = 2;
+	msg->msg.ioctlv.num_io = 1;
+	msg->msg.ioctlv.vector = msg->vectors;
+}
+
+/* Wii side */
+
+void wii_bt_post_buffer(u8 endpoint, u16 size)
+{
+	wii_bt_msg_t *msg = msg_alloc();
+
+	if (size > sizeof(msg->data)) {
+		fprintf(stderr, "wii_bt: buffer too big\n");
+		abort();
+	}
+
+	if (endpoint == EP_HCI_EVENT)
+		msg_setup_bulk_intr(msg, USBV0_IOCTLV_INTRMSG, endpoint, size);
+	else
+		msg_setup_bulk_intr(msg, USBV0_IOCTLV_BLKMSG, endpoint, size);
+	msg_send(msg);
+}
+
+void wii_bt_post_buffers(u8 endpoint, u32 count)
+{
+	u16 size = (endpoint == EP_HCI_EVENT) ? HCI_EVENT_PKT_SIZE : WII_BT_DATA_SIZE;
+
+	while (count--)
+		wii_bt_post_buffer(endpoint, size);
+}
+
+void wii_bt_send_hci_cmd(u16 opcode, const void *params, u8 size)
+{
+	wii_bt_msg_t *msg = msg_alloc();
+	hci_cmd_hdr_t *hdr = (hci_cmd_hdr_t *)msg->data;
+
+	hdr->opcode = htole16(opcode);
+	hdr->length = size;
+	memcpy(hdr + 1, params, size);
+
+	msg->wLength = htole16(sizeof(*hdr) + size);
+	msg->vectors[0].data = &msg->bmRequestType;
+	msg->vectors[0].len = sizeof(msg->bmRequestType);
+	msg->vectors[1].data = &msg->bRequest;
+	msg->vectors[1].len = sizeof(msg->bRequest);
+	msg->vectors[2].data = &msg->wValue;
+	msg->vectors[2].len = sizeof(msg->wValue);
+	msg->vectors[3].data = &msg->wIndex;
+	msg->vectors[3].len = sizeof(msg->wIndex);
+	msg->vectors[4].data = &msg->wLength;
+	msg->vectors[4].len = sizeof(msg->wLength);
+	msg->vectors[5].data = &msg->unknown;
+	msg->vectors[5].len = sizeof(msg->unknown);
+	msg->vectors[6].data = msg->data;
+	msg->vectors[6].len = sizeof(*hdr) + size;
+	msg->bRequest = EP_HCI_CTRL;
+	msg->msg.command = IOS_IOCTLV;
+	msg->msg.ioctlv.command = USBV0_IOCTLV_CTRLMSG;
+	msg->msg.ioctlv.num_in = 6;
+	msg->msg.ioctlv.num_io = 1;
+	msg->msg.ioctlv.vector = msg->vectors;
+	msg_send(msg);
+}
+
+void wii_bt_send_acl(u16 con_handle, u16 dcid, const void *data, u16 size)
+{
+	wii_bt_msg_t *msg = msg_alloc();
+	hci_acldata_hdr_t *acl = (hci_acldata_hdr_t *)msg->data;
+	l2cap_hdr_t *l2cap = (l2cap_hdr_t *)(acl + 1);
+	u16 length = sizeof(*acl) + sizeof(*l2cap) + size;
+
+	if (length > sizeof(msg->data)) {
+		fprintf(stderr, "wii_bt: ACL packet too big\n");
+		abort();
+	}
+
+	acl->con_handle = htole16(HCI_MK_CON_HANDLE(con_handle, HCI_PACKET_START, HCI_POINT2POINT));
+	acl->length = htole16(sizeof(*l2cap) + size);
+	l2cap->length = htole16(size);
+	l2cap->dcid = htole16(dcid);
+	memcpy(l2cap + 1, data, size);
+
+	msg_setup_bulk_intr(msg, USBV0_IOCTLV_BLKMSG, EP_ACL_DATA_OUT, length);
+	msg_send(msg);
+}
+
+void wii_bt_send_output_report(int index, u8 report_id, const void *data, u16 size)
+{
+	u8 buf[2 + WIIMOTE_MAX_PAYLOAD];
+
+	buf[0] = (HID_TYPE_DATA << 4) | HID_PARAM_OUTPUT;
+	buf[1] = report_id;
+	memcpy(&buf[2], data, size);
+	wii_bt_send_acl(wiimotes[index].con_handle, wiimotes[index].intr_remote_cid, buf, 2 + size);
+}
+
+void wii_bt_enable_page_scan(bool wpad)
+{
+	hci_write_scan_enable_cp cp = { .scan_enable = HCI_PAGE_SCAN_ENABLE };
+
+	wpad_handshake = wpad;
+	wii_bt_send_hci_cmd(HCI_CMD_WRITE_SCAN_ENABLE, &cp, sizeof(cp));
+}
+
+wii_bt_wiimote_t *wii_bt_get_wiimote(int index)
+{
+	return &wiimotes[index];
+}
+
+static int wiimote_index_for_bdaddr(const bdaddr_t *bdaddr)
+{
+	for (int i = 0; i < MAX_FAKE_WIIMOTES; i++) {
+		bdaddr_t fake = FAKE_WIIMOTE_BDADDR(i);
+		if (memcmp(bdaddr, &fake, sizeof(fake)) == 0)
+			return i;
+	}
+	return -1;
+}
+
+static wii_bt_wiimote_t *wiimote_for_con_handle(u16 con_handle)
+{
+	for (int i = 0; i < MAX_FAKE_WIIMOTES; i++) {
+		if (wiimotes[i].connected && (wiimotes[i].con_handle == con_handle))
+			return &wiimotes[i];
+	}
+	return NULL;
+}
+
+/* Emulated WPAD handshake */
+
+static void wpad_request_status(wii_bt_wiimote_t *wm)
+{
+	u8 rumble = 0;
+
+	wm->wpad_stage = WPAD_STAGE_STATUS;
+	wii_bt_send_output_report(wm - wiimotes, OUTPUT_REPORT_ID_STATUS, &rumble, sizeof(rumble));
+}
+
+static void wpad_read(wii_bt_wiimote_t *wm, bool extension)
+{
+	struct wiimote_output_report_read_data_t read = { 0 };
+
+	/* The whole extension register block, or both copies of the EEPROM calibration */
+	if (extension) {
+		read.space = ADDRESS_SPACE_I2C_BUS;
+		read.slave_address = EXTENSION_I2C_ADDR;
+		read.size = 0x100;
+	} else {
+		read.space = ADDRESS_SPACE_EEPROM;
+		read.size = 0x2a;
+	}
+
+	wm->wpad_stage = WPAD_STAGE_READ;
+	wm->wpad_extension = extension;
+	wm->wpad_read_left = read.size;
+	wii_bt_send_output_report(wm - wiimotes, OUTPUT_REPORT_ID_READ_DATA, &read, sizeof(read));
+}
+
+static void wpad_set_reporting_mode(wii_bt_wiimote_t *wm)
+{
+	struct wiimote_output_report_mode_t mode = { 0 };
+
+	mode.continuous = 1;
+	mode.mode = wm->wpad_extension ? INPUT_REPORT_ID_BTN_ACC_EXP : INPUT_REPORT_ID_BTN_ACC;
+	wm->wpad_stage = WPAD_STAGE_REPORTING;
+	wii_bt_send_output_report(wm - wiimotes, OUTPUT_REPORT_ID_REPORT_MODE, &mode, sizeof(mode));
+}
+
+static void handle_input_report(wii_bt_wiimote_t *wm, u8 report_id, const u8 *data, u16 size)
+{
+	switch (report_id) {
+	case INPUT_REPORT_ID_STATUS: {
+		const struct wiimote_input_report_status_t *status = (const void *)data;
+
+		wm->status_reports++;
+		if (!wm->wpad_handshake)
+			break;
+		/* An extension change: read again once the current read is done */
+		if (wm->wpad_stage == WPAD_STAGE_READ)
+			wm->wpad_read_pending = true;
+		else
+			wpad_read(wm, status->extension);
+		break;
+	}
+	case INPUT_REPORT_ID_READ_DATA_REPLY: {
+		const struct wiimote_input_report_read_data_t *reply = (const void *)data;
+
+		wm->read_replies++;
+		if (!wm->wpad_handshake || (wm->wpad_stage != WPAD_STAGE_READ))
+			break;
+		if (reply->error || (wm->wpad_read_left <= reply->size_minus_one + 1))
+			wm->wpad_read_left = 0;
+		else
+			wm->wpad_read_left -= reply->size_minus_one + 1;
+		if (wm->wpad_read_left)
+			break;
+		if (wm->wpad_read_pending) {
+			wm->wpad_read_pending = false;
+			wpad_request_status(wm);
+		} else {
+			wpad_set_reporting_mode(wm);
+		}
+		break;
+	}
+	case INPUT_REPORT_ID_ACK:
+		wm->acks++;
+		break;
+	default:
+		if (report_id < INPUT_REPORT_ID_BTN)
+			break;
+		wm->data_reports++;
+		wm->last_data_report_size = MIN2(size, sizeof(wm->last_data_report));
+		memcpy(wm->last_data_report, data, wm->last_data_report_size);
+		if (wm->wpad_handshake && (wm->wpad_stage == WPAD_STAGE_REPORTING) && !wm->input_ready) {
+			wm->input_ready = true;
+			wm->input_ready_ns = host_time_ns();
+		}
+		break;
+	}
+}
+
+/* L2CAP signalling, the Wii accepts and configures the HID channels of the fake Wiimotes */
+
+static void send_signal(wii_bt_wiimote_t *wm, u8 code, u8 ident, const void *params, u16 size)
+{
+	u8 buf[sizeof(l2cap_cmd_hdr_t) + 16];
+	l2cap_cmd_hdr_t *cmd = (l2cap_cmd_hdr_t *)buf;
+
+	cmd->code = code;
+	cmd->ident = ident;
+	cmd->length = htole16(size);
+	memcpy(cmd + 1, params, size);
+	wii_bt_send_acl(wm->con_handle, L2CAP_SIGNAL_CID, buf, sizeof(*cmd) + size);
+}
+
+static void handle_signal(wii_bt_wiimote_t *wm, const u8 *data, u16 length)
+{
+	const l2cap_cmd_hdr_t *cmd;
+	const void *payload;
+	u16 cmd_len;
+
+	while (length >= sizeof(l2cap_cmd_hdr_t)) {
+		cmd = (const void *)data;
+		cmd_len = le16toh(cmd->length);
+		payload = cmd + 1;
+
+		switch (cmd->code) {
+		case L2CAP_CONNECT_REQ: {
+			const l2cap_con_req_cp *req = payload;
+			u16 cid = WII_BT_FIRST_CID + 2 * (wm - wiimotes);
+			struct {
+				l2cap_cfg_req_cp req;
+				l2cap_cfg_opt_t opt;
+				u16 mtu;
+			} ATTRIBUTE_PACKED cfg;
+			l2cap_con_rsp_cp rsp;
+
+			if (le16toh(req->psm) == L2CAP_PSM_HID_CNTL) {
+				wm->cntl_cid = cid;
+				wm->cntl_remote_cid = le16toh(req->scid);
+			} else {
+				cid++;
+				wm->intr_cid = cid;
+				wm->intr_remote_cid = le16toh(req->scid);
+			}
+
+			rsp.dcid = htole16(cid);
+			rsp.scid = req->scid;
+			rsp.result = htole16(L2CAP_SUCCESS);
+			rsp.status = htole16(L2CAP_NO_INFO);
+			send_signal(wm, L2CAP_CONNECT_RSP, cmd->ident, &rsp, sizeof(rsp));
+
+			cfg.req.dcid = req->scid;
+			cfg.req.flags = 0;
+			cfg.opt.type = L2CAP_OPT_MTU;
+			cfg.opt.length = L2CAP_OPT_MTU_SIZE;
+			cfg.mtu = htole16(WII_REQUEST_MTU);
+			send_signal(wm, L2CAP_CONFIG_REQ, ++signal_ident, &cfg, sizeof(cfg));
+			break;
+		}
+		case L2CAP_CONFIG_REQ: {
+			const l2cap_cfg_req_cp *req = payload;
+			bool cntl = le16toh(req->dcid) == wm->cntl_cid;
+			l2cap_cfg_rsp_cp rsp;
+
+			rsp.scid = htole16(cntl ? wm->cntl_remote_cid : wm->intr_remote_cid);
+			rsp.flags = 0;
+			rsp.result = htole16(L2CAP_SUCCESS);
+			send_signal(wm, L2CAP_CONFIG_RSP, cmd->ident, &rsp, sizeof(rsp));
+			wm->cfg_done |= cntl ? CFG_CNTL_IN : CFG_INTR_IN;
+			break;
+		}
+		case L2CAP_CONFIG_RSP: {
+			const l2cap_cfg_rsp_cp *rsp = payload;
+			u16 scid = le16toh(rsp->scid);
+
+			if (scid == wm->cntl_cid)
+				wm->cfg_done |= CFG_CNTL_OUT;
+			else if (scid == wm->intr_cid)
+				wm->cfg_done |= CFG_INTR_OUT;
+			break;
+		}
+		}
+
+		data += sizeof(*cmd) + cmd_len;
+		length -= sizeof(*cmd) + cmd_len;
+	}
+
+	if (!wm->hid_ready && (wm->cfg_done == CFG_DONE)) {
+		wm->hid_ready = true;
+		if (wm->wpad_handshake)
+			wpad_request_status(wm);
+	}
+}
+
+static void handle_acl_data(const u8 *data, u32 length)
+{
+	const hci_acldata_hdr_t *acl = (const void *)data;
+	const l2cap_hdr_t *l2cap = (const void *)(acl + 1);
+	const u8 *payload = (const u8 *)(l2cap + 1);
+	u16 dcid = le16toh(l2cap->dcid);
+	u16 size = le16toh(l2cap->length);
+	wii_bt_wiimote_t *wm;
+
+	if (config.acl_data)
+		config.acl_data(data, length);
+
+	wm = wiimote_for_con_handle(HCI_CON_HANDLE(le16toh(acl->con_handle)));
+	if (!wm)
+		return;
+
+	if (dcid == L2CAP_SIGNAL_CID)
+		handle_signal(wm, payload, size);
+	else if ((dcid == wm->intr_cid) && (size >= 2) &&
+		 (payload[0] == ((HID_TYPE_DATA << 4) | HID_PARAM_INPUT)))
+		handle_input_report(wm, payload[1], &payload[2], size - 2);
+}
+
+static void handle_hci_event(const u8 *data, u32 length)
+{
+	const hci_event_hdr_t *hdr = (const void *)data;
+	const void *payload = hdr + 1;
+	int i;
+
+	if (config.hci_event)
+		config.hci_event(data, length);
+
+	switch (hdr->event) {
+	case HCI_EVENT_CON_REQ: {
+		const hci_con_req_ep *ep = payload;
+		hci_accept_con_cp cp;
+
+		i = wiimote_index_for_bdaddr(&ep->bdaddr);
+		if (i < 0)
+			break;
+		memset(&wiimotes[i], 0, sizeof(wiimotes[i]));
+		wiimotes[i].con_req_ns = host_time_ns();
+		wiimotes[i].wpad_handshake = wpad_handshake;
+
+		cp.bdaddr = ep->bdaddr;
+		cp.role = HCI_ROLE_MASTER;
+		wii_bt_send_hci_cmd(HCI_CMD_ACCEPT_CON, &cp, sizeof(cp));
+		break;
+	}
+	case HCI_EVENT_CON_COMPL: {
+		const hci_con_compl_ep *ep = payload;
+
+		i = wiimote_index_for_bdaddr(&ep->bdaddr);
+		if ((i < 0) || ep->status)
+			break;
+		wiimotes[i].con_handle = le16toh(ep->con_handle);
+		wiimotes[i].connected = true;
+		break;
+	}
+	case HCI_EVENT_DISCON_COMPL: {
+		const hci_discon_compl_ep *ep = payload;
+		wii_bt_wiimote_t *wm = wiimote_for_con_handle(le16toh(ep->con_handle));
+
+		/* Forget the connection, a new one starts from scratch */
+		if (wm && !ep->status)
+			memset(wm, 0, sizeof(*wm));
+		break;
+	}
+	case HCI_EVENT_NUM_COMPL_PKTS: {
+		const hci_num_compl_pkts_ep *ep = payload;
+		const hci_num_compl_pkts_info *info = (const void *)(ep + 1);
+		wii_bt_wiimote_t *wm;
+
+		for (i = 0; i < ep->num_con_handles; i++) {
+			wm = wiimote_for_con_handle(le16toh(info[i].con_handle));
+			if (wm)
+				wm->compl_pkts += le16toh(info[i].compl_pkts);
+		}
+		break;
+	}
+	}
+}
+
+/* Called for every message the module ACKs */
+static void wii_bt_ack(ipcmessage *ipcmsg, s32 result)
+{
+	wii_bt_msg_t *msg = msg_get(ipcmsg);
+
+	if (!msg)
+		return;
+
+	if ((msg->msg.ioctlv.command == USBV0_IOCTLV_CTRLMSG) || !(msg->endpoint & 0x80)) {
+		msg->used = false;
+		return;
+	}
+
+	if (result > msg->length) {
+		fprintf(stderr, "wii_bt: %d bytes written to a buffer of %u\n", (int)result,
+			msg->length);
+		abort();
+	}
+
+	if (result > 0) {
+		if (msg->endpoint == EP_HCI_EVENT)
+			handle_hci_event(msg->data, result);
+		else
+			handle_acl_data(msg->data, result);
+	}
+
+	if (config.no_repost)
+		msg->used = false;
+	else
+		msg_send(msg);
+}
+
+/* Dongle side */
+
+static void dongle_handle_msg(ipcmessage *msg)
+{
+	ioctlv *vector = msg->ioctlv.vector;
+	u8 endpoint;
+	s32 ret;
+
+	if (msg->command != IOS_IOCTLV) {
+		OH1_IOS_ResourceReply_hook(msg, IOS_OK);
+		return;
+	}
+
+	switch (msg->ioctlv.command) {
+	case USBV0_IOCTLV_CTRLMSG:
+		OH1_IOS_ResourceReply_hook(msg, le16toh(*(u16 *)vector[4].data));
+		break;
+	case USBV0_IOCTLV_BLKMSG:
+	case USBV0_IOCTLV_INTRMSG:
+		endpoint = *(u8 *)vector[0].data;
+		if (!(endpoint & 0x80)) {
+			OH1_IOS_ResourceReply_hook(msg, *(u16 *)vector[1].data);
+			break;
+		}
+		ret = config.dongle_read ? config.dongle_read(endpoint, vector[2].data,
+							      *(u16 *)vector[1].data) : 0;
+		if (ret > 0) {
+			OH1_IOS_ResourceReply_hook(msg, ret);
+			break;
+		}
+		for (int i = 0; i < WII_BT_MAX_READS; i++) {
+			if (!dongle_reads[i]) {
+				dongle_reads[i] = msg;
+				return;
+			}
+		}
+		fprintf(stderr, "wii_bt: too many reads pending at the dongle\n");
+		abort();
+	default:
+		OH1_IOS_ResourceReply_hook(msg, IOS_OK);
+		break;
+	}
+}
+
+u32 wii_bt_dongle_pending_reads(u8 endpoint)
+{
+	u32 count = 0;
+
+	for (int i = 0; i < WII_BT_MAX_READS; i++) {
+		if (dongle_reads[i] && (*(u8 *)dongle_reads[i]->ioctlv.vector[0].data == endpoint))
+			count++;
+	}
+	return count;
+}
+
+/* OH1 thread */
+
+void wii_bt_pump(void)
+{
+	ipcmessage *msg;
+
+	while (1) {
+		msg = NULL;
+		OH1_IOS_ReceiveMessage_hook(orig_msg_queueid, &msg, IOS_MESSAGE_NOBLOCK);
+		if (!msg)
+			break;
+		dongle_handle_msg(msg);
+	}
+}
+
+bool wii_bt_run(u64 timeout_ns, bool (*done)(void *arg), void *arg)
+{
+	const struct timespec idle = { .tv_nsec = 20 * 1000 };
+	u64 deadline = host_time_ns() + timeout_ns;
+
+	while (1) {
+		wii_bt_pump();
+		if (done(arg))
+			return true;
+		if (host_time_ns() > deadline)
+			return false;
+		nanosleep(&idle, NULL);
+	}
+}
+
+void wii_bt_init(const wii_bt_config_t *cfg)
+{
+	config = *cfg;
+
+	orig_msg_queueid = os_message_queue_create(orig_msg_queue_data,
+						   ARRAY_SIZE(orig_msg_queue_data));
+	host_set_ack_handler(wii_bt_ack);
+
+	wii_bt_post_buffers(EP_HCI_EVENT, config.intr_buffers);
+	wii_bt_post_buffers(EP_ACL_DATA_IN, config.bulk_in_buffers);
+
+	/* The first message initializes the module */
+	wii_bt_pump();
+}
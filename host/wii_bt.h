@@ -0,0 +1,87 @@
+#ifndef WII_BT_H
+#define WII_BT_H
+
+#include <assert.h>
+#include "hci.h"
+#include "host.h"
+#include "types.h"
+#include "wiimote.h"
+
+/* Emulation of both ends of /dev/usb/oh1 around the module, for the host tests and benchmarks:
+ * the Wii's Bluetooth stack on the PPC (it sends HCI commands and ACL data, and keeps buffers
+ * posted for the HCI events and the ACL data in) and a USB Bluetooth dongle without any real
+ * device in range. Everything runs on the thread calling wii_bt_pump(), which plays the OH1
+ * thread: the callbacks below are called from it, and so can use the module's internals. */
+
+/* /dev/usb/oh1 endpoints */
+#define EP_HCI_CTRL	0x00
+#define EP_HCI_EVENT	0x81
+#define EP_ACL_DATA_IN	0x82
+#define EP_ACL_DATA_OUT	0x02
+
+typedef struct {
+	/* Buffers kept posted on the HCI event (interrupt) and the ACL data in (bulk in) endpoints */
+	u32 intr_buffers;
+	u32 bulk_in_buffers;
+	/* Post the buffers again once the module fills them */
+	bool no_repost;
+	/* Optional. Called for every HCI event and ACL packet delivered to the Wii */
+	void (*hci_event)(const void *data, u32 length);
+	void (*acl_data)(const void *data, u32 length);
+	/* Optional. Completes a read handed down to the dongle: returns the size of the data
+	 * written to data, or 0 to leave it pending, like a dongle without traffic does */
+	s32 (*dongle_read)(u8 endpoint, void *data, u16 length);
+} wii_bt_config_t;
+
+/* State of the HID connection with a fake Wiimote, as seen by the emulated Wii */
+typedef struct {
+	u16 con_handle;
+	bool connected;
+	/* Both HID channels connected and configured both ways */
+	bool hid_ready;
+	u16 cntl_cid, cntl_remote_cid;
+	u16 intr_cid, intr_remote_cid;
+	u8 cfg_done;
+	/* Emulated WPAD handshake: status request, calibration or extension read,
+	 * then continuous reporting mode. input_ready is set by the first data report. */
+	bool wpad_handshake;
+	u8 wpad_stage;
+	bool wpad_extension;
+	u16 wpad_read_left;
+	bool wpad_read_pending;
+	bool input_ready;
+	u64 con_req_ns;
+	u64 input_ready_ns;
+	/* Input reports received */
+	u32 status_reports;
+	u32 read_replies;
+	u32 acks;
+	u32 data_reports;
+	u8 last_data_report[WIIMOTE_MAX_PAYLOAD];
+	u16 last_data_report_size;
+	/* ACL credits given back by Number_Of_Completed_Packets */
+	u32 compl_pkts;
+} wii_bt_wiimote_t;
+
+void wii_bt_init(const wii_bt_config_t *config);
+/* Runs the OH1 hooks until the OH1 queue is empty */
+void wii_bt_pump(void);
+/* Pumps until done() returns true (true) or timeout_ns elapses (false) */
+bool wii_bt_run(u64 timeout_ns, bool (*done)(void *arg), void *arg);
+
+/* Wii side */
+void wii_bt_post_buffers(u8 endpoint, u32 count);
+/* A single buffer of the given size, rather than the endpoint's maximum packet size */
+void wii_bt_post_buffer(u8 endpoint, u16 size);
+void wii_bt_send_hci_cmd(u16 opcode, const void *params, u8 size);
+void wii_bt_send_acl(u16 con_handle, u16 dcid, const void *data, u16 size);
+void wii_bt_send_output_report(int index, u8 report_id, const void *data, u16 size);
+/* Enables page scan, so that fake Wiimotes can connect. With wpad_handshake, the emulated
+ * Wii also does the WPAD handshake with every fake Wiimote that connects. */
+void wii_bt_enable_page_scan(bool wpad_handshake);
+wii_bt_wiimote_t *wii_bt_get_wiimote(int index);
+
+/* Dongle side: reads handed down to the dongle that are still pending */
+u32 wii_bt_dongle_pending_reads(u8 endpoint);
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef WIIMOTE_CRYPTO_REF_H
+#define WIIMOTE_CRYPTO_REF_H
+
+#include "wiimote_crypto.h"
+
+/* Byte at a time extension encryption, as done by Dolphin (EncryptionKey::Encrypt() in
+ * Source/Core/Core/HW/WiimoteEmu/Encryption.cpp). Reference for wiimote_crypto_encrypt(). */
+static inline void wiimote_crypto_encrypt_ref(u8 *data, const struct wiimote_encryption_key_t *key,
+					      u32 addr, u32 size)
+{
+	for (u32 i = 0; i < size; i++, addr++)
+		data[i] = (data[i] - key->ft[addr % 8]) ^ key->sb[addr % 8];
+}
+
+#endif
@@ -4,7 +4,16 @@
 #include "hci.h"
 #include "input_device.h"
 
-#define MAX_FAKE_WIIMOTES	2
+/* Number of fake Wiimotes (and input devices), up to CONF_PAD_MAX_ACTIVE */
+#ifndef MAX_FAKE_WIIMOTES
+#define MAX_FAKE_WIIMOTES	4
+#endif
+
+/* Send input reports as soon as the input device reports a change (at most one per tick period),
+ * instead of waiting for the next periodic tick. Only applies to non-continuous reporting mode. */
+#ifndef FAKE_WIIMOTE_EVENT_DRIVEN_INPUT
+#define FAKE_WIIMOTE_EVENT_DRIVEN_INPUT	1
+#endif
 
 #define FAKE_WIIMOTE_BDADDR(i) ((bdaddr_t){.b = {0xFE, 0xED, 0xBA, 0xDF, 0x00, 0xD0 + i}})
 
@@ -22,6 +31,7 @@ enum wiimote_mgr_ext_u {
 /** Used by the main event loop **/
 void fake_wiimote_mgr_init(void);
 void fake_wiimote_mgr_tick_devices(void);
+void fake_wiimote_mgr_handle_input_wakeup(void);
 
 /** Used by the HCI state tracker **/
 
@@ -42,7 +52,7 @@ bool fake_wiimote_mgr_handle_acl_data_out_request_from_host(u16 hci_con_handle,
 
 /** Used by the input devices **/
 
-bool fake_wiimote_mgr_add_input_device(void *usrdata, const input_device_ops_t *ops);
+fake_wiimote_t *fake_wiimote_mgr_add_input_device(void *usrdata, const input_device_ops_t *ops);
 bool fake_wiimote_mgr_remove_input_device(fake_wiimote_t *wiimote);
 void fake_wiimote_mgr_set_extension(fake_wiimote_t *wiimote, enum wiimote_mgr_ext_u ext);
 void fake_wiimote_mgr_report_input(fake_wiimote_t *wiimote, u16 buttons);
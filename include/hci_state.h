@@ -5,16 +5,26 @@
 
 void hci_state_init(void);
 
+/* Virtual connection handles are always below this value */
+#define MAX_HCI_CONNECTIONS	32
+
+/* Returned by hci_con_handle_virt_alloc() when all the handles are in use */
+#define HCI_CON_HANDLE_INVALID	0xFFFF
+
 /* Used by fake Wiimote manager */
 u16 hci_con_handle_virt_alloc(void);
+void hci_con_handle_virt_free(u16 virt);
 bool hci_request_connection(const bdaddr_t *bdaddr, u8 uclass0, u8 uclass1, u8 uclass2,
 			    u8 link_type);
 
 
 /* Used by the main request-handling loop */
 
-void hci_state_handle_hci_cmd_from_host(void *data, u32 length, bool *fwd_to_usb);
-void hci_state_handle_hci_event_from_controller(void *data, u32 length);
+void hci_state_tick(void);
+u16 hci_state_get_acl_data_pkt_size(void);
+/* Returns the new length of the command, which can shrink when forwarded to the dongle */
+u32 hci_state_handle_hci_cmd_from_host(void *data, u32 length, bool *fwd_to_usb);
+u32 hci_state_handle_hci_event_from_controller(void *data, u32 length, u32 size);
 void hci_state_handle_acl_data_in_response_from_controller(void *data, u32 length);
 void hci_state_handle_acl_data_out_request_from_host(void *data, u32 length, bool *fwd_to_usb);
 
@@ -22,6 +22,16 @@ typedef struct {
 	areply usb_async_resp_msg;
 	/* Buffer where we store the USB async respones */
 	u8 usb_async_resp[128] ATTRIBUTE_ALIGN(32);
+	/* Notification message we get when an async output (LEDs/rumble) transfer completes */
+	areply usb_async_output_msg;
+	/* Buffer for the async output transfers */
+	u8 usb_async_output[64] ATTRIBUTE_ALIGN(32);
+	/* Latest requested output state (written by the OH1 thread), sent by the worker */
+	u8 output_slot;
+	volatile bool output_pending;
+	bool output_in_flight;
+	/* Disconnection requested by the OH1 thread, done by the worker */
+	volatile bool disconnect_pending;
 	/* Bytes for private data (usage up to the device driver) */
 	u8 private_data[USB_INPUT_DEVICE_PRIVATE_DATA_SIZE] ATTRIBUTE_ALIGN(4);
 } usb_input_device_t;
@@ -44,5 +54,11 @@ int usb_device_driver_issue_intr_transfer(usb_input_device_t *device, int out, v
 int usb_device_driver_issue_ctrl_transfer_async(usb_input_device_t *device, u8 requesttype,
 						u8 request, u16 value, u16 index, void *data, u16 length);
 int usb_device_driver_issue_intr_transfer_async(usb_input_device_t *device, int out, void *data, u16 length);
+/* Output (LEDs/rumble) transfers, data must point to usb_async_output */
+int usb_device_driver_issue_output_ctrl_transfer_async(usb_input_device_t *device, u8 requesttype,
+						       u8 request, u16 value, u16 index, void *data,
+						       u16 length);
+int usb_device_driver_issue_output_intr_transfer_async(usb_input_device_t *device, void *data,
+						       u16 length);
 
 #endif
@@ -5,15 +5,26 @@
 #include <stdio.h>
 #include <string.h>
 #include "hci.h"
+#include "l2cap.h"
 
 #define bswap16 __builtin_bswap16
+
+/* Starlet is big-endian, the host build (make host) is usually not */
+#undef le16toh
+#undef htole16
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
 #define le16toh bswap16
 #define htole16 bswap16
+#else
+#define le16toh(x) (x)
+#define htole16(x) (x)
+#endif
 
 #define MAC_STR_LEN 18
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
+#define BIT(n)		(1U << (n))
 #define MIN2(x, y)	(((x) < (y)) ? (x) : (y))
 #define ROUNDUP32(x)	(((u32)(x) + 0x1f) & ~0x1f)
 #define ROUNDDOWN32(x)	(((u32)(x) - 0x1f) & ~0x1f)
@@ -21,6 +32,13 @@
 #define UNUSED(x) (void)(x)
 #define MEMBER_SIZE(type, member) sizeof(((type *)0)->member)
 
+/* Memory barrier between threads. Starlet has a single core, so a compiler barrier is enough */
+#ifdef __arm__
+#define barrier() __asm__ volatile("" ::: "memory")
+#else
+#define barrier() __sync_synchronize()
+#endif
+
 #ifdef assert
 #undef assert
 #endif
@@ -49,6 +67,56 @@ static inline int memmismatch(const void *restrict a, const void *restrict b, in
 	return i;
 }
 
+/* Injected message slots usage */
+typedef struct {
+	u32 slots;
+	u32 slot_size;
+	u32 big_slots;
+	u32 big_slot_size;
+	u32 in_use;
+	u32 high_water;
+	/* Data reports merged into a still queued one */
+	u32 coalesced;
+} injmessage_stats_t;
+
+void injmessage_get_stats(injmessage_stats_t *stats);
+
+/* Classes of the messages waiting for a host buffer (ReadyQs). The injected ones are
+ * listed in priority order. */
+typedef enum {
+	READY_CLASS_HCI_EVENT,	/* Interrupt endpoint */
+	READY_CLASS_ACL_CTRL,	/* Bulk in: L2CAP signalling, ACKs, replies */
+	READY_CLASS_ACL_DATA,	/* Bulk in: fake Wiimote data reports */
+	/* Real traffic from the Bluetooth dongle, sharing the host buffers with the
+	 * classes above by deficit round-robin */
+	READY_CLASS_REAL_HCI_EVENT,
+	READY_CLASS_REAL_ACL,
+	NUM_READY_CLASSES
+} ready_class_e;
+
+typedef struct {
+	u32 depth[NUM_READY_CLASSES];
+	u32 high_water[NUM_READY_CLASSES];
+	/* Host buffers filled, including the messages delivered without queuing */
+	u32 delivered[NUM_READY_CLASSES];
+} ready_queue_stats_t;
+
+void ready_queue_get_stats(ready_queue_stats_t *stats);
+
+/* Host buffers given to the real and the injected messages per round, when both wait */
+#ifndef READY_WEIGHT_REAL
+#define READY_WEIGHT_REAL	1
+#endif
+#ifndef READY_WEIGHT_INJECTED
+#define READY_WEIGHT_INJECTED	1
+#endif
+
+/* Free entries in the bulk in (ACL data) ReadyQ */
+u32 usb_bulk_in_ready_queue_room(void);
+
+/* Wakes up the OH1 thread to send input reports (called from the USB HID worker) */
+void request_input_wakeup(void);
+
 /* HCI event enqueue helpers */
 int enqueue_hci_event_command_status(u16 opcode);
 int enqueue_hci_event_command_compl(u16 opcode, const void *payload, u32 payload_size);
@@ -56,6 +124,7 @@ int enqueue_hci_event_con_req(const bdaddr_t *bdaddr, u8 uclass0, u8 uclass1, u8
 int enqueue_hci_event_discon_compl(u16 con_handle, u8 status, u8 reason);
 int enqueue_hci_event_con_compl(const bdaddr_t *bdaddr, u16 con_handle, u8 status);
 int enqueue_hci_event_role_change(const bdaddr_t *bdaddr, u8 role);
+int enqueue_hci_event_num_compl_pkts(const hci_num_compl_pkts_info *info, u8 num_con_handles);
 
 /* L2CAP event enqueue helpers */
 int l2cap_send_msg(u16 hci_con_handle, u16 dcid, const void *data, u16 size);
@@ -63,6 +132,25 @@ int l2cap_send_connect_req(u16 hci_con_handle, u16 psm, u16 scid);
 int l2cap_send_disconnect_req(u16 hci_con_handle, u16 dcid, u16 scid);
 int l2cap_send_disconnect_rsp(u16 hci_con_handle, u8 ident, u16 dcid, u16 scid);
 int l2cap_send_config_req(u16 hci_con_handle, u16 remote_cid, u16 mtu, u16 flush_time_out);
+/* Biggest options_len of l2cap_send_config_rsp() */
+#define L2CAP_CFG_RSP_MAX_OPTIONS	256
 int l2cap_send_config_rsp(u16 hci_con_handle, u16 remote_cid, u8 ident, const u8 *options, u32 options_len);
 
+/* HID input report header (ACL, L2CAP and HID type), prebuilt for a HID interrupt channel.
+ * The lengths are filled in for every report. */
+typedef struct {
+	hci_acldata_hdr_t acl;
+	l2cap_hdr_t l2cap;
+	u8 hid_type;
+} ATTRIBUTE_PACKED hid_input_report_hdr_t;
+
+void hid_input_report_hdr_init(hid_input_report_hdr_t *hdr, u16 hci_con_handle, u16 dcid);
+int hid_send_input_report(const hid_input_report_hdr_t *hdr, u8 report_id, const void *data, u16 size);
+/* Like hid_send_input_report(), but for data reports of the fake Wiimote index. They are
+ * delivered after any other bulk in message. If the report *queued is still waiting on the
+ * ReadyQ with the same report ID, it's updated in place instead. *queued is updated to track
+ * the report that was sent. */
+int hid_send_data_report(const hid_input_report_hdr_t *hdr, u8 index, void **queued,
+			 u8 report_id, const void *data, u16 size);
+
 #endif
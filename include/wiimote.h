@@ -1,6 +1,7 @@
 #ifndef WIIMOTE_H
 #define WIIMOTE_H
 
+#include <stddef.h>
 #include "types.h"
 
 /* Source: HID_010_SPC_PFL/1.0 (official HID specification) and Dolphin emulator */
@@ -236,80 +237,47 @@ union wiimote_usable_eeprom_data_t {
 };
 static_assert(sizeof(union wiimote_usable_eeprom_data_t) == EEPROM_FREE_SIZE);
 
-/* Helper inline functions */
+/* Data reports (0x30 - 0x3f) layout */
 
-static inline bool input_report_has_btn(u8 rpt_id)
-{
-	switch (rpt_id) {
-	case INPUT_REPORT_ID_EXP21:
-		return false;
-	default:
-		return true;
-	}
-}
-
-static inline u8 input_report_acc_size(u8 rpt_id)
-{
-	switch (rpt_id) {
-	case INPUT_REPORT_ID_BTN_ACC:
-	case INPUT_REPORT_ID_BTN_ACC_IR:
-	case INPUT_REPORT_ID_BTN_ACC_EXP:
-	case INPUT_REPORT_ID_BTN_ACC_IR_EXP:
-		return 3;
-	default:
-		return 0;
-	}
-}
+#define IR_OBJECT_NONE		0xff
 
-static inline u8 input_report_acc_offset(u8 rpt_id)
-{
-	switch (rpt_id) {
-	case INPUT_REPORT_ID_BTN_ACC:
-	case INPUT_REPORT_ID_BTN_ACC_IR:
-	case INPUT_REPORT_ID_BTN_ACC_EXP:
-	case INPUT_REPORT_ID_BTN_ACC_IR_EXP:
-		return 2;
-	default:
-		return 0;
-	}
-}
+struct wiimote_report_layout_t {
+	u8 btn_size;
+	u8 acc_offset;
+	u8 acc_size;
+	u8 ir_offset;
+	u8 ir_size;
+	u8 ext_offset;
+	u8 ext_size;
+	u8 size;
+};
 
-static inline u8 input_report_ext_size(u8 rpt_id)
-{
-	switch (rpt_id) {
-	case INPUT_REPORT_ID_BTN_EXP8:
-		return 8;
-	case INPUT_REPORT_ID_BTN_EXP19:
-		return 19;
-	case INPUT_REPORT_ID_BTN_ACC_EXP:
-		return 16;
-	case INPUT_REPORT_ID_BTN_IR_EXP:
-		return 9;
-	case INPUT_REPORT_ID_BTN_ACC_IR_EXP:
-		return 6;
-	case INPUT_REPORT_ID_EXP21:
-		return 21;
-	default:
-		return 0;
-	}
-}
+#define REPORT_LAYOUT(btn, acc, ir, ext) {					\
+	.btn_size = (btn),							\
+	.acc_offset = (btn), .acc_size = (acc),					\
+	.ir_offset = (btn) + (acc), .ir_size = (ir),				\
+	.ext_offset = (btn) + (acc) + (ir), .ext_size = (ext),			\
+	.size = (btn) + (acc) + (ir) + (ext) }
+
+/* The interleaved modes (0x3e/0x3f) and the unused IDs only report the buttons */
+static const struct wiimote_report_layout_t wiimote_report_layouts[0x10] = {
+	[0x0 ... 0xf] 					= REPORT_LAYOUT(2, 0, 0, 0),
+	[INPUT_REPORT_ID_BTN_ACC - 0x30]		= REPORT_LAYOUT(2, 3, 0, 0),
+	[INPUT_REPORT_ID_BTN_EXP8 - 0x30]		= REPORT_LAYOUT(2, 0, 0, 8),
+	[INPUT_REPORT_ID_BTN_ACC_IR - 0x30]		= REPORT_LAYOUT(2, 3, 12, 0),
+	[INPUT_REPORT_ID_BTN_EXP19 - 0x30]		= REPORT_LAYOUT(2, 0, 0, 19),
+	[INPUT_REPORT_ID_BTN_ACC_EXP - 0x30]		= REPORT_LAYOUT(2, 3, 0, 16),
+	[INPUT_REPORT_ID_BTN_IR_EXP - 0x30]		= REPORT_LAYOUT(2, 0, 10, 9),
+	[INPUT_REPORT_ID_BTN_ACC_IR_EXP - 0x30]		= REPORT_LAYOUT(2, 3, 10, 6),
+	[INPUT_REPORT_ID_EXP21 - 0x30]			= REPORT_LAYOUT(0, 0, 0, 21),
+};
 
-static inline u8 input_report_ext_offset(u8 rpt_id)
+static inline const struct wiimote_report_layout_t *wiimote_get_report_layout(u8 rpt_id)
 {
-	switch (rpt_id) {
-	case INPUT_REPORT_ID_BTN_EXP8:
-	case INPUT_REPORT_ID_BTN_EXP19:
-		return 2;
-	case INPUT_REPORT_ID_BTN_ACC_EXP:
-		return 5;
-	case INPUT_REPORT_ID_BTN_IR_EXP:
-		return 12;
-	case INPUT_REPORT_ID_BTN_ACC_IR_EXP:
-		return 15;
-	case INPUT_REPORT_ID_EXP21:
-	default:
-		return 0;
-	}
+	/* Other IDs get a buttons only report too */
+	if ((rpt_id & 0xf0) != INPUT_REPORT_ID_BTN)
+		return &wiimote_report_layouts[0];
+	return &wiimote_report_layouts[rpt_id & 0xf];
 }
 
 #endif
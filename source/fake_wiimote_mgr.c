@@ -1,4 +1,5 @@
 #include <string.h>
+#include "conf.h"
 #include "fake_wiimote_mgr.h"
 #include "hci.h"
 #include "hci_state.h"
@@ -34,9 +35,64 @@ typedef struct {
 	u16 remote_mtu;
 } l2cap_channel_info_t;
 
+/* Input state as reported by the input device */
+typedef struct {
+	u16 buttons;
+	u8 controller_data[CONTROLLER_DATA_BYTES];
+} input_state_t;
+
+/* EEPROM is stored sparsely in pages. Pages are allocated from a pool shared by all the
+ * fake Wiimotes when first written, untouched pages read from eeprom_default_image. */
+#define EEPROM_PAGE_SIZE	32
+#define EEPROM_NUM_PAGES	(EEPROM_FREE_SIZE / EEPROM_PAGE_SIZE)
+#define EEPROM_SPAN_PAGES(begin, end)	(((end) - 1) / EEPROM_PAGE_SIZE - (begin) / EEPROM_PAGE_SIZE + 1)
+/* What the Wii writes to a Wiimote: the calibration (WPAD) and both Mii blocks (Mii Channel) */
+#define EEPROM_WIIMOTE_PAGES						\
+	(EEPROM_SPAN_PAGES(0, offsetof(union wiimote_usable_eeprom_data_t, user_data)) +	\
+	 EEPROM_SPAN_PAGES(offsetof(union wiimote_usable_eeprom_data_t, mii_data_1),	\
+			   offsetof(union wiimote_usable_eeprom_data_t, unk_1)))
+/* The default fits all of the above for every fake Wiimote. Writes to the rest of the EEPROM
+ * share it too: if they exhaust it, they fail with ERROR_CODE_BUSY. */
+#ifndef EEPROM_POOL_PAGES
+#define EEPROM_POOL_PAGES	(MAX_FAKE_WIIMOTES * EEPROM_WIIMOTE_PAGES)
+#endif
+static_assert((EEPROM_FREE_SIZE % EEPROM_PAGE_SIZE) == 0);
+/* Pool pages are indexed by a u8 */
+static_assert(EEPROM_POOL_PAGES <= 255);
+
+/* Number of extension keys remembered per fake Wiimote */
+#ifndef EXTENSION_KEY_CACHE_SIZE
+#define EXTENSION_KEY_CACHE_SIZE	4
+#endif
+
+/* State only accessed on memory reads/writes and extension changes */
+typedef struct {
+	struct wiimote_extension_registers_t extension_regs;
+	/* Recently generated extension keys. Games write the same key data again
+	 * on every reconnection and extension change. */
+	struct {
+		u8 key_data[MEMBER_SIZE(struct wiimote_extension_registers_t, encryption_key_data)];
+		struct wiimote_encryption_key_t key;
+	} key_cache[EXTENSION_KEY_CACHE_SIZE];
+	u8 key_cache_count;
+	u8 key_cache_next;
+	/* 1-based index of the pool page backing each EEPROM page, 0 if never written */
+	u8 eeprom_pages[EEPROM_NUM_PAGES];
+} fake_wiimote_cold_t;
+
+static_assert(MAX_FAKE_WIIMOTES <= CONF_PAD_MAX_ACTIVE);
+
+/* Maximum number of "read data" replies sent per fake Wiimote and tick, as long as
+ * the bulk in ReadyQ has room for them */
+#ifndef READ_DATA_REPLIES_PER_TICK
+#define READ_DATA_REPLIES_PER_TICK	4
+#endif
+
+/* State accessed on every tick and input report */
 typedef struct fake_wiimote_t {
-	bool active;
-	bdaddr_t bdaddr;
+	/* Set by the USB HID worker when the input device is gone, the OH1 thread
+	 * disconnects the fake Wiimote on the next tick */
+	volatile bool input_removed;
 	/* Bluetooth connection state */
 	u16 hci_con_handle;
 	baseband_state_e baseband_state;
@@ -44,23 +100,36 @@ typedef struct fake_wiimote_t {
 	l2cap_channel_info_t psm_sdp_chn;
 	l2cap_channel_info_t psm_hid_cntl_chn;
 	l2cap_channel_info_t psm_hid_intr_chn;
-	/* Associated input device with this fake Wiimote */
-	void *usrdata;
-	const input_device_ops_t *input_device_ops;
+	/* Prebuilt header of the input reports sent on the HID interrupt channel */
+	hid_input_report_hdr_t intr_report_hdr;
+	/* Last data report sent, it's updated in place while it's still queued */
+	void *queued_data_report;
 	/* Reporting mode */
 	u8 reporting_mode;
 	bool reporting_continuous;
-	/* Input and extension state */
+	const struct wiimote_report_layout_t *report_layout;
+	/* Input and extension state. buttons and controller_data hold the
+	 * last input snapshot taken by the OH1 thread */
 	u16 buttons;
+	u8 controller_data[CONTROLLER_DATA_BYTES];
 	enum wiimote_mgr_ext_u cur_extension;
 	enum wiimote_mgr_ext_u new_extension;
-	struct wiimote_extension_registers_t extension_regs;
 	struct wiimote_encryption_key_t extension_key;
 	bool extension_key_dirty;
-	/* If true, we have to send an input report (if not in continuous reporting mode) */
-	bool input_dirty;
-	/* EEPROM */
-	union wiimote_usable_eeprom_data_t eeprom;
+	/* controller_data encrypted with extension_key, kept up to date on input changes
+	 * while valid. Invalidated when the key is regenerated */
+	u8 controller_data_enc[CONTROLLER_DATA_BYTES];
+	bool controller_data_enc_valid;
+	/* Latest input, written by the USB HID worker and read without locking by the OH1 thread.
+	 * input_seq is odd while an update is in progress (seqlock). */
+	vu32 input_seq;
+	input_state_t input;
+	/* input_seq of the current snapshot and of the last reported one. If they differ,
+	 * we have to send an input report (if not in continuous reporting mode) */
+	u32 input_seq_fetched;
+	u32 input_seq_reported;
+	/* An input report was already sent during the current tick period */
+	bool report_sent;
 	/* Current in-progress "memory read request" */
 	struct {
 		u8 space;
@@ -68,17 +137,162 @@ typedef struct fake_wiimote_t {
 		u16 address;
 		u16 size;
 	} read_request;
+	/* Associated input device with this fake Wiimote */
+	void *usrdata;
+	const input_device_ops_t *input_device_ops;
+	bdaddr_t bdaddr;
 } fake_wiimote_t;
 
 static fake_wiimote_t fake_wiimotes[MAX_FAKE_WIIMOTES];
+static fake_wiimote_cold_t fake_wiimotes_cold[MAX_FAKE_WIIMOTES];
+
+/* The active fake Wiimotes are the bits set in (claimed ^ released). Slots are claimed by the
+ * USB HID worker and released by the OH1 thread. Each bitmap has a single writer, so no update
+ * can get lost when one thread preempts the other. */
+static vu32 fake_wiimotes_claimed;
+static vu32 fake_wiimotes_released;
+
+/* Source: Dolphin emulator. IR and accelerometer calibration, twice, with valid checksums */
+static const u8 eeprom_default_image[] = {
+	0x7f, 0x5d, 0x03, 0x80, 0x5d, 0x80, 0xa2, 0xb8, 0x7f, 0xa2, 0x0c,
+	0x7f, 0x5d, 0x03, 0x80, 0x5d, 0x80, 0xa2, 0xb8, 0x7f, 0xa2, 0x0c,
+	0x80, 0x80, 0x80, 0x00, 0x9a, 0x9a, 0x9a, 0x00, 0x00, 0xa3,
+	0x80, 0x80, 0x80, 0x00, 0x9a, 0x9a, 0x9a, 0x00, 0x00, 0xa3,
+};
+static_assert(sizeof(eeprom_default_image) ==
+	      offsetof(union wiimote_usable_eeprom_data_t, user_data));
+
+static u8 eeprom_pool[EEPROM_POOL_PAGES][EEPROM_PAGE_SIZE];
+/* Only set by the OH1 thread (on allocation). Cleared when the owner gets a new input device. */
+static volatile bool eeprom_pool_used[EEPROM_POOL_PAGES];
+
+/* Connected fake Wiimotes, indexed by virtual HCI connection handle */
+static fake_wiimote_t *fake_wiimotes_by_con_handle[MAX_HCI_CONNECTIONS];
 
 /* Helper functions */
 
+static inline u32 fake_wiimotes_active_mask(void)
+{
+	return fake_wiimotes_claimed ^ fake_wiimotes_released;
+}
+
+static inline bool fake_wiimote_is_active(const fake_wiimote_t *wiimote)
+{
+	return (fake_wiimotes_active_mask() >> (wiimote - fake_wiimotes)) & 1;
+}
+
+static inline fake_wiimote_t *get_fake_wiimote_for_bdaddr(const bdaddr_t *bdaddr)
+{
+	const bdaddr_t base = FAKE_WIIMOTE_BDADDR(0);
+	u8 index = bdaddr->b[BLUETOOTH_BDADDR_SIZE - 1] - base.b[BLUETOOTH_BDADDR_SIZE - 1];
+
+	if ((memcmp(bdaddr, &base, BLUETOOTH_BDADDR_SIZE - 1) != 0) ||
+	    (index >= MAX_FAKE_WIIMOTES))
+		return NULL;
+	return &fake_wiimotes[index];
+}
+
+static inline fake_wiimote_t *get_fake_wiimote_for_con_handle(u16 hci_con_handle)
+{
+	if (hci_con_handle >= MAX_HCI_CONNECTIONS)
+		return NULL;
+	return fake_wiimotes_by_con_handle[hci_con_handle];
+}
+
 static inline bool fake_wiimote_is_connected(const fake_wiimote_t *wiimote)
 {
 	return wiimote->baseband_state == BASEBAND_STATE_COMPLETE;
 }
 
+static inline fake_wiimote_cold_t *fake_wiimote_get_cold(const fake_wiimote_t *wiimote)
+{
+	return &fake_wiimotes_cold[wiimote - fake_wiimotes];
+}
+
+/* Sparse EEPROM */
+
+static void eeprom_read_default(u8 *dst, u16 address, u16 size)
+{
+	u16 len = 0;
+
+	if (address < sizeof(eeprom_default_image)) {
+		len = MIN2(size, sizeof(eeprom_default_image) - address);
+		memcpy(dst, &eeprom_default_image[address], len);
+	}
+	memset(dst + len, 0, size - len);
+}
+
+static u8 eeprom_pool_alloc(void)
+{
+	for (int i = 0; i < EEPROM_POOL_PAGES; i++) {
+		if (!eeprom_pool_used[i]) {
+			eeprom_pool_used[i] = true;
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+static void eeprom_reset(fake_wiimote_cold_t *cold)
+{
+	for (int i = 0; i < EEPROM_NUM_PAGES; i++) {
+		if (cold->eeprom_pages[i]) {
+			eeprom_pool_used[cold->eeprom_pages[i] - 1] = false;
+			cold->eeprom_pages[i] = 0;
+		}
+	}
+}
+
+static void eeprom_read(const fake_wiimote_cold_t *cold, u8 *dst, u16 address, u16 size)
+{
+	u16 offset, len;
+	u8 page;
+
+	while (size) {
+		offset = address % EEPROM_PAGE_SIZE;
+		len = MIN2(size, EEPROM_PAGE_SIZE - offset);
+		page = cold->eeprom_pages[address / EEPROM_PAGE_SIZE];
+		if (page)
+			memcpy(dst, &eeprom_pool[page - 1][offset], len);
+		else
+			eeprom_read_default(dst, address, len);
+		dst += len;
+		address += len;
+		size -= len;
+	}
+}
+
+static bool eeprom_write(fake_wiimote_cold_t *cold, const u8 *src, u16 address, u16 size)
+{
+	u16 offset, len;
+	u16 first = address / EEPROM_PAGE_SIZE;
+	u16 last = (address + size - 1) / EEPROM_PAGE_SIZE;
+	u8 page;
+
+	/* Back all the pages first, so that we don't do partial writes */
+	for (int i = first; i <= last; i++) {
+		if (cold->eeprom_pages[i])
+			continue;
+		page = eeprom_pool_alloc();
+		if (!page)
+			return false;
+		eeprom_read_default(eeprom_pool[page - 1], i * EEPROM_PAGE_SIZE, EEPROM_PAGE_SIZE);
+		cold->eeprom_pages[i] = page;
+	}
+
+	while (size) {
+		offset = address % EEPROM_PAGE_SIZE;
+		len = MIN2(size, EEPROM_PAGE_SIZE - offset);
+		page = cold->eeprom_pages[address / EEPROM_PAGE_SIZE];
+		memcpy(&eeprom_pool[page - 1][offset], src, len);
+		src += len;
+		address += len;
+		size -= len;
+	}
+
+	return true;
+}
+
 /* Channel bookkeeping */
 
 static inline u16 generate_l2cap_channel_id(void)
@@ -130,23 +344,19 @@ static void l2cap_channel_info_setup(l2cap_channel_info_t *info, u16 psm, u16 lo
 
 /* HID reports */
 
-static int send_hid_data(u16 hci_con_handle, u16 dcid, u8 hid_type, const void *data, u32 size)
+static inline int wiimote_send_input_report(const fake_wiimote_t *wiimote, u8 report_id,
+					    const void *data, u16 size)
 {
-	u8 buf[WIIMOTE_MAX_PAYLOAD];
-	assert(size <= (WIIMOTE_MAX_PAYLOAD - 1));
-	buf[0] = hid_type;
-	memcpy(&buf[1], data, size);
-	return l2cap_send_msg(hci_con_handle, dcid, buf, size + 1);
+	assert(size <= (WIIMOTE_MAX_PAYLOAD - 2));
+	return hid_send_input_report(&wiimote->intr_report_hdr, report_id, data, size);
 }
 
-static inline int send_hid_input_report(u16 hci_con_handle, u16 dcid, u8 report_id,
-					const void *data, u32 size)
+static inline int wiimote_send_data_report(fake_wiimote_t *wiimote, const void *data, u16 size)
 {
-	u8 buf[WIIMOTE_MAX_PAYLOAD - 1];
 	assert(size <= (WIIMOTE_MAX_PAYLOAD - 2));
-	buf[0] = report_id;
-	memcpy(&buf[1], data, size);
-	return send_hid_data(hci_con_handle, dcid, (HID_TYPE_DATA << 4) | HID_PARAM_INPUT, buf, size + 1);
+	return hid_send_data_report(&wiimote->intr_report_hdr, wiimote - fake_wiimotes,
+				    &wiimote->queued_data_report, wiimote->reporting_mode,
+				    data, size);
 }
 
 static int wiimote_send_ack(const fake_wiimote_t *wiimote, u8 rpt_id, u8 error_code)
@@ -155,18 +365,16 @@ static int wiimote_send_ack(const fake_wiimote_t *wiimote, u8 rpt_id, u8 error_c
 	ack.buttons = wiimote->buttons;
 	ack.rpt_id = rpt_id;
 	ack.error_code = error_code;
-	return send_hid_input_report(wiimote->hci_con_handle, wiimote->psm_hid_intr_chn.remote_cid,
-				     INPUT_REPORT_ID_ACK, &ack, sizeof(ack));
+	return wiimote_send_input_report(wiimote, INPUT_REPORT_ID_ACK, &ack, sizeof(ack));
 }
 
 static int wiimote_send_input_report_status(const fake_wiimote_t *wiimote)
 {
 	struct wiimote_input_report_status_t status;
 	memset(&status, 0, sizeof(status));
-	status.extension = fake_wiimotes->cur_extension != WIIMOTE_MGR_EXT_NONE;
+	status.extension = wiimote->cur_extension != WIIMOTE_MGR_EXT_NONE;
 	status.buttons = wiimote->buttons;
-	return send_hid_input_report(wiimote->hci_con_handle, wiimote->psm_hid_intr_chn.remote_cid,
-				     INPUT_REPORT_ID_STATUS, &status, sizeof(status));
+	return wiimote_send_input_report(wiimote, INPUT_REPORT_ID_STATUS, &status, sizeof(status));
 }
 
 /* Disconnection helper functions */
@@ -184,7 +392,7 @@ static int fake_wiimote_disconnect(fake_wiimote_t *wiimote)
 	int ret = 0, ret2;
 
 	/* If we had a L2CAP Interrupt channel connection, notify the driver of disconnection */
-	if (l2cap_channel_is_complete(&wiimote->psm_hid_intr_chn)) {
+	if (!wiimote->input_removed && l2cap_channel_is_complete(&wiimote->psm_hid_intr_chn)) {
 		if (wiimote->input_device_ops->disconnect)
 			wiimote->input_device_ops->disconnect(wiimote->usrdata);
 	}
@@ -212,9 +420,13 @@ static int fake_wiimote_disconnect(fake_wiimote_t *wiimote)
 						      0, 0x13 /* User Ended Connection */);
 		if (ret2 < 0 && ret == 0)
 			ret = ret2;
+		fake_wiimotes_by_con_handle[wiimote->hci_con_handle] = NULL;
+		hci_con_handle_virt_free(wiimote->hci_con_handle);
+		wiimote->baseband_state = BASEBAND_STATE_INACTIVE;
 	}
 
-	wiimote->active = false;
+	if (fake_wiimote_is_active(wiimote))
+		fake_wiimotes_released ^= BIT(wiimote - fake_wiimotes);
 
 	return ret;
 }
@@ -223,46 +435,66 @@ static int fake_wiimote_disconnect(fake_wiimote_t *wiimote)
 
 void fake_wiimote_mgr_init(void)
 {
+	fake_wiimotes_claimed = 0;
+	fake_wiimotes_released = 0;
 	for (int i = 0; i < MAX_FAKE_WIIMOTES; i++) {
-		fake_wiimotes[i].active = false;
 		/* We can set it now, since it's permanent */
 		fake_wiimotes[i].bdaddr = FAKE_WIIMOTE_BDADDR(i);
 	}
 }
 
-bool fake_wiimote_mgr_add_input_device(void *usrdata, const input_device_ops_t *ops)
+fake_wiimote_t *fake_wiimote_mgr_add_input_device(void *usrdata, const input_device_ops_t *ops)
 {
 	/* Find an inactive fake Wiimote */
-	for (int i = 0; i < MAX_FAKE_WIIMOTES; i++) {
-		if (fake_wiimotes[i].active)
-			continue;
-
-		fake_wiimotes[i].baseband_state = BASEBAND_STATE_REQUEST_CONNECTION;
-		fake_wiimotes[i].acl_state = L2CAP_CHANNEL_STATE_INACTIVE_INACTIVE;
-		fake_wiimotes[i].psm_sdp_chn.valid = false;
-		fake_wiimotes[i].psm_hid_cntl_chn.valid = false;
-		fake_wiimotes[i].psm_hid_intr_chn.valid = false;
-		fake_wiimotes[i].usrdata = usrdata;
-		fake_wiimotes[i].input_device_ops = ops;
-		fake_wiimotes[i].buttons = 0;
-		fake_wiimotes[i].cur_extension = WIIMOTE_MGR_EXT_NONE;
-		fake_wiimotes[i].new_extension = WIIMOTE_MGR_EXT_NONE;
-		memset(&fake_wiimotes[i].extension_regs, 0, sizeof(fake_wiimotes[i].extension_regs));
-		memset(&fake_wiimotes[i].extension_key, 0, sizeof(fake_wiimotes[i].extension_key));
-		fake_wiimotes[i].extension_key_dirty = true;
-		fake_wiimotes[i].input_dirty = false;
-		fake_wiimotes[i].read_request.size = 0;
-		fake_wiimotes[i].reporting_mode = INPUT_REPORT_ID_BTN;
-		fake_wiimotes[i].reporting_continuous = false;
-		fake_wiimotes[i].active = true;
-		return true;
-	}
-	return false;
+	u32 free = ~fake_wiimotes_active_mask() & (BIT(MAX_FAKE_WIIMOTES) - 1);
+	int i;
+
+	if (!free)
+		return NULL;
+	i = __builtin_ctz(free);
+
+	fake_wiimotes[i].input_removed = false;
+	fake_wiimotes[i].baseband_state = BASEBAND_STATE_REQUEST_CONNECTION;
+	fake_wiimotes[i].acl_state = L2CAP_CHANNEL_STATE_INACTIVE_INACTIVE;
+	fake_wiimotes[i].psm_sdp_chn.valid = false;
+	fake_wiimotes[i].psm_hid_cntl_chn.valid = false;
+	fake_wiimotes[i].psm_hid_intr_chn.valid = false;
+	fake_wiimotes[i].usrdata = usrdata;
+	fake_wiimotes[i].input_device_ops = ops;
+	fake_wiimotes[i].buttons = 0;
+	memset(fake_wiimotes[i].controller_data, 0, sizeof(fake_wiimotes[i].controller_data));
+	fake_wiimotes[i].cur_extension = WIIMOTE_MGR_EXT_NONE;
+	fake_wiimotes[i].new_extension = WIIMOTE_MGR_EXT_NONE;
+	memset(&fake_wiimotes_cold[i].extension_regs, 0,
+	       sizeof(fake_wiimotes_cold[i].extension_regs));
+	eeprom_reset(&fake_wiimotes_cold[i]);
+	memset(&fake_wiimotes[i].extension_key, 0, sizeof(fake_wiimotes[i].extension_key));
+	fake_wiimotes[i].extension_key_dirty = true;
+	fake_wiimotes[i].controller_data_enc_valid = false;
+	memset(&fake_wiimotes[i].input, 0, sizeof(fake_wiimotes[i].input));
+	fake_wiimotes[i].input_seq = 0;
+	fake_wiimotes[i].input_seq_fetched = 0;
+	fake_wiimotes[i].input_seq_reported = 0;
+	fake_wiimotes[i].report_sent = false;
+	fake_wiimotes[i].queued_data_report = NULL;
+	fake_wiimotes[i].read_request.size = 0;
+	fake_wiimotes[i].reporting_mode = INPUT_REPORT_ID_BTN;
+	fake_wiimotes[i].report_layout = wiimote_get_report_layout(INPUT_REPORT_ID_BTN);
+	fake_wiimotes[i].reporting_continuous = false;
+
+	/* Publish it to the OH1 thread */
+	barrier();
+	fake_wiimotes_claimed ^= BIT(i);
+
+	return &fake_wiimotes[i];
 }
 
 bool fake_wiimote_mgr_remove_input_device(fake_wiimote_t *wiimote)
 {
-	return fake_wiimote_disconnect(wiimote) == IOS_OK;
+	/* Called from the USB HID worker. The OH1 thread owns the Bluetooth state,
+	 * so let it do the disconnection on the next tick. */
+	wiimote->input_removed = true;
+	return true;
 }
 
 void fake_wiimote_mgr_set_extension(fake_wiimote_t *wiimote, enum wiimote_mgr_ext_u ext)
@@ -270,28 +502,92 @@ void fake_wiimote_mgr_set_extension(fake_wiimote_t *wiimote, enum wiimote_mgr_ex
 	wiimote->new_extension = ext;
 }
 
+/* Input handoff (USB HID worker -> OH1 thread) */
+
+static inline void input_write_begin(fake_wiimote_t *wiimote)
+{
+	wiimote->input_seq++;
+	barrier();
+}
+
+static inline void input_write_end(fake_wiimote_t *wiimote)
+{
+	barrier();
+	wiimote->input_seq++;
+}
+
+static inline void extension_encrypt_controller_data(fake_wiimote_t *wiimote, u8 begin, u8 end)
+{
+	/* The controller data registers start at address 0 */
+	memcpy(&wiimote->controller_data_enc[begin], &wiimote->controller_data[begin], end - begin);
+	wiimote_crypto_encrypt(&wiimote->controller_data_enc[begin], &wiimote->extension_key,
+			       begin, end - begin);
+}
+
+static void fake_wiimote_fetch_input(fake_wiimote_t *wiimote)
+{
+	input_state_t input;
+	u32 seq = wiimote->input_seq;
+	int first, last;
+
+	if (seq == wiimote->input_seq_fetched)
+		return;
+
+	/* The USB HID worker has a lower priority and can't make progress while we run,
+	 * so don't retry on a torn read: keep the previous snapshot, the new input will
+	 * be picked up on the next tick */
+	if (seq & 1)
+		return;
+	barrier();
+	memcpy(&input, &wiimote->input, sizeof(input));
+	barrier();
+	if (wiimote->input_seq != seq)
+		return;
+
+	wiimote->buttons = input.buttons;
+
+	/* Only copy (and re-encrypt) the range of controller data bytes that changed */
+	first = memmismatch(wiimote->controller_data, input.controller_data, CONTROLLER_DATA_BYTES);
+	if (first != CONTROLLER_DATA_BYTES) {
+		last = CONTROLLER_DATA_BYTES;
+		while (wiimote->controller_data[last - 1] == input.controller_data[last - 1])
+			last--;
+		memcpy(&wiimote->controller_data[first], &input.controller_data[first], last - first);
+		if (wiimote->controller_data_enc_valid)
+			extension_encrypt_controller_data(wiimote, first, last);
+	}
+
+	wiimote->input_seq_fetched = seq;
+}
+
 void fake_wiimote_mgr_report_input(fake_wiimote_t *wiimote, u16 buttons)
 {
-	bool btn_changed = (wiimote->buttons ^ buttons) != 0;
+	bool btn_changed = (wiimote->input.buttons ^ buttons) != 0;
 
 	if (btn_changed) {
-		wiimote->buttons = buttons;
-		wiimote->input_dirty = true;
+		input_write_begin(wiimote);
+		wiimote->input.buttons = buttons;
+		input_write_end(wiimote);
+		if (FAKE_WIIMOTE_EVENT_DRIVEN_INPUT && !wiimote->reporting_continuous)
+			request_input_wakeup();
 	}
 }
 
 void fake_wiimote_mgr_report_input_ext(fake_wiimote_t *wiimote, u16 buttons, const void *ext_data, u8 ext_size)
 {
-	u8 *ext_controller_data = wiimote->extension_regs.controller_data;
-	bool btn_changed = (wiimote->buttons ^ buttons) != 0;
+	u8 *ext_controller_data = wiimote->input.controller_data;
+	bool btn_changed = (wiimote->input.buttons ^ buttons) != 0;
 	int ext_cmp = memmismatch(ext_controller_data, ext_data, ext_size);
 
 	if (btn_changed || (ext_cmp != ext_size)) {
-		wiimote->buttons = buttons;
+		input_write_begin(wiimote);
+		wiimote->input.buttons = buttons;
 		/* If there are changes to the extension bytes, copy them */
 		if (ext_cmp != ext_size)
 			memcpy(ext_controller_data + ext_cmp, ext_data + ext_cmp, ext_size - ext_cmp);
-		wiimote->input_dirty = true;
+		input_write_end(wiimote);
+		if (FAKE_WIIMOTE_EVENT_DRIVEN_INPUT && !wiimote->reporting_continuous)
+			request_input_wakeup();
 	}
 }
 
@@ -309,22 +605,68 @@ static void check_send_config_for_new_channel(u16 hci_con_handle, l2cap_channel_
 	}
 }
 
+static void extension_generate_key(fake_wiimote_t *wiimote)
+{
+	fake_wiimote_cold_t *cold = fake_wiimote_get_cold(wiimote);
+	const u8 *key_data = cold->extension_regs.encryption_key_data;
+	int i;
+
+	for (i = 0; i < cold->key_cache_count; i++) {
+		if (memcmp(cold->key_cache[i].key_data, key_data,
+			   sizeof(cold->key_cache[i].key_data)) == 0) {
+			wiimote->extension_key = cold->key_cache[i].key;
+			return;
+		}
+	}
+
+	wiimote_crypto_generate_key_from_extension_key_data(&wiimote->extension_key, key_data);
+
+	/* Replace the oldest entry */
+	i = cold->key_cache_next;
+	memcpy(cold->key_cache[i].key_data, key_data, sizeof(cold->key_cache[i].key_data));
+	cold->key_cache[i].key = wiimote->extension_key;
+	cold->key_cache_next = (i + 1) % EXTENSION_KEY_CACHE_SIZE;
+	if (cold->key_cache_count < EXTENSION_KEY_CACHE_SIZE)
+		cold->key_cache_count++;
+}
+
 static bool extension_read_data(fake_wiimote_t *wiimote, void *dst, u16 address, u16 size)
 {
-	if (address + size > sizeof(wiimote->extension_regs))
+	fake_wiimote_cold_t *cold = fake_wiimote_get_cold(wiimote);
+	bool encrypted = cold->extension_regs.encryption == ENCRYPTION_ENABLED;
+	u16 len = 0;
+
+	if (address + size > sizeof(cold->extension_regs))
 		return false;
 
-	/* Copy the requested data from the extension registers */
-	memcpy(dst, (u8 *)&wiimote->extension_regs + address, size);
+	if (encrypted && wiimote->extension_key_dirty) {
+		extension_generate_key(wiimote);
+		wiimote->extension_key_dirty = false;
+		wiimote->controller_data_enc_valid = false;
+	}
 
-	/* Encrypt data read from extension registers (if necessary) */
-	if (wiimote->extension_regs.encryption == ENCRYPTION_ENABLED) {
-		if (wiimote->extension_key_dirty) {
-			wiimote_crypto_generate_key_from_extension_key_data(&wiimote->extension_key,
-						wiimote->extension_regs.encryption_key_data);
-			wiimote->extension_key_dirty = false;
+	/* Copy the requested data from the extension registers. The controller data
+	 * registers are kept in the hot state, next to the buttons, and so is their
+	 * encrypted copy. */
+	if (address < CONTROLLER_DATA_BYTES) {
+		len = MIN2(size, CONTROLLER_DATA_BYTES - address);
+		if (encrypted) {
+			if (!wiimote->controller_data_enc_valid) {
+				extension_encrypt_controller_data(wiimote, 0, CONTROLLER_DATA_BYTES);
+				wiimote->controller_data_enc_valid = true;
+			}
+			memcpy(dst, &wiimote->controller_data_enc[address], len);
+		} else {
+			memcpy(dst, &wiimote->controller_data[address], len);
 		}
-		wiimote_crypto_encrypt(dst, &wiimote->extension_key, address, size);
+	}
+
+	if (size > len) {
+		memcpy((u8 *)dst + len, (u8 *)&cold->extension_regs + address + len, size - len);
+		/* Encrypt data read from extension registers (if necessary) */
+		if (encrypted)
+			wiimote_crypto_encrypt((u8 *)dst + len, &wiimote->extension_key,
+					       address + len, size - len);
 	}
 
 	return true;
@@ -332,27 +674,37 @@ static bool extension_read_data(fake_wiimote_t *wiimote, void *dst, u16 address,
 
 static bool extension_write_data(fake_wiimote_t *wiimote, const void *src, u16 address, u16 size)
 {
-	if (address + size > sizeof(wiimote->extension_regs))
+	fake_wiimote_cold_t *cold = fake_wiimote_get_cold(wiimote);
+	u16 begin, end;
+
+	if (address + size > sizeof(cold->extension_regs))
 		return false;
 
 	if ((address + size > ENCRYPTION_KEY_DATA_BEGIN) && (address < ENCRYPTION_KEY_DATA_END)) {
-		/* We just run the key generation on all writes to the key area */
-		wiimote->extension_key_dirty = true;
+		/* Only regenerate the key if the key bytes actually change */
+		begin = (address > ENCRYPTION_KEY_DATA_BEGIN) ? address : ENCRYPTION_KEY_DATA_BEGIN;
+		end = MIN2(address + size, ENCRYPTION_KEY_DATA_END);
+		if (memcmp((u8 *)&cold->extension_regs + begin, (const u8 *)src + (begin - address),
+			   end - begin) != 0)
+			wiimote->extension_key_dirty = true;
 	}
 
 	/* Copy the requested data to the extension registers */
-	memcpy((u8 *)&wiimote->extension_regs + address, src, size);
+	memcpy((u8 *)&cold->extension_regs + address, src, size);
 	return true;
 }
 
-static bool fake_wiimote_process_read_request(fake_wiimote_t *wiimote)
+/* Sends the next "read data" reply. Returns 0 if there is no read request left, or the
+ * result of the send. The request only advances once its reply is sent. */
+static int fake_wiimote_process_read_request(fake_wiimote_t *wiimote)
 {
 	struct wiimote_input_report_read_data_t reply;
 	u8 error = ERROR_CODE_SUCCESS;
 	u16 address, read_size = MIN2(16, wiimote->read_request.size);
+	int ret;
 
 	if (read_size == 0)
-		return false;
+		return 0;
 
 	address = wiimote->read_request.address;
 	memset(&reply.data, 0, sizeof(reply.data));
@@ -362,7 +714,7 @@ static bool fake_wiimote_process_read_request(fake_wiimote_t *wiimote)
 		if (address + wiimote->read_request.size > EEPROM_FREE_SIZE)
 			error = ERROR_CODE_INVALID_ADDRESS;
 		else
-			memcpy(reply.data, &wiimote->eeprom.data[address], read_size);
+			eeprom_read(fake_wiimote_get_cold(wiimote), reply.data, address, read_size);
 		break;
 	case ADDRESS_SPACE_I2C_BUS:
 	case ADDRESS_SPACE_I2C_BUS_ALT:
@@ -379,23 +731,44 @@ static bool fake_wiimote_process_read_request(fake_wiimote_t *wiimote)
 		break;
 	}
 
+	reply.buttons = wiimote->buttons;
+	/* Real wiimote seems to set size to max value on read errors */
+	reply.size_minus_one = ((error != ERROR_CODE_SUCCESS) ? 16 : read_size) - 1;
+	reply.error = error;
+	reply.address = address;
+	ret = wiimote_send_input_report(wiimote, INPUT_REPORT_ID_READ_DATA_REPLY, &reply,
+					sizeof(reply));
+	if (ret != IOS_OK)
+		return ret;
+
 	/* Stop processing request on read error */
 	if (error != ERROR_CODE_SUCCESS) {
 		wiimote->read_request.size = 0;
-		/* Real wiimote seems to set size to max value on read errors */
-		read_size = 16;
 	} else {
 		wiimote->read_request.address += read_size;
 		wiimote->read_request.size -= read_size;
 	}
 
-	reply.buttons = wiimote->buttons;
-	reply.size_minus_one = read_size - 1;
-	reply.error = error;
-	reply.address = address;
-	send_hid_input_report(wiimote->hci_con_handle, wiimote->psm_hid_intr_chn.remote_cid,
-			      INPUT_REPORT_ID_READ_DATA_REPLY, &reply, sizeof(reply));
-	return true;
+	return 1;
+}
+
+/* Sends a burst of "read data" replies. Returns true while a read request is being processed */
+static bool fake_wiimote_process_read_request_burst(fake_wiimote_t *wiimote)
+{
+	int sent = 0;
+	int ret = 0;
+
+	/* The first reply is always tried. The ReadyQ room doesn't cover the injected message
+	 * slots, so a reply that can't be sent stops the burst, to be sent again next tick. */
+	while ((sent < READ_DATA_REPLIES_PER_TICK) &&
+	       ((sent == 0) || (usb_bulk_in_ready_queue_room() > 0))) {
+		ret = fake_wiimote_process_read_request(wiimote);
+		if (ret <= 0)
+			break;
+		sent++;
+	}
+
+	return (sent > 0) || (ret < 0);
 }
 
 static void fake_wiimote_process_write_request(fake_wiimote_t *wiimote,
@@ -412,8 +785,9 @@ static void fake_wiimote_process_write_request(fake_wiimote_t *wiimote,
 	case ADDRESS_SPACE_EEPROM:
 		if (write->address + write->size > EEPROM_FREE_SIZE)
 			error = ERROR_CODE_INVALID_ADDRESS;
-		else
-			memcpy(&wiimote->eeprom.data[write->address], write->data, write->size);
+		else if (!eeprom_write(fake_wiimote_get_cold(wiimote), write->data,
+				       write->address, write->size))
+			error = ERROR_CODE_BUSY;
 		break;
 	case ADDRESS_SPACE_I2C_BUS:
 	case ADDRESS_SPACE_I2C_BUS_ALT:
@@ -462,7 +836,7 @@ static inline bool fake_wiimote_process_extension_change(fake_wiimote_t *wiimote
 	}
 
 	if (id_code)
-		memcpy(wiimote->extension_regs.identifier, id_code, 6);
+		memcpy(fake_wiimote_get_cold(wiimote)->extension_regs.identifier, id_code, 6);
 	wiimote->cur_extension = wiimote->new_extension;
 
 	/* Following a connection or disconnection event on the Extension Port, data reporting
@@ -473,12 +847,13 @@ static inline bool fake_wiimote_process_extension_change(fake_wiimote_t *wiimote
 	return true;
 }
 
+/* Accelerometer data of a Wiimote lying flat, matching the default EEPROM calibration */
+static const u8 accel_data_at_rest[3] = {0x80, 0x80, 0x9a};
+
 static void fake_wiimote_send_data_report(fake_wiimote_t *wiimote)
 {
 	u8 report_data[CONTROLLER_DATA_BYTES] ATTRIBUTE_ALIGN(4);
-	bool has_btn;
-	u8 ext_size, ext_offset;
-	u8 report_size;
+	const struct wiimote_report_layout_t *layout = wiimote->report_layout;
 
 	if (wiimote->reporting_mode == INPUT_REPORT_ID_REPORT_DISABLED) {
 		/* The wiimote is in this disabled state after an extension change.
@@ -486,32 +861,85 @@ static void fake_wiimote_send_data_report(fake_wiimote_t *wiimote)
 		return;
 	}
 
-	if (wiimote->reporting_continuous || wiimote->input_dirty) {
-		has_btn = input_report_has_btn(wiimote->reporting_mode);
-		ext_size = input_report_ext_size(wiimote->reporting_mode);
-		ext_offset = input_report_ext_offset(wiimote->reporting_mode);
-		report_size = (has_btn ? 2 : 0) + ext_size;
+	fake_wiimote_fetch_input(wiimote);
 
-		if (has_btn)
+	if (wiimote->reporting_continuous ||
+	    (wiimote->input_seq_fetched != wiimote->input_seq_reported)) {
+		if (layout->btn_size)
 			memcpy(report_data, &wiimote->buttons, sizeof(wiimote->buttons));
 
-		if (ext_size) {
+		/* We have no motion sensors nor IR camera */
+		if (layout->acc_size)
+			memcpy(report_data + layout->acc_offset, accel_data_at_rest,
+			       sizeof(accel_data_at_rest));
+		if (layout->ir_size)
+			memset(report_data + layout->ir_offset, IR_OBJECT_NONE, layout->ir_size);
+
+		if (layout->ext_size) {
 			/* Takes care of encrypting the extension data if necessary */
-			extension_read_data(wiimote, report_data + ext_offset, 0, ext_size);
+			extension_read_data(wiimote, report_data + layout->ext_offset, 0,
+					    layout->ext_size);
 		}
 
-		send_hid_input_report(wiimote->hci_con_handle, wiimote->psm_hid_intr_chn.remote_cid,
-				      wiimote->reporting_mode, report_data, report_size);
+		wiimote_send_data_report(wiimote, report_data, layout->size);
 
-		wiimote->input_dirty = false;
+		wiimote->input_seq_reported = wiimote->input_seq_fetched;
+		wiimote->report_sent = true;
 	}
 }
 
-static void fake_wiimote_tick(fake_wiimote_t *wiimote)
+/* Advances the HID channels setup as far as the host responses allow. Each step is taken as
+ * soon as the host answers the previous one, instead of waiting for the next tick. */
+static void fake_wiimote_acl_link(fake_wiimote_t *wiimote)
 {
 	int ret;
+	u16 local_cid;
+
+	/* A connection request that could not be injected is retried on the next step or tick */
+	if (!wiimote->psm_hid_cntl_chn.valid) {
+		local_cid = generate_l2cap_channel_id();
+		ret = l2cap_send_connect_req(wiimote->hci_con_handle, L2CAP_PSM_HID_CNTL, local_cid);
+		if (ret == IOS_OK) {
+			l2cap_channel_info_setup(&wiimote->psm_hid_cntl_chn, L2CAP_PSM_HID_CNTL,
+						 local_cid);
+			DEBUG("Generated local CID for HID CNTL: 0x%x\n", local_cid);
+		}
+	}
+
+	/* The interrupt channel is connected after the control channel, like a real Wiimote */
+	if (!wiimote->psm_hid_intr_chn.valid &&
+	    l2cap_channel_is_accepted(&wiimote->psm_hid_cntl_chn)) {
+		local_cid = generate_l2cap_channel_id();
+		ret = l2cap_send_connect_req(wiimote->hci_con_handle, L2CAP_PSM_HID_INTR, local_cid);
+		if (ret == IOS_OK) {
+			l2cap_channel_info_setup(&wiimote->psm_hid_intr_chn, L2CAP_PSM_HID_INTR,
+						 local_cid);
+			DEBUG("Generated local CID for HID INTR: 0x%x\n", local_cid);
+		}
+	}
+
+	/* Send configuration for any newly connected channels. */
+	check_send_config_for_new_channel(wiimote->hci_con_handle, &wiimote->psm_hid_cntl_chn);
+	check_send_config_for_new_channel(wiimote->hci_con_handle, &wiimote->psm_hid_intr_chn);
+
+	if (l2cap_channel_is_complete(&wiimote->psm_hid_cntl_chn) &&
+	    l2cap_channel_is_complete(&wiimote->psm_hid_intr_chn)) {
+		wiimote->acl_state = ACL_STATE_INACTIVE;
+		/* Call assigned() input_device callback */
+		if (!wiimote->input_removed && wiimote->input_device_ops->assigned)
+			wiimote->input_device_ops->assigned(wiimote->usrdata, wiimote);
+	}
+}
+
+static void fake_wiimote_tick(fake_wiimote_t *wiimote)
+{
 	bool req;
 
+	if (wiimote->input_removed) {
+		fake_wiimote_disconnect(wiimote);
+		return;
+	}
+
 	if (wiimote->baseband_state == BASEBAND_STATE_REQUEST_CONNECTION) {
 		req = hci_request_connection(&wiimote->bdaddr, WIIMOTE_HCI_CLASS_0,
 					     WIIMOTE_HCI_CLASS_1, WIIMOTE_HCI_CLASS_2,
@@ -523,33 +951,14 @@ static void fake_wiimote_tick(fake_wiimote_t *wiimote)
 		/* "If the connection originated from the device (Wiimote) it will create
 		 * HID control and interrupt channels (in that order)." */
 		if (wiimote->acl_state == ACL_STATE_LINKING) {
-			/* If-else-if cascade to avoid sending too many packets on the same "tick" */
-			if (!wiimote->psm_hid_cntl_chn.valid) {
-				u16 local_cid = generate_l2cap_channel_id();
-				ret = l2cap_send_connect_req(wiimote->hci_con_handle, L2CAP_PSM_HID_CNTL,
-							     local_cid);
-				assert(ret == IOS_OK);
-				l2cap_channel_info_setup(&wiimote->psm_hid_cntl_chn, L2CAP_PSM_HID_CNTL, local_cid);
-				DEBUG("Generated local CID for HID CNTL: 0x%x\n", local_cid);
-			} else if (!wiimote->psm_hid_intr_chn.valid) {
-				u16 local_cid = generate_l2cap_channel_id();
-				ret = l2cap_send_connect_req(wiimote->hci_con_handle, L2CAP_PSM_HID_INTR,
-							     local_cid);
-				assert(ret == IOS_OK);
-				l2cap_channel_info_setup(&wiimote->psm_hid_intr_chn, L2CAP_PSM_HID_INTR, local_cid);
-				DEBUG("Generated local CID for HID INTR: 0x%x\n", local_cid);
-			} else if (l2cap_channel_is_complete(&wiimote->psm_hid_cntl_chn) &&
-				   l2cap_channel_is_complete(&wiimote->psm_hid_intr_chn)) {
-				wiimote->acl_state = ACL_STATE_INACTIVE;
-				/* Call assigned() input_device callback */
-				wiimote->input_device_ops->assigned(wiimote->usrdata, wiimote);
-			}
-			/* Send configuration for any newly connected channels. */
-			check_send_config_for_new_channel(wiimote->hci_con_handle, &wiimote->psm_hid_cntl_chn);
-			check_send_config_for_new_channel(wiimote->hci_con_handle, &wiimote->psm_hid_intr_chn);
+			/* Normally driven by the incoming signal packets. The tick only starts it. */
+			fake_wiimote_acl_link(wiimote);
 		} else {
+			/* A new tick period starts: allow sending an input report again */
+			wiimote->report_sent = false;
+
 			/* Both HID ctrl and intr channels are connected (we only need intr though) */
-			if (fake_wiimote_process_read_request(wiimote)) {
+			if (fake_wiimote_process_read_request_burst(wiimote)) {
 				/* Read requests suppress normal input reports.
 				 * Don't send any other reports */
 				return;
@@ -567,9 +976,35 @@ static void fake_wiimote_tick(fake_wiimote_t *wiimote)
 
 void fake_wiimote_mgr_tick_devices(void)
 {
-	for (int i = 0; i < MAX_FAKE_WIIMOTES; i++) {
-		if (fake_wiimotes[i].active)
-			fake_wiimote_tick(&fake_wiimotes[i]);
+	u32 mask = fake_wiimotes_active_mask();
+
+	while (mask) {
+		fake_wiimote_tick(&fake_wiimotes[__builtin_ctz(mask)]);
+		mask &= mask - 1;
+	}
+}
+
+void fake_wiimote_mgr_handle_input_wakeup(void)
+{
+	fake_wiimote_t *wiimote;
+	u32 mask = fake_wiimotes_active_mask();
+
+	for (; mask; mask &= mask - 1) {
+		wiimote = &fake_wiimotes[__builtin_ctz(mask)];
+		if (wiimote->input_removed || !fake_wiimote_is_connected(wiimote) ||
+		    (wiimote->acl_state != ACL_STATE_INACTIVE))
+			continue;
+
+		/* Read requests and extension changes are processed on the tick */
+		if (wiimote->read_request.size || (wiimote->new_extension != wiimote->cur_extension))
+			continue;
+
+		/* Rate-limit to one report per tick period, like a real Wiimote.
+		 * In continuous reporting mode the tick already sends one per period. */
+		if (wiimote->reporting_continuous || wiimote->report_sent)
+			continue;
+
+		fake_wiimote_send_data_report(wiimote);
 	}
 }
 
@@ -578,133 +1013,117 @@ void fake_wiimote_mgr_tick_devices(void)
 bool fake_wiimote_mgr_handle_hci_cmd_accept_con(const bdaddr_t *bdaddr, u8 role)
 {
 	int ret;
-
 	/* Check if the bdaddr belongs to a fake wiimote */
-	for (int i = 0; i < MAX_FAKE_WIIMOTES; i++) {
-		if (memcmp(bdaddr, &fake_wiimotes[i].bdaddr, sizeof(bdaddr_t) != 0))
-			continue;
-
-		/* Connection accepted to our fake wiimote */
-		DEBUG("Connection accepted for fake Wiimote %d!\n", i);
+	fake_wiimote_t *wiimote = get_fake_wiimote_for_bdaddr(bdaddr);
+	if (!wiimote)
+		return false;
 
-		/* The Accept_Connection_Request command will cause the Command Status
-		   event to be sent from the Host Controller when the Host Controller
-		   begins setting up the connection */
+	/* Connection accepted to our fake wiimote */
+	DEBUG("Connection accepted for fake Wiimote %d!\n", wiimote - fake_wiimotes);
 
-		ret = enqueue_hci_event_command_status(HCI_CMD_ACCEPT_CON);
-		assert(ret == IOS_OK);
+	/* The Accept_Connection_Request command will cause the Command Status
+	   event to be sent from the Host Controller when the Host Controller
+	   begins setting up the connection */
 
-		fake_wiimotes[i].baseband_state = BASEBAND_STATE_COMPLETE;
-		fake_wiimotes[i].hci_con_handle = hci_con_handle_virt_alloc();
-		DEBUG("Fake Wiimote %d got HCI con_handle: 0x%x\n", i, fake_wiimotes[i].hci_con_handle);
+	ret = enqueue_hci_event_command_status(HCI_CMD_ACCEPT_CON);
+	assert(ret == IOS_OK);
 
-		/* We can start the ACL (L2CAP) linking now */
-		fake_wiimotes[i].acl_state = ACL_STATE_LINKING;
+	wiimote->hci_con_handle = hci_con_handle_virt_alloc();
+	assert(wiimote->hci_con_handle != HCI_CON_HANDLE_INVALID);
+	wiimote->baseband_state = BASEBAND_STATE_COMPLETE;
+	fake_wiimotes_by_con_handle[wiimote->hci_con_handle] = wiimote;
+	DEBUG("Fake Wiimote %d got HCI con_handle: 0x%x\n", wiimote - fake_wiimotes,
+	      wiimote->hci_con_handle);
 
-		if (role == HCI_ROLE_MASTER) {
-			ret = enqueue_hci_event_role_change(bdaddr, HCI_ROLE_MASTER);
-			assert(ret == IOS_OK);
-		}
+	/* We can start the ACL (L2CAP) linking now */
+	wiimote->acl_state = ACL_STATE_LINKING;
 
-		/* In addition, when the Link Manager determines the connection is established,
-		 * the Host Controllers on both Bluetooth devices that form the connection
-		 * will send a Connection Complete event to each Host */
-		ret = enqueue_hci_event_con_compl(bdaddr, fake_wiimotes[i].hci_con_handle, 0);
+	if (role == HCI_ROLE_MASTER) {
+		ret = enqueue_hci_event_role_change(bdaddr, HCI_ROLE_MASTER);
 		assert(ret == IOS_OK);
-
-		DEBUG("Connection complete sent, starting ACL linking!\n");
-		return true;
 	}
 
-	return false;
+	/* In addition, when the Link Manager determines the connection is established,
+	 * the Host Controllers on both Bluetooth devices that form the connection
+	 * will send a Connection Complete event to each Host */
+	ret = enqueue_hci_event_con_compl(bdaddr, wiimote->hci_con_handle, 0);
+	assert(ret == IOS_OK);
+
+	DEBUG("Connection complete sent, starting ACL linking!\n");
+	return true;
 }
 
 bool fake_wiimote_mgr_handle_hci_cmd_disconnect(u16 hci_con_handle, u8 reason)
 {
 	/* Check if the HCI connection handle belongs to a fake wiimote */
-	for (int i = 0; i < MAX_FAKE_WIIMOTES; i++) {
-		if (!fake_wiimote_is_connected(&fake_wiimotes[i]) ||
-		    (fake_wiimotes[i].hci_con_handle != hci_con_handle))
-			continue;
-
-		/* Host wants disconnection to our fake wiimote. Disconnect */
-		DEBUG("Host requested disconnection of fake Wiimote %d.\n", i);
-		fake_wiimote_disconnect(&fake_wiimotes[i]);
-		return true;
-	}
+	fake_wiimote_t *wiimote = get_fake_wiimote_for_con_handle(hci_con_handle);
+	if (!wiimote)
+		return false;
 
-	return false;
+	/* Host wants disconnection to our fake wiimote. Disconnect */
+	DEBUG("Host requested disconnection of fake Wiimote %d.\n", wiimote - fake_wiimotes);
+	fake_wiimote_disconnect(wiimote);
+	return true;
 }
 
 bool fake_wiimote_mgr_handle_hci_cmd_reject_con(const bdaddr_t *bdaddr, u8 reason)
 {
 	/* Check if the bdaddr belongs to a fake wiimote */
-	for (int i = 0; i < MAX_FAKE_WIIMOTES; i++) {
-		if (memcmp(bdaddr, &fake_wiimotes[i].bdaddr, sizeof(bdaddr_t) != 0))
-			continue;
-
-		/* Connection rejected to our fake wiimote. Disconnect */
-		DEBUG("Connection to fake Wiimote %d rejected!\n", i);
-		fake_wiimote_disconnect(&fake_wiimotes[i]);
-		return true;
-	}
+	fake_wiimote_t *wiimote = get_fake_wiimote_for_bdaddr(bdaddr);
+	if (!wiimote)
+		return false;
 
-	return false;
+	/* Connection rejected to our fake wiimote. Disconnect */
+	DEBUG("Connection to fake Wiimote %d rejected!\n", wiimote - fake_wiimotes);
+	fake_wiimote_disconnect(wiimote);
+	return true;
 }
 
 bool fake_wiimote_mgr_hci_handle_belongs_to_fake_wiimote(u16 hci_con_handle)
 {
-	/* Check if the HCI connection handle belongs to a fake wiimote */
-	for (int i = 0; i < MAX_FAKE_WIIMOTES; i++) {
-		if (fake_wiimote_is_connected(&fake_wiimotes[i]) &&
-		    (fake_wiimotes[i].hci_con_handle == hci_con_handle))
-		return true;
-	}
-
-	return false;
+	return get_fake_wiimote_for_con_handle(hci_con_handle) != NULL;
 }
 
 static void handle_l2cap_config_req(fake_wiimote_t *wiimote, u8 ident, u16 dcid, u16 flags,
 				    const u8 *options, u16 options_size)
 {
-	u8 tmp[256];
+	/* Options echoed back in the response */
+	u8 tmp[L2CAP_CFG_RSP_MAX_OPTIONS];
 	u32 opt_size;
 	l2cap_channel_info_t *info;
-	l2cap_cfg_opt_t *opt;
-	l2cap_cfg_opt_val_t *val;
-	l2cap_cfg_rsp_cp *rsp = (l2cap_cfg_rsp_cp *)tmp;
+	const l2cap_cfg_opt_t *opt;
+	const l2cap_cfg_opt_val_t *val;
 	u32 offset = 0;
 	u32 resp_len = 0;
 	/* If the option is not provided, configure the default. */
 	u16 remote_mtu = L2CAP_MTU_DEFAULT;
 
 	assert(flags == 0x00);
-	assert(options_size <= sizeof(tmp));
 
 	info = get_channel_info(wiimote, dcid);
-	assert(info);
-
-	/* Response to the config request */
-	rsp->scid = htole16(info->remote_cid);
-	rsp->flags = htole16(0x00);
-	rsp->result = htole16(L2CAP_SUCCESS);
-	resp_len += sizeof(l2cap_cfg_rsp_cp);
+	if (!info)
+		return;
 
 	/* Read configuration options. */
-	while (offset < options_size) {
-		opt = (l2cap_cfg_opt_t *)&options[offset];
-		offset += sizeof(l2cap_cfg_opt_t);
-		val = (l2cap_cfg_opt_val_t *)&options[offset];
+	while (offset + sizeof(l2cap_cfg_opt_t) <= options_size) {
+		opt = (const l2cap_cfg_opt_t *)&options[offset];
+		opt_size = sizeof(l2cap_cfg_opt_t) + opt->length;
+		/* Truncated option */
+		if (offset + opt_size > options_size)
+			break;
+		val = (const l2cap_cfg_opt_val_t *)&options[offset + sizeof(l2cap_cfg_opt_t)];
 
 		switch (opt->type) {
 		case L2CAP_OPT_MTU:
-			assert(opt->length == L2CAP_OPT_MTU_SIZE);
+			if (opt->length != L2CAP_OPT_MTU_SIZE)
+				break;
 			remote_mtu = le16toh(val->mtu);
 			DEBUG("      MTU configured to: 0x%x\n", remote_mtu);
 			break;
 		/* We don't care what the flush timeout is. Our packets are not dropped. */
 		case L2CAP_OPT_FLUSH_TIMO:
-			assert(opt->length == L2CAP_OPT_FLUSH_TIMO_SIZE);
+			if (opt->length != L2CAP_OPT_FLUSH_TIMO_SIZE)
+				break;
 			DEBUG("      Flush timeout configured to 0x%x\n", val->flush_timo);
 			break;
 		default:
@@ -712,14 +1131,16 @@ static void handle_l2cap_config_req(fake_wiimote_t *wiimote, u8 ident, u16 dcid,
 			break;
 		}
 
-		offset += opt->length;
-		opt_size = sizeof(l2cap_cfg_opt_t) + opt->length;
-		memcpy(&tmp[resp_len], options, opt_size);
-		resp_len += opt_size;
+		/* Echo the options that fit, the MTU comes first anyway */
+		if (resp_len + opt_size <= sizeof(tmp)) {
+			memcpy(&tmp[resp_len], opt, opt_size);
+			resp_len += opt_size;
+		}
+		offset += opt_size;
 	}
 
 	/* Send Respone */
-	l2cap_send_config_rsp(wiimote->hci_con_handle, dcid, ident, tmp, resp_len);
+	l2cap_send_config_rsp(wiimote->hci_con_handle, info->remote_cid, ident, tmp, resp_len);
 
 	/* Set the MTU */
 	info->remote_mtu = remote_mtu;
@@ -766,6 +1187,10 @@ static void handle_l2cap_signal_channel(fake_wiimote_t *wiimote, u8 code, u8 ide
 
 		/* Save endpoint's Destination CID  */
 		info->remote_cid = dcid;
+		if (info == &wiimote->psm_hid_intr_chn) {
+			hid_input_report_hdr_init(&wiimote->intr_report_hdr, wiimote->hci_con_handle, dcid);
+			wiimote->queued_data_report = NULL;
+		}
 		break;
 	}
 	case L2CAP_CONFIG_REQ: {
@@ -775,6 +1200,9 @@ static void handle_l2cap_signal_channel(fake_wiimote_t *wiimote, u8 code, u8 ide
 		const void *options = (const void *)((u8 *)rsp + sizeof(l2cap_cfg_req_cp));
 		UNUSED(flags);
 
+		if (size < sizeof(l2cap_cfg_req_cp))
+			break;
+
 		DEBUG("  L2CAP_CONFIG_REQ: dcid: 0x%x, flags: 0x%x\n", dcid, flags);
 		handle_l2cap_config_req(wiimote, ident, dcid, flags, options,
 					size - sizeof(l2cap_cfg_req_cp));
@@ -808,7 +1236,7 @@ static void handle_l2cap_signal_channel(fake_wiimote_t *wiimote, u8 code, u8 ide
 
 		/* If it's the L2CAP Interrupt channel connection, notify the driver of disconnection */
 		if ((info->psm == L2CAP_PSM_HID_INTR) && l2cap_channel_is_complete(info)) {
-			if (wiimote->input_device_ops->disconnect)
+			if (!wiimote->input_removed && wiimote->input_device_ops->disconnect)
 				wiimote->input_device_ops->disconnect(wiimote->usrdata);
 			info->valid = false;
 		}
@@ -830,6 +1258,9 @@ static void handle_l2cap_signal_channel_request(fake_wiimote_t *wiimote, const v
 		cmd_hdr = (const void *)data;
 		cmd_len = le16toh(cmd_hdr->length);
 		cmd_payload = (const void *)((u8 *)data + sizeof(*cmd_hdr));
+		/* Truncated command */
+		if (sizeof(*cmd_hdr) + cmd_len > length)
+			break;
 
 		handle_l2cap_signal_channel(wiimote, cmd_hdr->code, cmd_hdr->ident,
 					    cmd_payload, cmd_len);
@@ -837,6 +1268,10 @@ static void handle_l2cap_signal_channel_request(fake_wiimote_t *wiimote, const v
 		data += sizeof(l2cap_cmd_hdr_t) + cmd_len;
 		length -= sizeof(l2cap_cmd_hdr_t) + cmd_len;
 	}
+
+	/* Answer right away if the host responses let the HID channels setup progress */
+	if (fake_wiimote_is_connected(wiimote) && (wiimote->acl_state == ACL_STATE_LINKING))
+		fake_wiimote_acl_link(wiimote);
 }
 
 static void handle_hid_intr_data_output(fake_wiimote_t *wiimote, const u8 *data, u16 size)
@@ -850,7 +1285,7 @@ static void handle_hid_intr_data_output(fake_wiimote_t *wiimote, const u8 *data,
 	case OUTPUT_REPORT_ID_LED: {
 		struct wiimote_output_report_led_t *led = (void *)&data[1];
 		/* Call set_leds() input_device callback */
-		if (wiimote->input_device_ops->set_leds)
+		if (!wiimote->input_removed && wiimote->input_device_ops->set_leds)
 			wiimote->input_device_ops->set_leds(wiimote->usrdata, led->leds);
 		if (led->ack)
 			wiimote_send_ack(wiimote, OUTPUT_REPORT_ID_LED, ERROR_CODE_SUCCESS);
@@ -866,6 +1301,7 @@ static void handle_hid_intr_data_output(fake_wiimote_t *wiimote, const u8 *data,
 			mode->mode, mode->continuous, mode->rumble, mode->ack);
 		wiimote->reporting_mode = mode->mode;
 		wiimote->reporting_continuous = mode->continuous;
+		wiimote->report_layout = wiimote_get_report_layout(mode->mode);
 		if (mode->ack)
 			wiimote_send_ack(wiimote, OUTPUT_REPORT_ID_REPORT_MODE, ERROR_CODE_SUCCESS);
 		break;
@@ -896,9 +1332,10 @@ static void handle_hid_intr_data_output(fake_wiimote_t *wiimote, const u8 *data,
 		/* A zero size request is just ignored, like on the real wiimote */
 		wiimote->read_request.size = read->size;
 
-		/* Send first "read-data reply". If more data needs to be sent,
+		/* Send the first "read-data replies". If more data needs to be sent,
 		 * it will happen on the next "tick()" */
-		fake_wiimote_process_read_request(wiimote);
+		fake_wiimote_process_read_request_burst(wiimote);
+		break;
 	}
 	default:
 		DEBUG("Unhandled output report: 0x%x\n", data[0]);
@@ -911,48 +1348,44 @@ bool fake_wiimote_mgr_handle_acl_data_out_request_from_host(u16 hci_con_handle,
 	const l2cap_hdr_t *header;
 	u16 dcid, length;
 	const u8 *payload;
+	fake_wiimote_t *wiimote;
 
 	/* Check if the HCI connection handle belongs to a fake wiimote */
-	for (int i = 0; i < MAX_FAKE_WIIMOTES; i++) {
-		if (!fake_wiimote_is_connected(&fake_wiimotes[i]) ||
-		    (fake_wiimotes[i].hci_con_handle != hci_con_handle))
-			continue;
+	wiimote = get_fake_wiimote_for_con_handle(hci_con_handle);
+	if (!wiimote)
+		return false;
 
-		/* L2CAP header */
-		header  = (const void *)((u8 *)acl + sizeof(hci_acldata_hdr_t));
-		length  = le16toh(header->length);
-		dcid    = le16toh(header->dcid);
-		payload = (u8 *)header + sizeof(l2cap_hdr_t);
+	/* L2CAP header */
+	header  = (const void *)((u8 *)acl + sizeof(hci_acldata_hdr_t));
+	length  = le16toh(header->length);
+	dcid    = le16toh(header->dcid);
+	payload = (u8 *)header + sizeof(l2cap_hdr_t);
 
-		DEBUG("FD ACL OUT: con_handle: 0x%x, dcid: 0x%x, len: 0x%x\n", hci_con_handle, dcid, length);
+	DEBUG("FD ACL OUT: con_handle: 0x%x, dcid: 0x%x, len: 0x%x\n", hci_con_handle, dcid, length);
 
-		if (dcid == L2CAP_SIGNAL_CID) {
-			handle_l2cap_signal_channel_request(&fake_wiimotes[i], payload, length);
-		} else {
-			l2cap_channel_info_t *info = get_channel_info(&fake_wiimotes[i], dcid);
-			if (info) {
-				switch (info->psm) {
-				case L2CAP_PSM_SDP:
-					/* TODO */
-					DEBUG("  PSM HID SDP\n");
-					break;
-				case L2CAP_PSM_HID_CNTL:
-					/* TODO */
-					DEBUG("  PSM HID CNTL\n");
-					break;
-				case L2CAP_PSM_HID_INTR:
-					if (payload[0] == ((HID_TYPE_DATA << 4) | HID_PARAM_OUTPUT))
-						handle_hid_intr_data_output(&fake_wiimotes[i],
-									    &payload[1],
-									    length - 1);
-					break;
-				}
-			} else {
-				DEBUG("Received L2CAP packet to unknown channel: 0x%x\n", dcid);
+	if (dcid == L2CAP_SIGNAL_CID) {
+		handle_l2cap_signal_channel_request(wiimote, payload, length);
+	} else {
+		l2cap_channel_info_t *info = get_channel_info(wiimote, dcid);
+		if (info) {
+			switch (info->psm) {
+			case L2CAP_PSM_SDP:
+				/* TODO */
+				DEBUG("  PSM HID SDP\n");
+				break;
+			case L2CAP_PSM_HID_CNTL:
+				/* TODO */
+				DEBUG("  PSM HID CNTL\n");
+				break;
+			case L2CAP_PSM_HID_INTR:
+				if (payload[0] == ((HID_TYPE_DATA << 4) | HID_PARAM_OUTPUT))
+					handle_hid_intr_data_output(wiimote, &payload[1], length - 1);
+				break;
 			}
+		} else {
+			DEBUG("Received L2CAP packet to unknown channel: 0x%x\n", dcid);
 		}
-		return true;
 	}
 
-	return false;
+	return true;
 }
@@ -1,4 +1,5 @@
 #include <stdbool.h>
+#include <stddef.h>
 #include <string.h>
 #include "fake_wiimote_mgr.h"
 #include "hci.h"
@@ -7,32 +8,81 @@
 #include "utils.h"
 #include "syscalls.h"
 
-#define MAX_HCI_CONNECTIONS	32
+#define HCI_PHYS_HASH_SIZE	32
+#define HCI_SLOT_NONE		0xFF
+/* Maximum connection handles in the Number_Of_Completed_Packets events we generate */
+#define HCI_NUM_COMPL_PKTS_BATCH	8
+
+static_assert((HCI_PHYS_HASH_SIZE & (HCI_PHYS_HASH_SIZE - 1)) == 0);
+static_assert(MAX_HCI_CONNECTIONS < HCI_SLOT_NONE);
 
 /* Snooped HCI state (requested by SW BT stack) */
 static u8 hci_unit_class[HCI_CLASS_SIZE];
 static u8 hci_page_scan_enable = 0;
+/* Size of the biggest ACL packet the controller uses (header included), 0 if not known yet */
+static u16 hci_acl_data_pkt_size = 0;
 
-/* Simulated HCI state */
+/* Simulated HCI state. The virtual connection handle (the one we return to the BT SW stack)
+ * is the index of its entry, so virt -> phys is a single lookup. */
 static struct {
 	bool valid;
-	u16 virt; /* The one we return to the BT SW stack */
+	bool mapped; /* Belongs to a real device */
 	u16 phys; /* The one the BT dongle uses */
-} hci_virt_con_handle_map_table[MAX_HCI_CONNECTIONS];
+	u8 hash_next; /* Next entry in the same phys -> virt hash chain */
+	u16 compl_pkts; /* Fake devices: ACL packets consumed but not reported to the host yet */
+} hci_con_handle_table[MAX_HCI_CONNECTIONS];
+
+/* phys -> virt hash chains */
+static u8 hci_phys_hash[HCI_PHYS_HASH_SIZE];
+
+/* FIFO of free virtual handles, so that a released handle is reused as late as possible */
+static u8 hci_virt_free_fifo[MAX_HCI_CONNECTIONS];
+static u8 hci_virt_free_head;
+static u8 hci_virt_free_count;
 
 void hci_state_init()
 {
-	for (int i = 0; i < ARRAY_SIZE(hci_virt_con_handle_map_table); i++)
-		hci_virt_con_handle_map_table[i].valid = false;
+	for (int i = 0; i < ARRAY_SIZE(hci_con_handle_table); i++) {
+		hci_con_handle_table[i].valid = false;
+		hci_virt_free_fifo[i] = i;
+	}
+	hci_virt_free_head = 0;
+	hci_virt_free_count = MAX_HCI_CONNECTIONS;
+
+	for (int i = 0; i < ARRAY_SIZE(hci_phys_hash); i++)
+		hci_phys_hash[i] = HCI_SLOT_NONE;
 }
 
 u16 hci_con_handle_virt_alloc(void)
 {
-	/* FIXME: We can have collisions after it wraps around! */
-	static u16 last_virt_con_handle = 0;
-	u16 ret = last_virt_con_handle;
-	last_virt_con_handle = (last_virt_con_handle + 1) & 0x0EFF;
-	return ret;
+	u8 virt;
+
+	if (hci_virt_free_count == 0)
+		return HCI_CON_HANDLE_INVALID;
+
+	virt = hci_virt_free_fifo[hci_virt_free_head];
+	hci_virt_free_head = (hci_virt_free_head + 1) % MAX_HCI_CONNECTIONS;
+	hci_virt_free_count--;
+
+	hci_con_handle_table[virt].valid = true;
+	hci_con_handle_table[virt].mapped = false;
+	hci_con_handle_table[virt].compl_pkts = 0;
+	return virt;
+}
+
+void hci_con_handle_virt_free(u16 virt)
+{
+	u32 tail;
+
+	if ((virt >= MAX_HCI_CONNECTIONS) || !hci_con_handle_table[virt].valid)
+		return;
+
+	/* On disconnection, the host considers all the packets for that handle completed */
+	hci_con_handle_table[virt].valid = false;
+	hci_con_handle_table[virt].compl_pkts = 0;
+	tail = (hci_virt_free_head + hci_virt_free_count) % MAX_HCI_CONNECTIONS;
+	hci_virt_free_fifo[tail] = virt;
+	hci_virt_free_count++;
 }
 
 bool hci_request_connection(const bdaddr_t *bdaddr, u8 uclass0, u8 uclass1, u8 uclass2,
@@ -48,39 +98,97 @@ bool hci_request_connection(const bdaddr_t *bdaddr, u8 uclass0, u8 uclass1, u8 u
 	return ret == IOS_OK;
 }
 
+/* Flow control for fake devices. We consume their ACL packets right away, so we have to
+ * give the host its buffer credits back, like a real controller does. */
+
+static u8 hci_fill_fake_num_compl_pkts(hci_num_compl_pkts_info *info, u8 max)
+{
+	u8 num = 0;
+
+	for (int i = 0; (i < MAX_HCI_CONNECTIONS) && (num < max); i++) {
+		if (!hci_con_handle_table[i].valid || !hci_con_handle_table[i].compl_pkts)
+			continue;
+
+		info[num].con_handle = i;
+		info[num].compl_pkts = hci_con_handle_table[i].compl_pkts;
+		num++;
+	}
+
+	return num;
+}
+
+static void hci_clear_fake_num_compl_pkts(const hci_num_compl_pkts_info *info, u8 num)
+{
+	for (int i = 0; i < num; i++)
+		hci_con_handle_table[info[i].con_handle].compl_pkts -= info[i].compl_pkts;
+}
+
+u16 hci_state_get_acl_data_pkt_size(void)
+{
+	return hci_acl_data_pkt_size;
+}
+
+void hci_state_tick(void)
+{
+	hci_num_compl_pkts_info info[HCI_NUM_COMPL_PKTS_BATCH];
+	u8 num;
+
+	/* Report all the packets completed since the last tick in a single event */
+	num = hci_fill_fake_num_compl_pkts(info, ARRAY_SIZE(info));
+	if (num && (enqueue_hci_event_num_compl_pkts(info, num) == IOS_OK))
+		hci_clear_fake_num_compl_pkts(info, num);
+}
+
 /* HCI connection handle virt<->phys mapping */
 
+static inline u8 *hci_phys_hash_bucket(u16 phys)
+{
+	return &hci_phys_hash[phys & (HCI_PHYS_HASH_SIZE - 1)];
+}
+
 static bool hci_virt_con_handle_map(u16 phys, u16 virt)
 {
-	for (int i = 0; i < ARRAY_SIZE(hci_virt_con_handle_map_table); i++) {
-		if (!hci_virt_con_handle_map_table[i].valid) {
-			hci_virt_con_handle_map_table[i].virt = virt;
-			hci_virt_con_handle_map_table[i].phys = phys;
-			hci_virt_con_handle_map_table[i].valid = 1;
-			return true;
-		}
-	}
-	return false;
+	u8 *bucket;
+
+	if ((virt >= MAX_HCI_CONNECTIONS) || !hci_con_handle_table[virt].valid)
+		return false;
+
+	bucket = hci_phys_hash_bucket(phys);
+	hci_con_handle_table[virt].phys = phys;
+	hci_con_handle_table[virt].mapped = true;
+	hci_con_handle_table[virt].hash_next = *bucket;
+	*bucket = virt;
+	return true;
 }
 
 static bool hci_virt_con_handle_unmap_virt(u16 virt)
 {
-	for (int i = 0; i < ARRAY_SIZE(hci_virt_con_handle_map_table); i++) {
-		if (hci_virt_con_handle_map_table[i].valid &&
-		    hci_virt_con_handle_map_table[i].virt == virt) {
-			hci_virt_con_handle_map_table[i].valid = 0;
-			return true;
+	u8 *link;
+
+	if ((virt >= MAX_HCI_CONNECTIONS) || !hci_con_handle_table[virt].mapped)
+		return false;
+
+	for (link = hci_phys_hash_bucket(hci_con_handle_table[virt].phys);
+	     *link != HCI_SLOT_NONE; link = &hci_con_handle_table[*link].hash_next) {
+		if (*link == virt) {
+			*link = hci_con_handle_table[virt].hash_next;
+			break;
 		}
 	}
-	return false;
+
+	hci_con_handle_table[virt].mapped = false;
+	hci_con_handle_virt_free(virt);
+	return true;
 }
 
 static bool hci_virt_con_handle_get_virt(u16 phys, u16 *virt)
 {
-	for (int i = 0; i < ARRAY_SIZE(hci_virt_con_handle_map_table); i++) {
-		if (hci_virt_con_handle_map_table[i].valid &&
-		    hci_virt_con_handle_map_table[i].phys == phys) {
-			*virt = hci_virt_con_handle_map_table[i].virt;
+	u8 i;
+
+	for (i = *hci_phys_hash_bucket(phys); i != HCI_SLOT_NONE;
+	     i = hci_con_handle_table[i].hash_next) {
+		if (hci_con_handle_table[i].phys == phys) {
+			*virt = i;
 			return true;
 		}
 	}
@@ -89,19 +197,137 @@ static bool hci_virt_con_handle_get_virt(u16 phys, u16 *virt)
 
 static bool hci_virt_con_handle_get_phys(u16 virt, u16 *phys)
 {
-	for (int i = 0; i < ARRAY_SIZE(hci_virt_con_handle_map_table); i++) {
-		if (hci_virt_con_handle_map_table[i].valid &&
-		    hci_virt_con_handle_map_table[i].virt == virt) {
-			*phys = hci_virt_con_handle_map_table[i].phys;
-			return true;
-		}
-	}
-	return false;
+	if ((virt >= MAX_HCI_CONNECTIONS) || !hci_con_handle_table[virt].mapped)
+		return false;
+
+	*phys = hci_con_handle_table[virt].phys;
+	return true;
+}
+
+/* HCI connection handle translation tables.
+ * Entries hold the offset of the con_handle inside the command/event parameters plus one,
+ * or 0 if there is nothing to translate. Commands are indexed by OCF, one table per OGF. */
+
+#define CON_HANDLE_OFFSET(code, type) [code] = offsetof(type, con_handle) + 1
+#define CON_HANDLE_OFFSET_TABLE(ogf, table) [ogf] = {table, ARRAY_SIZE(table)}
+
+static const u8 hci_cmd_link_control_con_handle_offs[] = {
+	CON_HANDLE_OFFSET(HCI_OCF_ADD_SCO_CON, hci_add_sco_con_cp),
+	CON_HANDLE_OFFSET(HCI_OCF_CHANGE_CON_PACKET_TYPE, hci_change_con_pkt_type_cp),
+	CON_HANDLE_OFFSET(HCI_OCF_AUTH_REQ, hci_auth_req_cp),
+	CON_HANDLE_OFFSET(HCI_OCF_SET_CON_ENCRYPTION, hci_set_con_encryption_cp),
+	CON_HANDLE_OFFSET(HCI_OCF_CHANGE_CON_LINK_KEY, hci_change_con_link_key_cp),
+	CON_HANDLE_OFFSET(HCI_OCF_READ_REMOTE_FEATURES, hci_read_remote_features_cp),
+	CON_HANDLE_OFFSET(HCI_OCF_READ_REMOTE_EXTENDED_FEATURES, hci_read_remote_extended_features_cp),
+	CON_HANDLE_OFFSET(HCI_OCF_READ_REMOTE_VER_INFO, hci_read_remote_ver_info_cp),
+	CON_HANDLE_OFFSET(HCI_OCF_READ_CLOCK_OFFSET, hci_read_clock_offset_cp),
+	CON_HANDLE_OFFSET(HCI_OCF_READ_LMP_HANDLE, hci_read_lmp_handle_cp),
+	CON_HANDLE_OFFSET(HCI_OCF_SETUP_SCO_CON, hci_setup_sco_con_cp),
+};
+
+static const u8 hci_cmd_link_policy_con_handle_offs[] = {
+	CON_HANDLE_OFFSET(HCI_OCF_HOLD_MODE, hci_hold_mode_cp),
+	CON_HANDLE_OFFSET(HCI_OCF_SNIFF_MODE, hci_sniff_mode_cp),
+	CON_HANDLE_OFFSET(HCI_OCF_EXIT_SNIFF_MODE, hci_exit_sniff_mode_cp),
+	CON_HANDLE_OFFSET(HCI_OCF_PARK_MODE, hci_park_mode_cp),
+	CON_HANDLE_OFFSET(HCI_OCF_EXIT_PARK_MODE, hci_exit_park_mode_cp),
+	CON_HANDLE_OFFSET(HCI_OCF_QOS_SETUP, hci_qos_setup_cp),
+	CON_HANDLE_OFFSET(HCI_OCF_ROLE_DISCOVERY, hci_role_discovery_cp),
+	CON_HANDLE_OFFSET(HCI_OCF_READ_LINK_POLICY_SETTINGS, hci_read_link_policy_settings_cp),
+	CON_HANDLE_OFFSET(HCI_OCF_WRITE_LINK_POLICY_SETTINGS, hci_write_link_policy_settings_cp),
+	CON_HANDLE_OFFSET(HCI_OCF_FLOW_SPECIFICATION, hci_flow_specification_cp),
+	CON_HANDLE_OFFSET(HCI_OCF_SNIFF_SUBRATING, hci_sniff_subrating_cp),
+};
+
+static const u8 hci_cmd_hc_baseband_con_handle_offs[] = {
+	CON_HANDLE_OFFSET(HCI_OCF_FLUSH, hci_flush_cp),
+	CON_HANDLE_OFFSET(HCI_OCF_READ_AUTO_FLUSH_TIMEOUT, hci_read_auto_flush_timeout_cp),
+	CON_HANDLE_OFFSET(HCI_OCF_WRITE_AUTO_FLUSH_TIMEOUT, hci_write_auto_flush_timeout_cp),
+	CON_HANDLE_OFFSET(HCI_OCF_READ_XMIT_LEVEL, hci_read_xmit_level_cp),
+	CON_HANDLE_OFFSET(HCI_OCF_READ_LINK_SUPERVISION_TIMEOUT, hci_read_link_supervision_timeout_cp),
+	CON_HANDLE_OFFSET(HCI_OCF_WRITE_LINK_SUPERVISION_TIMEOUT, hci_write_link_supervision_timeout_cp),
+	CON_HANDLE_OFFSET(HCI_OCF_REFRESH_ENCRYPTION_KEY, hci_refresh_encryption_key_cp),
+	CON_HANDLE_OFFSET(HCI_OCF_ENHANCED_FLUSH, hci_enhanced_flush_cp),
+};
+
+static const u8 hci_cmd_status_con_handle_offs[] = {
+	CON_HANDLE_OFFSET(HCI_OCF_READ_FAILED_CONTACT_CNTR, hci_read_failed_contact_cntr_cp),
+	CON_HANDLE_OFFSET(HCI_OCF_RESET_FAILED_CONTACT_CNTR, hci_reset_failed_contact_cntr_cp),
+	CON_HANDLE_OFFSET(HCI_OCF_READ_LINK_QUALITY, hci_read_link_quality_cp),
+	CON_HANDLE_OFFSET(HCI_OCF_READ_RSSI, hci_read_rssi_cp),
+	CON_HANDLE_OFFSET(HCI_OCF_READ_AFH_CHANNEL_MAP, hci_read_afh_channel_map_cp),
+	CON_HANDLE_OFFSET(HCI_OCF_READ_CLOCK, hci_read_clock_cp),
+};
+
+static const struct {
+	const u8 *offs;
+	u8 size;
+} hci_cmd_con_handle_offs[] = {
+	CON_HANDLE_OFFSET_TABLE(HCI_OGF_LINK_CONTROL, hci_cmd_link_control_con_handle_offs),
+	CON_HANDLE_OFFSET_TABLE(HCI_OGF_LINK_POLICY, hci_cmd_link_policy_con_handle_offs),
+	CON_HANDLE_OFFSET_TABLE(HCI_OGF_HC_BASEBAND, hci_cmd_hc_baseband_con_handle_offs),
+	CON_HANDLE_OFFSET_TABLE(HCI_OGF_STATUS, hci_cmd_status_con_handle_offs),
+};
+
+static const u8 hci_event_con_handle_offs[] = {
+	CON_HANDLE_OFFSET(HCI_EVENT_AUTH_COMPL, hci_auth_compl_ep),
+	CON_HANDLE_OFFSET(HCI_EVENT_ENCRYPTION_CHANGE, hci_encryption_change_ep),
+	CON_HANDLE_OFFSET(HCI_EVENT_CHANGE_CON_LINK_KEY_COMPL, hci_change_con_link_key_compl_ep),
+	CON_HANDLE_OFFSET(HCI_EVENT_MASTER_LINK_KEY_COMPL, hci_master_link_key_compl_ep),
+	CON_HANDLE_OFFSET(HCI_EVENT_READ_REMOTE_FEATURES_COMPL, hci_read_remote_features_compl_ep),
+	CON_HANDLE_OFFSET(HCI_EVENT_READ_REMOTE_VER_INFO_COMPL, hci_read_remote_ver_info_compl_ep),
+	CON_HANDLE_OFFSET(HCI_EVENT_QOS_SETUP_COMPL, hci_qos_setup_compl_ep),
+	CON_HANDLE_OFFSET(HCI_EVENT_FLUSH_OCCUR, hci_flush_occur_ep),
+	CON_HANDLE_OFFSET(HCI_EVENT_MODE_CHANGE, hci_mode_change_ep),
+	CON_HANDLE_OFFSET(HCI_EVENT_MAX_SLOT_CHANGE, hci_max_slot_change_ep),
+	CON_HANDLE_OFFSET(HCI_EVENT_READ_CLOCK_OFFSET_COMPL, hci_read_clock_offset_compl_ep),
+	CON_HANDLE_OFFSET(HCI_EVENT_CON_PKT_TYPE_CHANGED, hci_con_pkt_type_changed_ep),
+	CON_HANDLE_OFFSET(HCI_EVENT_QOS_VIOLATION, hci_qos_violation_ep),
+	CON_HANDLE_OFFSET(HCI_EVENT_FLOW_SPECIFICATION_COMPL, hci_flow_specification_compl_ep),
+	CON_HANDLE_OFFSET(HCI_EVENT_READ_REMOTE_EXTENDED_FEATURES, hci_read_remote_extended_features_ep),
+	CON_HANDLE_OFFSET(HCI_EVENT_SCO_CON_COMPL, hci_sco_con_compl_ep),
+	CON_HANDLE_OFFSET(HCI_EVENT_SCO_CON_CHANGED, hci_sco_con_changed_ep),
+	CON_HANDLE_OFFSET(HCI_EVENT_SNIFF_SUBRATING, hci_sniff_subrating_ep),
+	CON_HANDLE_OFFSET(HCI_EVENT_ENCRYPTION_KEY_REFRESH, hci_encryption_key_refresh_ep),
+	CON_HANDLE_OFFSET(HCI_EVENT_LINK_SUPERVISION_TO_CHANGED, hci_link_supervision_to_changed_ep),
+	CON_HANDLE_OFFSET(HCI_EVENT_ENHANCED_FLUSH_COMPL, hci_enhanced_flush_compl_ep),
+};
+
+#undef CON_HANDLE_OFFSET
+#undef CON_HANDLE_OFFSET_TABLE
+
+static inline u8 hci_cmd_get_con_handle_offset(u16 opcode)
+{
+	u16 ogf = HCI_OGF(opcode);
+	u16 ocf = HCI_OCF(opcode);
+
+	if ((ogf >= ARRAY_SIZE(hci_cmd_con_handle_offs)) || (ocf >= hci_cmd_con_handle_offs[ogf].size))
+		return 0;
+	return hci_cmd_con_handle_offs[ogf].offs[ocf];
+}
+
+static inline u8 hci_event_get_con_handle_offset(u8 event)
+{
+	if (event >= ARRAY_SIZE(hci_event_con_handle_offs))
+		return 0;
+	return hci_event_con_handle_offs[event];
+}
+
+/* The con_handle can be at an odd offset, access it byte by byte */
+static inline u16 get_le16(const u8 *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static inline void set_le16(u8 *p, u16 val)
+{
+	p[0] = val & 0xFF;
+	p[1] = val >> 8;
 }
 
 /* HCI handlers */
 
-void hci_state_handle_hci_cmd_from_host(void *data, u32 length, bool *fwd_to_usb)
+u32 hci_state_handle_hci_cmd_from_host(void *data, u32 length, bool *fwd_to_usb)
 {
 	hci_cmd_hdr_t *hdr = data;
 	void *payload = (void *)((u8 *)hdr + sizeof(hci_cmd_hdr_t));
@@ -113,22 +339,6 @@ void hci_state_handle_hci_cmd_from_host(void *data, u32 length, bool *fwd_to_usb
 	 * Otherwise, we just have to patch the HCI connection handle from virtual to physical.
 	 */
 
-#define TRANSLATE_CON_HANDLE(event, type) \
-	case event: { \
-		type *cp = (type *)payload; \
-		u16 phys, virt = le16toh(cp->con_handle); \
-		/* First check if the virtual connection handle corresponds to a fake wiimote. \
-		 * If so, we don't have to forward the HCI command to the USB BT dongle. */ \
-		if (fake_wiimote_mgr_hci_handle_belongs_to_fake_wiimote(virt)) { \
-			*fwd_to_usb = false; \
-			break; \
-		} \
-		assert(hci_virt_con_handle_get_phys(virt, &phys)); \
-		cp->con_handle = htole16(phys); \
-		os_sync_after_write(&cp->con_handle, sizeof(cp->con_handle)); \
-		break; \
-	}
-
 	switch (opcode) {
 	case HCI_CMD_CREATE_CON:
 		DEBUG("HCI_CMD_CREATE_CON\n");
@@ -201,53 +411,66 @@ void hci_state_handle_hci_cmd_from_host(void *data, u32 length, bool *fwd_to_usb
 		hci_unit_class[2] = cp->uclass[2];
 		break;
 	}
-	TRANSLATE_CON_HANDLE(HCI_CMD_ADD_SCO_CON, hci_add_sco_con_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_CHANGE_CON_PACKET_TYPE, hci_change_con_pkt_type_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_AUTH_REQ, hci_auth_req_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_SET_CON_ENCRYPTION, hci_set_con_encryption_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_CHANGE_CON_LINK_KEY, hci_change_con_link_key_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_READ_REMOTE_FEATURES, hci_read_remote_features_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_READ_REMOTE_EXTENDED_FEATURES, hci_read_remote_extended_features_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_READ_REMOTE_VER_INFO, hci_read_remote_ver_info_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_READ_CLOCK_OFFSET, hci_read_clock_offset_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_READ_LMP_HANDLE, hci_read_lmp_handle_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_SETUP_SCO_CON, hci_setup_sco_con_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_HOLD_MODE, hci_hold_mode_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_SNIFF_MODE, hci_sniff_mode_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_EXIT_SNIFF_MODE, hci_exit_sniff_mode_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_PARK_MODE, hci_park_mode_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_EXIT_PARK_MODE, hci_exit_park_mode_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_QOS_SETUP, hci_qos_setup_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_ROLE_DISCOVERY, hci_role_discovery_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_READ_LINK_POLICY_SETTINGS, hci_read_link_policy_settings_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_WRITE_LINK_POLICY_SETTINGS, hci_write_link_policy_settings_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_FLOW_SPECIFICATION, hci_flow_specification_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_SNIFF_SUBRATING, hci_sniff_subrating_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_FLUSH, hci_flush_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_READ_AUTO_FLUSH_TIMEOUT, hci_read_auto_flush_timeout_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_WRITE_AUTO_FLUSH_TIMEOUT, hci_write_auto_flush_timeout_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_READ_XMIT_LEVEL, hci_read_xmit_level_cp)
-	case HCI_CMD_HOST_NUM_COMPL_PKTS:
-		/* TODO */
+	case HCI_CMD_HOST_NUM_COMPL_PKTS: {
+		hci_host_num_compl_pkts_cp *cp = payload;
+		u8 *info = (u8 *)cp + sizeof(*cp);
+		u8 *out = info;
+		u8 num = 0;
+		u16 phys;
+
+		/* Translate the real handles and drop the fake ones (they don't do controller
+		 * to host flow control), packing the remaining entries */
+		for (int i = 0; i < cp->nu_con_handles; i++, info += sizeof(hci_num_compl_pkts_info)) {
+			if (!hci_virt_con_handle_get_phys(get_le16(info), &phys))
+				continue;
+			set_le16(out, phys);
+			if (out != info)
+				memcpy(out + offsetof(hci_num_compl_pkts_info, compl_pkts),
+				       info + offsetof(hci_num_compl_pkts_info, compl_pkts), sizeof(u16));
+			out += sizeof(hci_num_compl_pkts_info);
+			num++;
+		}
+
+		if (num == 0) {
+			*fwd_to_usb = false;
+			break;
+		}
+
+		cp->nu_con_handles = num;
+		hdr->length = sizeof(*cp) + num * sizeof(hci_num_compl_pkts_info);
+		length = sizeof(*hdr) + hdr->length;
+		os_sync_after_write(hdr, length);
 		break;
-	TRANSLATE_CON_HANDLE(HCI_CMD_READ_LINK_SUPERVISION_TIMEOUT, hci_read_link_supervision_timeout_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_WRITE_LINK_SUPERVISION_TIMEOUT, hci_write_link_supervision_timeout_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_REFRESH_ENCRYPTION_KEY, hci_refresh_encryption_key_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_ENHANCED_FLUSH, hci_enhanced_flush_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_READ_FAILED_CONTACT_CNTR, hci_read_failed_contact_cntr_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_RESET_FAILED_CONTACT_CNTR, hci_reset_failed_contact_cntr_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_READ_LINK_QUALITY, hci_read_link_quality_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_READ_RSSI, hci_read_rssi_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_READ_AFH_CHANNEL_MAP, hci_read_afh_channel_map_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_READ_CLOCK, hci_read_clock_cp)
-	default:
-		DEBUG("HCI CTRL: opcode: 0x%x\n", opcode);
+	}
+	default: {
+		u8 *con_handle;
+		u16 phys, virt;
+		u8 offs = hci_cmd_get_con_handle_offset(opcode);
+
+		if (!offs) {
+			DEBUG("HCI CTRL: opcode: 0x%x\n", opcode);
+			break;
+		}
+
+		con_handle = (u8 *)payload + offs - 1;
+		virt = get_le16(con_handle);
+		/* First check if the virtual connection handle corresponds to a fake wiimote.
+		 * If so, we don't have to forward the HCI command to the USB BT dongle. */
+		if (fake_wiimote_mgr_hci_handle_belongs_to_fake_wiimote(virt)) {
+			*fwd_to_usb = false;
+			break;
+		}
+		assert(hci_virt_con_handle_get_phys(virt, &phys));
+		set_le16(con_handle, phys);
+		os_sync_after_write(con_handle, sizeof(u16));
 		break;
 	}
-#undef TRANSLATE_CON_HANDLE
+	}
+
+	return length;
 }
 
-void hci_state_handle_hci_event_from_controller(void *data, u32 length)
+u32 hci_state_handle_hci_event_from_controller(void *data, u32 length, u32 size)
 {
 	bool ret;
 	u16 virt;
@@ -259,16 +482,6 @@ void hci_state_handle_hci_event_from_controller(void *data, u32 length)
 
 	DEBUG("C > H HCI EVT: event: 0x%x, len: 0x%x\n", hdr->event, hdr->length);
 
-#define TRANSLATE_CON_HANDLE(event, type) \
-	case event: { \
-		type *ep = (type *)payload; \
-		u16 virt, phys = le16toh(ep->con_handle); \
-		assert(hci_virt_con_handle_get_virt(phys, &virt)); \
-		ep->con_handle = htole16(virt); \
-		os_sync_after_write(&ep->con_handle, sizeof(ep->con_handle)); \
-		break; \
-	}
-
 	switch (hdr->event) {
 	case HCI_EVENT_CON_COMPL: {
 		hci_con_compl_ep *ep = payload;
@@ -279,6 +492,7 @@ void hci_state_handle_hci_event_from_controller(void *data, u32 length)
 		if (ep->status == 0) {
 			/* Allocate a new virtual connection handle */
 			virt = hci_con_handle_virt_alloc();
+			assert(virt != HCI_CON_HANDLE_INVALID);
 			/* Create the new connection handle mapping */
 			ret = hci_virt_con_handle_map(le16toh(ep->con_handle), virt);
 			assert(ret);
@@ -306,33 +520,65 @@ void hci_state_handle_hci_event_from_controller(void *data, u32 length)
 		}
 		break;
 	}
-	TRANSLATE_CON_HANDLE(HCI_EVENT_AUTH_COMPL, hci_auth_compl_ep)
-	TRANSLATE_CON_HANDLE(HCI_EVENT_ENCRYPTION_CHANGE, hci_encryption_change_ep)
-	TRANSLATE_CON_HANDLE(HCI_EVENT_CHANGE_CON_LINK_KEY_COMPL, hci_change_con_link_key_compl_ep)
-	TRANSLATE_CON_HANDLE(HCI_EVENT_MASTER_LINK_KEY_COMPL, hci_master_link_key_compl_ep)
-	TRANSLATE_CON_HANDLE(HCI_EVENT_READ_REMOTE_FEATURES_COMPL, hci_read_remote_features_compl_ep)
-	TRANSLATE_CON_HANDLE(HCI_EVENT_READ_REMOTE_VER_INFO_COMPL, hci_read_remote_ver_info_compl_ep)
-	TRANSLATE_CON_HANDLE(HCI_EVENT_QOS_SETUP_COMPL, hci_qos_setup_compl_ep)
-	TRANSLATE_CON_HANDLE(HCI_EVENT_FLUSH_OCCUR, hci_flush_occur_ep)
-	case HCI_EVENT_NUM_COMPL_PKTS:
-		/* TODO */
-		assert(1);
+	case HCI_EVENT_COMMAND_COMPL: {
+		hci_command_compl_ep *ep = payload;
+		hci_read_buffer_size_rp *rp = (void *)((u8 *)ep + sizeof(*ep));
+
+		if ((le16toh(ep->opcode) == HCI_CMD_READ_BUFFER_SIZE) && (rp->status == 0)) {
+			hci_acl_data_pkt_size = sizeof(hci_acldata_hdr_t) + le16toh(rp->max_acl_size);
+			DEBUG("HCI_CMD_READ_BUFFER_SIZE: max_acl_size: 0x%x\n", le16toh(rp->max_acl_size));
+		}
+		break;
+	}
+	case HCI_EVENT_NUM_COMPL_PKTS: {
+		hci_num_compl_pkts_ep *ep = payload;
+		hci_num_compl_pkts_info fake_info[HCI_NUM_COMPL_PKTS_BATCH];
+		u8 *info = (u8 *)ep + sizeof(*ep);
+		u32 room;
+		u8 num;
+
+		for (int i = 0; i < ep->num_con_handles; i++, info += sizeof(hci_num_compl_pkts_info)) {
+			if (hci_virt_con_handle_get_virt(get_le16(info), &virt))
+				set_le16(info, virt);
+		}
+
+		/* Merge the packets completed by fake devices into it, if there's room */
+		room = MIN2(size, sizeof(*hdr) + 0xFF);
+		room = (room > length) ? (room - length) : 0;
+		num = hci_fill_fake_num_compl_pkts(fake_info, MIN2(room / sizeof(hci_num_compl_pkts_info),
+								   ARRAY_SIZE(fake_info)));
+		for (int i = 0; i < num; i++, info += sizeof(hci_num_compl_pkts_info)) {
+			set_le16(info, fake_info[i].con_handle);
+			set_le16(info + offsetof(hci_num_compl_pkts_info, compl_pkts),
+				 fake_info[i].compl_pkts);
+		}
+		hci_clear_fake_num_compl_pkts(fake_info, num);
+		ep->num_con_handles += num;
+		hdr->length += num * sizeof(hci_num_compl_pkts_info);
+		length += num * sizeof(hci_num_compl_pkts_info);
+
+		os_sync_after_write(data, length);
 		break;
-	TRANSLATE_CON_HANDLE(HCI_EVENT_MODE_CHANGE, hci_mode_change_ep)
-	TRANSLATE_CON_HANDLE(HCI_EVENT_MAX_SLOT_CHANGE, hci_max_slot_change_ep)
-	TRANSLATE_CON_HANDLE(HCI_EVENT_READ_CLOCK_OFFSET_COMPL, hci_read_clock_offset_compl_ep)
-	TRANSLATE_CON_HANDLE(HCI_EVENT_CON_PKT_TYPE_CHANGED, hci_con_pkt_type_changed_ep)
-	TRANSLATE_CON_HANDLE(HCI_EVENT_QOS_VIOLATION, hci_qos_violation_ep)
-	TRANSLATE_CON_HANDLE(HCI_EVENT_FLOW_SPECIFICATION_COMPL, hci_flow_specification_compl_ep)
-	TRANSLATE_CON_HANDLE(HCI_EVENT_READ_REMOTE_EXTENDED_FEATURES, hci_read_remote_extended_features_ep)
-	TRANSLATE_CON_HANDLE(HCI_EVENT_SCO_CON_COMPL, hci_sco_con_compl_ep)
-	TRANSLATE_CON_HANDLE(HCI_EVENT_SCO_CON_CHANGED, hci_sco_con_changed_ep)
-	TRANSLATE_CON_HANDLE(HCI_EVENT_SNIFF_SUBRATING, hci_sniff_subrating_ep)
-	TRANSLATE_CON_HANDLE(HCI_EVENT_ENCRYPTION_KEY_REFRESH, hci_encryption_key_refresh_ep)
-	TRANSLATE_CON_HANDLE(HCI_EVENT_LINK_SUPERVISION_TO_CHANGED, hci_link_supervision_to_changed_ep)
-	TRANSLATE_CON_HANDLE(HCI_EVENT_ENHANCED_FLUSH_COMPL, hci_enhanced_flush_compl_ep)
 	}
-#undef TRANSLATE_CON_HANDLE
+	default: {
+		u8 *con_handle;
+		u16 phys;
+		u8 offs = hci_event_get_con_handle_offset(hdr->event);
+
+		if (!offs)
+			break;
+
+		con_handle = (u8 *)payload + offs - 1;
+		phys = get_le16(con_handle);
+		ret = hci_virt_con_handle_get_virt(phys, &virt);
+		assert(ret);
+		set_le16(con_handle, virt);
+		os_sync_after_write(con_handle, sizeof(u16));
+		break;
+	}
+	}
+
+	return length;
 }
 
 void hci_state_handle_acl_data_in_response_from_controller(void *data, u32 length)
@@ -375,6 +621,8 @@ void hci_state_handle_acl_data_out_request_from_host(void *data, u32 length, boo
 
 	/* First check if the virtual connection handle corresponds to a fake wiimote */
 	if (fake_wiimote_mgr_handle_acl_data_out_request_from_host(virt, hdr)) {
+		/* Give the ACL buffer credit back to the host on the next tick */
+		hci_con_handle_table[virt].compl_pkts++;
 		*fwd_to_usb = false;
 		DEBUG("  (to fakedev)\n");
 		return;
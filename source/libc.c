@@ -1,8 +1,40 @@
+#include <stdint.h>
 #include <stdio.h>
 
+/* Word-wise versions: the bulk is done 16 bytes at a time when both pointers share the same
+ * alignment (ldmia/stmia on the ARM926), the rest byte by byte. */
+
+typedef unsigned int __attribute__((__may_alias__)) word_t;
+
+#define WORD_SIZE	sizeof(word_t)
+#define WORD_MASK	(WORD_SIZE - 1)
+
 void *memset(void *s, int c, size_t n)
 {
-	char *p = s;
+	unsigned char *p = s;
+	word_t *w, v;
+
+	if (n >= 2 * WORD_SIZE) {
+		while ((uintptr_t)p & WORD_MASK) {
+			*p++ = c;
+			n--;
+		}
+
+		v = (unsigned char)c;
+		v |= v << 8;
+		v |= v << 16;
+
+		w = (word_t *)p;
+		for (; n >= 4 * WORD_SIZE; n -= 4 * WORD_SIZE, w += 4) {
+			w[0] = v;
+			w[1] = v;
+			w[2] = v;
+			w[3] = v;
+		}
+		for (; n >= WORD_SIZE; n -= WORD_SIZE)
+			*w++ = v;
+		p = (unsigned char *)w;
+	}
 
 	while (n) {
 		*p++ = c;
@@ -14,8 +46,34 @@ void *memset(void *s, int c, size_t n)
 
 void *memcpy(void *dest, const void *src, size_t n)
 {
-	const char *s = src;
-	char *d = dest;
+	const unsigned char *s = src;
+	unsigned char *d = dest;
+	const word_t *ws;
+	word_t *wd, w0, w1, w2, w3;
+
+	if ((n >= 2 * WORD_SIZE) && !(((uintptr_t)d ^ (uintptr_t)s) & WORD_MASK)) {
+		while ((uintptr_t)d & WORD_MASK) {
+			*d++ = *s++;
+			n--;
+		}
+
+		ws = (const word_t *)s;
+		wd = (word_t *)d;
+		for (; n >= 4 * WORD_SIZE; n -= 4 * WORD_SIZE, ws += 4, wd += 4) {
+			w0 = ws[0];
+			w1 = ws[1];
+			w2 = ws[2];
+			w3 = ws[3];
+			wd[0] = w0;
+			wd[1] = w1;
+			wd[2] = w2;
+			wd[3] = w3;
+		}
+		for (; n >= WORD_SIZE; n -= WORD_SIZE)
+			*wd++ = *ws++;
+		s = (const unsigned char *)ws;
+		d = (unsigned char *)wd;
+	}
 
 	while (n) {
 		*d++ = *s++;
@@ -27,13 +85,32 @@ void *memcpy(void *dest, const void *src, size_t n)
 
 int memcmp(const void *s1, const void *s2, size_t n)
 {
-	unsigned char u1, u2;
+	const unsigned char *p1 = s1, *p2 = s2;
+	const word_t *w1, *w2;
+
+	if ((n >= 2 * WORD_SIZE) && !(((uintptr_t)p1 ^ (uintptr_t)p2) & WORD_MASK)) {
+		while ((uintptr_t)p1 & WORD_MASK) {
+			if (*p1 != *p2)
+				return *p1 - *p2;
+			p1++;
+			p2++;
+			n--;
+		}
+
+		/* Skip the equal words, the differing one (if any) is compared byte by byte */
+		w1 = (const word_t *)p1;
+		w2 = (const word_t *)p2;
+		for (; n >= WORD_SIZE && *w1 == *w2; n -= WORD_SIZE) {
+			w1++;
+			w2++;
+		}
+		p1 = (const unsigned char *)w1;
+		p2 = (const unsigned char *)w2;
+	}
 
-	for (; n--; s1++, s2++) {
-		u1 = *(unsigned char *)s1;
-		u2 = *(unsigned char *)s2;
-		if (u1 != u2)
-			return u1 - u2;
+	for (; n; n--, p1++, p2++) {
+		if (*p1 != *p2)
+			return *p1 - *p2;
 	}
 
 	return 0;
@@ -16,6 +16,7 @@
 #include "types.h"
 #include "usb_hid.h"
 #include "utils.h"
+#include "wiimote.h"
 
 /* OH1 module hook information */
 #define OH1_IOS_ReceiveMessage_ADDR1 0x138b365c
@@ -53,7 +54,24 @@
 
 /* The Real Wiimmote sends report every ~5ms (200 Hz). */
 #define PERIODC_TIMER_PERIOD		5 * 1000
-#define HAND_DOWN_MSG_DATA_SIZE		4096
+
+/* HCI events never exceed HCI_EVENT_PKT_SIZE (257) bytes. The ACL buffers fit a packet of the
+ * Wii's BT controller (BCM2045, 339 bytes ACL MTU). Bigger reads are clamped to the ACL packet
+ * size reported by Read_Buffer_Size, or forwarded untouched to OH1 if they still don't fit.
+ * The buffers can't be sized from Read_Buffer_Size itself: they are static, and the host posts
+ * its first reads before the command completes. */
+#define HAND_DOWN_INTR_DATA_SIZE	ROUNDUP32(HCI_EVENT_PKT_SIZE)
+#ifndef HAND_DOWN_BULK_IN_DATA_SIZE
+#define HAND_DOWN_BULK_IN_DATA_SIZE	ROUNDUP32(sizeof(hci_acldata_hdr_t) + 339)
+#endif
+
+/* Number of hand down messages (reads) we can have in flight at OH1 per endpoint */
+#ifndef HAND_DOWN_MSGS_INTR
+#define HAND_DOWN_MSGS_INTR		1
+#endif
+#ifndef HAND_DOWN_MSGS_BULK_IN
+#define HAND_DOWN_MSGS_BULK_IN		2
+#endif
 
 /* Required by cios-lib... */
 char *moduleName = "TST";
@@ -61,121 +79,427 @@ char *moduleName = "TST";
 /* Queue ID created by OH1 that receives ipcmessages from /dev/usb/oh1 */
 int orig_msg_queueid;
 
+/* Messages we send to the OH1 queue ourselves. Small integers, so that they fit in the
+ * 32-bit timer message and never collide with ipcmessage pointers. */
+#define PERIODIC_TIMER_COOKIE	1
+#define INPUT_WAKEUP_COOKIE	2
+
 /* Periodic timer with large period to tick fakedevices to check their state */
 static int periodic_timer_id;
-static int periodic_timer_cookie;
-
-/* ipcmessages used when we return from IOS_ReceiveMessage hook to communicate with the USB BT dongle */
-static u8 usb_intr_hand_down_msg_data[HAND_DOWN_MSG_DATA_SIZE] ATTRIBUTE_ALIGN(32);
-static u8 usb_intr_hand_down_msg_ioctlv_0_data = EP_HCI_EVENT;
-static u16 usb_intr_hand_down_msg_ioctlv_1_data;
-static ioctlv usb_intr_hand_down_msg_ioctlvs[3] = {
-	{&usb_intr_hand_down_msg_ioctlv_0_data, sizeof(usb_intr_hand_down_msg_ioctlv_0_data)},
-	{&usb_intr_hand_down_msg_ioctlv_1_data, sizeof(usb_intr_hand_down_msg_ioctlv_1_data)},
-	{&usb_intr_hand_down_msg_data,          sizeof(usb_intr_hand_down_msg_data)}
-};
-static ipcmessage usb_intr_hand_down_msg = {
-	.command = IOS_IOCTLV,
-	.result = IOS_OK,
-	.fd = 0, /* Filled dynamically */
-	.ioctlv = {
-		.command = USBV0_IOCTLV_INTRMSG,
-		.num_in = 2,
-		.num_io = 1,
-		.vector = usb_intr_hand_down_msg_ioctlvs
-	}
-};
-static bool usb_intr_hand_down_msg_pending = false;
-
-static u8 usb_bulk_in_hand_down_msg_data[HAND_DOWN_MSG_DATA_SIZE] ATTRIBUTE_ALIGN(32);
-static u8 usb_bulk_in_hand_down_msg_ioctlv_0_data = EP_ACL_DATA_IN;
-static u16 usb_bulk_in_hand_down_msg_ioctlv_1_data;
-static ioctlv usb_bulk_in_hand_down_msg_ioctlvs[3] = {
-	{&usb_bulk_in_hand_down_msg_ioctlv_0_data, sizeof(usb_bulk_in_hand_down_msg_ioctlv_0_data)},
-	{&usb_bulk_in_hand_down_msg_ioctlv_1_data, sizeof(usb_bulk_in_hand_down_msg_ioctlv_1_data)},
-	{&usb_bulk_in_hand_down_msg_data,          sizeof(usb_bulk_in_hand_down_msg_data)}
-};
-static ipcmessage usb_bulk_in_hand_down_msg = {
-	.command = IOS_IOCTLV,
-	.result = IOS_OK,
-	.fd = 0, /* Filled dynamically */
-	.ioctlv = {
-		.command = USBV0_IOCTLV_BLKMSG,
-		.num_in = 2,
-		.num_io = 1,
-		.vector = usb_bulk_in_hand_down_msg_ioctlvs
-	}
-};
-static bool usb_bulk_in_hand_down_msg_pending = false;
 
-/* Heap to allocate ipcmessages that we inject into the ReadyQ to send them to the /dev/usb/oh1 user,
- * which is the bluetooth stack beneath the WPAD library of games/apps */
-static u8 injmessages_heap_data[4 * 1024] ATTRIBUTE_ALIGN(32);
-static int injmessages_heap_id;
+/* Sent by the USB HID worker when a fake Wiimote has new input. Only one can be in flight. */
+static volatile bool input_wakeup_pending;
+
+/* ipcmessages used when we return from IOS_ReceiveMessage hook to communicate with the USB BT dongle.
+ * We keep a pool of them per endpoint, so that several USB reads can be in flight at OH1. */
+typedef struct {
+	ipcmessage msg; /* Must be the first member */
+	ioctlv vectors[3];
+	u8 endpoint;
+	u16 length;
+	/* Handed down to OH1, or completed and waiting on the real ReadyQ */
+	bool pending;
+	u16 data_size;
+	u8 *data;
+} hand_down_msg;
+
+static hand_down_msg usb_intr_hand_down_msgs[HAND_DOWN_MSGS_INTR];
+static hand_down_msg usb_bulk_in_hand_down_msgs[HAND_DOWN_MSGS_BULK_IN];
+static u8 usb_intr_hand_down_data[HAND_DOWN_MSGS_INTR][HAND_DOWN_INTR_DATA_SIZE] ATTRIBUTE_ALIGN(32);
+static u8 usb_bulk_in_hand_down_data[HAND_DOWN_MSGS_BULK_IN][HAND_DOWN_BULK_IN_DATA_SIZE] ATTRIBUTE_ALIGN(32);
+
+/* Slots to allocate messages that we inject into the ReadyQ to send them to the /dev/usb/oh1 user,
+ * which is the bluetooth stack beneath the WPAD library of games/apps.
+ * An injected message is only alive while it sits on a ReadyQ, so we never need more slots than
+ * both ReadyQs can hold. They are handed out in ring order by the OH1 thread and released by
+ * clearing "used", so no locking is needed. */
+#define INJMESSAGE_SLOTS	32
+#define INJMESSAGE_SLOT_SIZE	64
+/* The few messages that don't fit in a regular slot (HCI events with a big payload, L2CAP
+ * configuration responses echoing many options) get one of these */
+#define INJMESSAGE_BIG_SLOTS	 2
+#define INJMESSAGE_BIG_SLOT_SIZE 288
 
 /* Custom type for messages that we inject to the ReadyQ.
- * They must *always* be allocated from the injmessages_heap. */
+ * They must *always* be allocated from the injmessages slots. */
 typedef struct {
+	vu8 used;
+	/* Non-zero for supersedable data reports: identifies the sender */
+	u8 tag;
 	u16 size;
-	u8 data[];
-} ATTRIBUTE_PACKED injmessage;
+	u8 data[INJMESSAGE_SLOT_SIZE - 4];
+} ATTRIBUTE_ALIGN(32) injmessage;
+static_assert(sizeof(injmessage) == INJMESSAGE_SLOT_SIZE);
+static_assert((INJMESSAGE_SLOTS & (INJMESSAGE_SLOTS - 1)) == 0);
+/* Largest packet we inject into a regular slot: a full Wiimote input report */
+static_assert(sizeof(hci_acldata_hdr_t) + sizeof(l2cap_hdr_t) + WIIMOTE_MAX_PAYLOAD <=
+	      MEMBER_SIZE(injmessage, data));
+
+/* Same layout as injmessage, with a bigger data area */
+typedef struct {
+	vu8 used;
+	u8 tag;
+	u16 size;
+	u8 data[INJMESSAGE_BIG_SLOT_SIZE - 4];
+} ATTRIBUTE_ALIGN(32) injmessage_big;
+static_assert(sizeof(injmessage_big) == INJMESSAGE_BIG_SLOT_SIZE);
+static_assert(offsetof(injmessage_big, data) == offsetof(injmessage, data));
+/* Largest packets we inject */
+static_assert(HCI_EVENT_PKT_SIZE <= MEMBER_SIZE(injmessage_big, data));
+static_assert(sizeof(hci_acldata_hdr_t) + sizeof(l2cap_hdr_t) + sizeof(l2cap_cmd_hdr_t) +
+	      sizeof(l2cap_cfg_rsp_cp) + L2CAP_CFG_RSP_MAX_OPTIONS <= MEMBER_SIZE(injmessage_big, data));
+
+/* Kept together, so that is_message_injected() is a single range check */
+static struct {
+	injmessage slots[INJMESSAGE_SLOTS];
+	injmessage_big big_slots[INJMESSAGE_BIG_SLOTS];
+} injmessages;
+static u32 injmessages_next;
+/* Usage statistics */
+static u32 injmessages_allocated;
+static u32 injmessages_freed;
+static u32 injmessages_high_water;
+static u32 injmessages_coalesced;
+
+/* A ReadyQ holds the messages waiting for a host buffer. IOS can't tell how many
+ * messages a queue holds, so we count them. Only touched by the OH1 thread. */
+typedef struct {
+	int id;
+	ready_class_e class;
+	u32 depth;
+} ready_queue_t;
 
 static void *ready_usb_intr_msg_queue_data[8];
-static int ready_usb_intr_msg_queue_id;
+static ready_queue_t ready_usb_intr_msg_queue = { .class = READY_CLASS_HCI_EVENT };
 static ipcmessage *pending_usb_intr_msg_queue_data[8];
 static int pending_usb_intr_msg_queue_id;
 
 static void *ready_usb_bulk_in_msg_queue_data[16];
-static int ready_usb_bulk_in_msg_queue_id;
+static ready_queue_t ready_usb_bulk_in_msg_queue = { .class = READY_CLASS_ACL_CTRL };
 static ipcmessage *pending_usb_bulk_in_msg_queue_data[16];
 static int pending_usb_bulk_in_msg_queue_id;
 
+/* Data reports of each fake Wiimote. They are only delivered when the bulk in ReadyQ is empty,
+ * round-robin between the fake Wiimotes. Queued data reports get coalesced, so a couple of
+ * entries is enough. */
+#define READY_DATA_QUEUE_SIZE	2
+static void *ready_usb_bulk_in_data_msg_queue_data[MAX_FAKE_WIIMOTES][READY_DATA_QUEUE_SIZE];
+static ready_queue_t ready_usb_bulk_in_data_msg_queues[MAX_FAKE_WIIMOTES];
+static u32 ready_usb_bulk_in_data_msg_queue_next;
+
+static_assert(INJMESSAGE_SLOTS >= ARRAY_SIZE(ready_usb_intr_msg_queue_data) +
+				  ARRAY_SIZE(ready_usb_bulk_in_msg_queue_data) +
+				  sizeof(ready_usb_bulk_in_data_msg_queue_data) / sizeof(void *));
+
+/* Completed hand down messages (real data from the Bluetooth dongle) */
+static void *ready_usb_intr_real_msg_queue_data[HAND_DOWN_MSGS_INTR];
+static ready_queue_t ready_usb_intr_real_msg_queue = { .class = READY_CLASS_REAL_HCI_EVENT };
+static void *ready_usb_bulk_in_real_msg_queue_data[HAND_DOWN_MSGS_BULK_IN];
+static ready_queue_t ready_usb_bulk_in_real_msg_queue = { .class = READY_CLASS_REAL_ACL };
+
+/* Messages waiting and delivered per class */
+static u32 ready_class_depth[NUM_READY_CLASSES];
+static u32 ready_class_high_water[NUM_READY_CLASSES];
+static u32 ready_class_delivered[NUM_READY_CLASSES];
+
+/* Host buffers of an endpoint are shared between the real and the injected messages with
+ * deficit round-robin. Each message costs one buffer, a source gets its weight in buffers
+ * per round. An idle source loses its remaining credit. */
+static_assert((READY_WEIGHT_REAL > 0) && (READY_WEIGHT_INJECTED > 0));
+
+typedef enum {
+	READY_SOURCE_REAL,
+	READY_SOURCE_INJECTED,
+	NUM_READY_SOURCES
+} ready_source_e;
+
+static const u32 ready_source_weight[NUM_READY_SOURCES] = {
+	[READY_SOURCE_REAL] = READY_WEIGHT_REAL,
+	[READY_SOURCE_INJECTED] = READY_WEIGHT_INJECTED,
+};
+
+typedef struct {
+	ready_queue_t *real;
+	ready_queue_t *injected;
+	ready_source_e turn;
+	u32 deficit[NUM_READY_SOURCES];
+} ready_sched_t;
+
+static ready_sched_t usb_intr_ready_sched = {
+	.real = &ready_usb_intr_real_msg_queue,
+	.injected = &ready_usb_intr_msg_queue,
+};
+static ready_sched_t usb_bulk_in_ready_sched = {
+	.real = &ready_usb_bulk_in_real_msg_queue,
+	.injected = &ready_usb_bulk_in_msg_queue,
+};
+
 /* Function prototypes */
 
 static int ensure_initalized(void);
-static int handle_bulk_intr_pending_message(ipcmessage *recv_msg, u16 size, ipcmessage **ret_msg,
-					    int ready_queue_id, int pending_queue_id,
-					    ipcmessage *hand_down_msg, bool *hand_down_msg_pending,
+static int handle_bulk_intr_pending_message(ipcmessage *recv_msg, u16 size, u16 max_size,
+					    ipcmessage **ret_msg, ready_sched_t *sched, int pending_queue_id,
+					    hand_down_msg *hand_down_msgs, u32 num_hand_down_msgs,
 					    bool *fwd_to_usb);
-static int handle_bulk_intr_ready_message(void *ready_msg, int pending_queue_id, int ready_queue_id);
+static int handle_bulk_intr_ready_message(void *ready_msg, int pending_queue_id, ready_queue_t *ready_q);
 
 /* Message allocation and enqueuing helpers */
 
-/* Used to allocate messages (bulk in/interrupt) to inject back to the BT SW stack */
-static injmessage *alloc_inject_message(void **data, u16 size)
+static inline injmessage *injmessage_claim(injmessage *msg, u16 size)
 {
-	injmessage *msg = os_heap_alloc(injmessages_heap_id, sizeof(injmessage) + size);
+	u32 in_use;
+
+	msg->used = 1;
+	msg->tag = 0;
+	msg->size = size;
+	in_use = ++injmessages_allocated - injmessages_freed;
+	if (in_use > injmessages_high_water)
+		injmessages_high_water = in_use;
+	return msg;
+}
+
+static injmessage *injmessage_alloc(u16 size)
+{
+	injmessage *msg;
+
+	if (size > MEMBER_SIZE(injmessage_big, data))
+		return NULL;
+
+	if (size > sizeof(msg->data)) {
+		for (int i = 0; i < INJMESSAGE_BIG_SLOTS; i++) {
+			msg = (injmessage *)&injmessages.big_slots[i];
+			if (!msg->used)
+				return injmessage_claim(msg, size);
+		}
+		return NULL;
+	}
+
+	for (int i = 0; i < INJMESSAGE_SLOTS; i++) {
+		msg = &injmessages.slots[(injmessages_next + i) & (INJMESSAGE_SLOTS - 1)];
+		if (msg->used)
+			continue;
+		injmessages_next = (injmessages_next + i + 1) & (INJMESSAGE_SLOTS - 1);
+		return injmessage_claim(msg, size);
+	}
+
+	return NULL;
+}
+
+static inline void injmessage_free(injmessage *msg)
+{
+	injmessages_freed++;
+	msg->used = 0;
+}
+
+void injmessage_get_stats(injmessage_stats_t *stats)
+{
+	stats->slots = INJMESSAGE_SLOTS;
+	stats->slot_size = MEMBER_SIZE(injmessage, data);
+	stats->big_slots = INJMESSAGE_BIG_SLOTS;
+	stats->big_slot_size = MEMBER_SIZE(injmessage_big, data);
+	stats->in_use = injmessages_allocated - injmessages_freed;
+	stats->high_water = injmessages_high_water;
+	stats->coalesced = injmessages_coalesced;
+}
+
+/* Used to get a buffer for the messages (bulk in/interrupt) we inject back to the BT SW stack.
+ * If the BT SW stack already gave us a buffer to fill (PendingQ), the message is built in place
+ * and returned as an ipcmessage. Otherwise it's allocated from the injmessages slots. */
+static void *alloc_inject_message(void **data, u16 size, int pending_queue_id)
+{
+	ipcmessage *pend_msg;
+	injmessage *msg;
+
+	if (os_message_queue_receive(pending_queue_id, &pend_msg, IOS_MESSAGE_NOBLOCK) == IOS_OK) {
+		if (size <= pend_msg->ioctlv.vector[2].len) {
+			/* Store the message size until we ACK it */
+			pend_msg->result = size;
+			*data = pend_msg->ioctlv.vector[2].data;
+			return pend_msg;
+		}
+		/* Too small, put it back to the front of the PendingQ to keep the order */
+		os_message_queue_send_now(pending_queue_id, pend_msg, IOS_MESSAGE_NOBLOCK);
+	}
+
+	msg = injmessage_alloc(size);
 	if (!msg)
 		return NULL;
-	msg->size = size;
 	*data = msg->data;
 	return msg;
 }
 
 static inline bool is_message_injected(const void *msg)
 {
-	return ((uintptr_t)msg >= (uintptr_t)injmessages_heap_data) &&
-	       ((uintptr_t)msg < ((uintptr_t)injmessages_heap_data + sizeof(injmessages_heap_data)));
+	return ((uintptr_t)msg >= (uintptr_t)&injmessages) &&
+	       ((uintptr_t)msg < ((uintptr_t)&injmessages + sizeof(injmessages)));
+}
+
+static int inject_message(void *msg, int pending_queue_id, ready_queue_t *ready_q)
+{
+	ipcmessage *pend_msg = msg;
+	int ret;
+
+	if (is_message_injected(msg)) {
+		ret = handle_bulk_intr_ready_message(msg, pending_queue_id, ready_q);
+		/* The ReadyQ is full, drop it */
+		if (ret < 0)
+			injmessage_free(msg);
+		return ret;
+	}
+
+	/* The message was built in place into a PendingQ buffer, we can ACK it already */
+	ready_class_delivered[ready_q->class]++;
+	os_sync_after_write(pend_msg->ioctlv.vector[2].data, pend_msg->result);
+	return os_message_queue_ack(pend_msg, pend_msg->result);
+}
+
+static inline int inject_msg_to_usb_intr_ready_queue(void *msg)
+{
+	return inject_message(msg, pending_usb_intr_msg_queue_id, &ready_usb_intr_msg_queue);
+}
+
+static inline int inject_msg_to_usb_bulk_in_ready_queue(void *msg)
+{
+	return inject_message(msg, pending_usb_bulk_in_msg_queue_id, &ready_usb_bulk_in_msg_queue);
+}
+
+static inline int inject_data_report_to_usb_bulk_in_ready_queue(void *msg, u8 index)
+{
+	return inject_message(msg, pending_usb_bulk_in_msg_queue_id,
+			      &ready_usb_bulk_in_data_msg_queues[index]);
+}
+
+u32 usb_bulk_in_ready_queue_room(void)
+{
+	return ARRAY_SIZE(ready_usb_bulk_in_msg_queue_data) - ready_usb_bulk_in_msg_queue.depth;
+}
+
+void ready_queue_get_stats(ready_queue_stats_t *stats)
+{
+	for (int i = 0; i < NUM_READY_CLASSES; i++) {
+		stats->depth[i] = ready_class_depth[i];
+		stats->high_water[i] = ready_class_high_water[i];
+		stats->delivered[i] = ready_class_delivered[i];
+	}
+}
+
+/* ReadyQ scheduler */
+
+static int ready_queue_send(ready_queue_t *ready_q, void *msg)
+{
+	int ret = os_message_queue_send(ready_q->id, msg, IOS_MESSAGE_NOBLOCK);
+	if (ret != IOS_OK)
+		return ret;
+
+	ready_q->depth++;
+	if (++ready_class_depth[ready_q->class] > ready_class_high_water[ready_q->class])
+		ready_class_high_water[ready_q->class] = ready_class_depth[ready_q->class];
+	return IOS_OK;
+}
+
+static int ready_queue_receive(ready_queue_t *ready_q, void **msg)
+{
+	int ret;
+
+	/* Save the syscall */
+	if (ready_q->depth == 0)
+		return IOS_EQUEUEEMPTY;
+
+	ret = os_message_queue_receive(ready_q->id, msg, IOS_MESSAGE_NOBLOCK);
+	if (ret == IOS_OK) {
+		ready_q->depth--;
+		ready_class_depth[ready_q->class]--;
+		/* Received messages are always delivered */
+		ready_class_delivered[ready_q->class]++;
+	}
+	return ret;
+}
+
+/* Picks the next injected message to deliver to the host from the ReadyQ of an endpoint */
+static int ready_queue_schedule_injected(ready_queue_t *ready_q, void **msg)
+{
+	ready_queue_t *data_q;
+	u32 index;
+
+	/* Strict priority for HCI events and the bulk in control class */
+	if (ready_queue_receive(ready_q, msg) == IOS_OK)
+		return IOS_OK;
+
+	if ((ready_q != &ready_usb_bulk_in_msg_queue) || (ready_class_depth[READY_CLASS_ACL_DATA] == 0))
+		return IOS_EQUEUEEMPTY;
+
+	/* Then data reports, round-robin between the fake Wiimotes */
+	for (int i = 0; i < MAX_FAKE_WIIMOTES; i++) {
+		index = (ready_usb_bulk_in_data_msg_queue_next + i) % MAX_FAKE_WIIMOTES;
+		data_q = &ready_usb_bulk_in_data_msg_queues[index];
+		if (ready_queue_receive(data_q, msg) == IOS_OK) {
+			ready_usb_bulk_in_data_msg_queue_next = (index + 1) % MAX_FAKE_WIIMOTES;
+			return IOS_OK;
+		}
+	}
+
+	return IOS_EQUEUEEMPTY;
+}
+
+/* Picks the next message to deliver to the host on an endpoint */
+static int ready_sched_receive(ready_sched_t *sched, void **msg)
+{
+	ready_source_e source;
+	int ret;
+
+	/* Every source with pending messages gets a turn within two passes */
+	for (int i = 0; i < 2 * NUM_READY_SOURCES; i++) {
+		source = sched->turn;
+		if (sched->deficit[source] > 0) {
+			if (source == READY_SOURCE_REAL)
+				ret = ready_queue_receive(sched->real, msg);
+			else
+				ret = ready_queue_schedule_injected(sched->injected, msg);
+			if (ret == IOS_OK) {
+				sched->deficit[source]--;
+				return IOS_OK;
+			}
+			sched->deficit[source] = 0;
+		}
+		sched->turn = (source + 1) % NUM_READY_SOURCES;
+		sched->deficit[sched->turn] += ready_source_weight[sched->turn];
+	}
+
+	return IOS_EQUEUEEMPTY;
 }
 
-static inline int inject_msg_to_usb_intr_ready_queue(injmessage *msg)
+static bool usb_bulk_in_buffer_pending(void)
 {
-	return handle_bulk_intr_ready_message(msg, pending_usb_intr_msg_queue_id,
-					      ready_usb_intr_msg_queue_id);
+	ipcmessage *pend_msg;
+
+	if (os_message_queue_receive(pending_usb_bulk_in_msg_queue_id, &pend_msg,
+				     IOS_MESSAGE_NOBLOCK) != IOS_OK)
+		return false;
+
+	/* Put it back to the front of the PendingQ */
+	os_message_queue_send_now(pending_usb_bulk_in_msg_queue_id, pend_msg, IOS_MESSAGE_NOBLOCK);
+	return true;
 }
 
-static inline int inject_msg_to_usb_bulk_in_ready_queue(injmessage *msg)
+/* Called from the USB HID worker thread */
+void request_input_wakeup(void)
 {
-	return handle_bulk_intr_ready_message(msg, pending_usb_bulk_in_msg_queue_id,
-					      ready_usb_bulk_in_msg_queue_id);
+	if (input_wakeup_pending)
+		return;
+
+	input_wakeup_pending = true;
+	if (os_message_queue_send(orig_msg_queueid, (void *)INPUT_WAKEUP_COOKIE,
+				  IOS_MESSAGE_NOBLOCK) != IOS_OK)
+		input_wakeup_pending = false;
 }
 
 /* HCI and ACL/L2CAP message enqueue (injection) helpers */
 
-static injmessage *alloc_hci_event_msg(void **event_payload, u8 event, u8 event_size)
+static void *alloc_hci_event_msg(void **event_payload, u8 event, u8 event_size)
 {
 	hci_event_hdr_t *hdr;
-	injmessage *msg = alloc_inject_message((void **)&hdr, sizeof(*hdr) + event_size);
+	void *msg = alloc_inject_message((void **)&hdr, sizeof(*hdr) + event_size,
+					 pending_usb_intr_msg_queue_id);
 	if (!msg)
 		return NULL;
 
@@ -187,10 +511,11 @@ static injmessage *alloc_hci_event_msg(void **event_payload, u8 event, u8 event_
 	return msg;
 }
 
-static injmessage *alloc_hci_acl_msg(void **acl_payload, u16 hci_con_handle, u16 acl_payload_size)
+static void *alloc_hci_acl_msg(void **acl_payload, u16 hci_con_handle, u16 acl_payload_size)
 {
 	hci_acldata_hdr_t *hdr;
-	injmessage *msg = alloc_inject_message((void **)&hdr, sizeof(*hdr) + acl_payload_size);
+	void *msg = alloc_inject_message((void **)&hdr, sizeof(*hdr) + acl_payload_size,
+					 pending_usb_bulk_in_msg_queue_id);
 	if (!msg)
 		return NULL;
 
@@ -206,7 +531,7 @@ static injmessage *alloc_hci_acl_msg(void **acl_payload, u16 hci_con_handle, u16
 int enqueue_hci_event_command_status(u16 opcode)
 {
 	hci_command_status_ep *ep;
-	injmessage *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_COMMAND_STATUS, sizeof(*ep));
+	void *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_COMMAND_STATUS, sizeof(*ep));
 	if (!msg)
 		return IOS_ENOMEM;
 
@@ -221,8 +546,8 @@ int enqueue_hci_event_command_status(u16 opcode)
 int enqueue_hci_event_command_compl(u16 opcode, const void *payload, u32 payload_size)
 {
 	hci_command_compl_ep *ep;
-	injmessage *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_COMMAND_COMPL,
-					      sizeof(*ep) + payload_size);
+	void *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_COMMAND_COMPL,
+					sizeof(*ep) + payload_size);
 	if (!msg)
 		return IOS_ENOMEM;
 
@@ -238,7 +563,7 @@ int enqueue_hci_event_command_compl(u16 opcode, const void *payload, u32 payload
 int enqueue_hci_event_con_req(const bdaddr_t *bdaddr, u8 uclass0, u8 uclass1, u8 uclass2, u8 link_type)
 {
 	hci_con_req_ep *ep;
-	injmessage *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_CON_REQ, sizeof(*ep));
+	void *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_CON_REQ, sizeof(*ep));
 	if (!msg)
 		return IOS_ENOMEM;
 
@@ -255,7 +580,7 @@ int enqueue_hci_event_con_req(const bdaddr_t *bdaddr, u8 uclass0, u8 uclass1, u8
 int enqueue_hci_event_discon_compl(u16 con_handle, u8 status, u8 reason)
 {
 	hci_discon_compl_ep *ep;
-	injmessage *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_DISCON_COMPL, sizeof(*ep));
+	void *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_DISCON_COMPL, sizeof(*ep));
 	if (!msg)
 		return IOS_ENOMEM;
 
@@ -270,7 +595,7 @@ int enqueue_hci_event_discon_compl(u16 con_handle, u8 status, u8 reason)
 int enqueue_hci_event_con_compl(const bdaddr_t *bdaddr, u16 con_handle, u8 status)
 {
 	hci_con_compl_ep *ep;
-	injmessage *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_CON_COMPL, sizeof(*ep));
+	void *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_CON_COMPL, sizeof(*ep));
 	if (!msg)
 		return IOS_ENOMEM;
 
@@ -287,7 +612,7 @@ int enqueue_hci_event_con_compl(const bdaddr_t *bdaddr, u16 con_handle, u8 statu
 int enqueue_hci_event_role_change(const bdaddr_t *bdaddr, u8 role)
 {
 	hci_role_change_ep *ep;
-	injmessage *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_ROLE_CHANGE, sizeof(*ep));
+	void *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_ROLE_CHANGE, sizeof(*ep));
 	if (!msg)
 		return IOS_ENOMEM;
 
@@ -299,9 +624,29 @@ int enqueue_hci_event_role_change(const bdaddr_t *bdaddr, u8 role)
 	return inject_msg_to_usb_intr_ready_queue(msg);
 }
 
-static injmessage *alloc_l2cap_msg(void **l2cap_payload, u16 hci_con_handle, u16 dcid, u16 size)
+int enqueue_hci_event_num_compl_pkts(const hci_num_compl_pkts_info *info, u8 num_con_handles)
 {
-	injmessage *msg;
+	hci_num_compl_pkts_ep *ep;
+	hci_num_compl_pkts_info *ep_info;
+	void *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_NUM_COMPL_PKTS,
+					sizeof(*ep) + num_con_handles * sizeof(*info));
+	if (!msg)
+		return IOS_ENOMEM;
+
+	/* Fill event data */
+	ep->num_con_handles = num_con_handles;
+	ep_info = (void *)((u8 *)ep + sizeof(*ep));
+	for (int i = 0; i < num_con_handles; i++) {
+		ep_info[i].con_handle = htole16(info[i].con_handle);
+		ep_info[i].compl_pkts = htole16(info[i].compl_pkts);
+	}
+
+	return inject_msg_to_usb_intr_ready_queue(msg);
+}
+
+static void *alloc_l2cap_msg(void **l2cap_payload, u16 hci_con_handle, u16 dcid, u16 size)
+{
+	void *msg;
 	l2cap_hdr_t *hdr;
 
 	msg = alloc_hci_acl_msg((void **)&hdr, hci_con_handle, sizeof(l2cap_hdr_t) + size);
@@ -316,10 +661,10 @@ static injmessage *alloc_l2cap_msg(void **l2cap_payload, u16 hci_con_handle, u16
 	return msg;
 }
 
-static injmessage *alloc_l2cap_cmd_msg(void **l2cap_cmd_payload, u16 hci_con_handle,
-				       u8 code, u8 ident, u16 size)
+static void *alloc_l2cap_cmd_msg(void **l2cap_cmd_payload, u16 hci_con_handle,
+				 u8 code, u8 ident, u16 size)
 {
-	injmessage *msg;
+	void *msg;
 	l2cap_cmd_hdr_t *hdr;
 
 	msg = alloc_l2cap_msg((void **)&hdr, hci_con_handle, L2CAP_SIGNAL_CID,
@@ -339,7 +684,7 @@ static injmessage *alloc_l2cap_cmd_msg(void **l2cap_cmd_payload, u16 hci_con_han
 int l2cap_send_msg(u16 hci_con_handle, u16 dcid, const void *data, u16 size)
 {
 	void *payload;
-	injmessage *msg = alloc_l2cap_msg(&payload, hci_con_handle, dcid, size);
+	void *msg = alloc_l2cap_msg(&payload, hci_con_handle, dcid, size);
 	if (!msg)
 		return IOS_ENOMEM;
 
@@ -351,7 +696,7 @@ int l2cap_send_msg(u16 hci_con_handle, u16 dcid, const void *data, u16 size)
 
 int l2cap_send_connect_req(u16 hci_con_handle, u16 psm, u16 scid)
 {
-	injmessage *msg;
+	void *msg;
 	l2cap_con_req_cp *req;
 
 	msg = alloc_l2cap_cmd_msg((void **)&req, hci_con_handle, L2CAP_CONNECT_REQ,
@@ -368,7 +713,7 @@ int l2cap_send_connect_req(u16 hci_con_handle, u16 psm, u16 scid)
 
 int l2cap_send_disconnect_req(u16 hci_con_handle, u16 dcid, u16 scid)
 {
-	injmessage *msg;
+	void *msg;
 	l2cap_discon_req_cp *req;
 
 	msg = alloc_l2cap_cmd_msg((void **)&req, hci_con_handle, L2CAP_DISCONNECT_REQ,
@@ -385,7 +730,7 @@ int l2cap_send_disconnect_req(u16 hci_con_handle, u16 dcid, u16 scid)
 
 int l2cap_send_disconnect_rsp(u16 hci_con_handle, u8 ident, u16 dcid, u16 scid)
 {
-	injmessage *msg;
+	void *msg;
 	l2cap_discon_rsp_cp *req;
 
 	msg = alloc_l2cap_cmd_msg((void **)&req, hci_con_handle, L2CAP_DISCONNECT_RSP,
@@ -402,7 +747,7 @@ int l2cap_send_disconnect_rsp(u16 hci_con_handle, u8 ident, u16 dcid, u16 scid)
 
 int l2cap_send_config_req(u16 hci_con_handle, u16 remote_cid, u16 mtu, u16 flush_time_out)
 {
-	injmessage *msg;
+	void *msg;
 	l2cap_cfg_req_cp *req;
 	l2cap_cfg_opt_t *opt;
 	u32 size = sizeof(l2cap_cfg_req_cp);
@@ -445,9 +790,11 @@ int l2cap_send_config_req(u16 hci_con_handle, u16 remote_cid, u16 mtu, u16 flush
 
 int l2cap_send_config_rsp(u16 hci_con_handle, u16 remote_cid, u8 ident, const u8 *options, u32 options_len)
 {
-	injmessage *msg;
+	void *msg;
 	l2cap_cfg_rsp_cp *req;
 
+	if (options_len > L2CAP_CFG_RSP_MAX_OPTIONS)
+		return IOS_EINVAL;
 	msg = alloc_l2cap_cmd_msg((void **)&req, hci_con_handle, L2CAP_CONFIG_RSP,
 				  ident, sizeof(*req) + options_len);
 	if (!msg)
@@ -463,6 +810,84 @@ int l2cap_send_config_rsp(u16 hci_con_handle, u16 remote_cid, u8 ident, const u8
 	return inject_msg_to_usb_bulk_in_ready_queue(msg);
 }
 
+void hid_input_report_hdr_init(hid_input_report_hdr_t *hdr, u16 hci_con_handle, u16 dcid)
+{
+	hdr->acl.con_handle = htole16(HCI_MK_CON_HANDLE(hci_con_handle, HCI_PACKET_START,
+							HCI_POINT2POINT));
+	hdr->acl.length = 0;
+	hdr->l2cap.length = 0;
+	hdr->l2cap.dcid = htole16(dcid);
+	hdr->hid_type = (HID_TYPE_DATA << 4) | HID_PARAM_INPUT;
+}
+
+static void *alloc_hid_input_report_msg(const hid_input_report_hdr_t *hdr, u8 report_id,
+					const void *data, u16 size)
+{
+	hid_input_report_hdr_t *msg_hdr;
+	u8 *payload;
+	/* HID type and report ID */
+	u16 l2cap_size = 2 + size;
+	void *msg = alloc_inject_message((void **)&msg_hdr, sizeof(*msg_hdr) + 1 + size,
+					 pending_usb_bulk_in_msg_queue_id);
+	if (!msg)
+		return NULL;
+
+	/* Fill message data */
+	memcpy(msg_hdr, hdr, sizeof(*msg_hdr));
+	msg_hdr->acl.length = htole16(sizeof(l2cap_hdr_t) + l2cap_size);
+	msg_hdr->l2cap.length = htole16(l2cap_size);
+	payload = (u8 *)msg_hdr + sizeof(*msg_hdr);
+	payload[0] = report_id;
+	memcpy(&payload[1], data, size);
+
+	return msg;
+}
+
+int hid_send_input_report(const hid_input_report_hdr_t *hdr, u8 report_id, const void *data, u16 size)
+{
+	void *msg = alloc_hid_input_report_msg(hdr, report_id, data, size);
+	if (!msg)
+		return IOS_ENOMEM;
+
+	return inject_msg_to_usb_bulk_in_ready_queue(msg);
+}
+
+int hid_send_data_report(const hid_input_report_hdr_t *hdr, u8 index, void **queued,
+			 u8 report_id, const void *data, u16 size)
+{
+	injmessage *queued_msg = *queued;
+	u8 tag = index + 1;
+	void *msg;
+	int ret;
+
+	assert(index < MAX_FAKE_WIIMOTES);
+
+	/* If the previous report is still waiting in the ReadyQ (the host is not reading
+	 * fast enough), overwrite it with the newest state instead of queuing another one */
+	if (queued_msg && queued_msg->used && (queued_msg->tag == tag) &&
+	    (queued_msg->size == sizeof(*hdr) + 1 + size) &&
+	    (queued_msg->data[sizeof(*hdr)] == report_id)) {
+		memcpy(&queued_msg->data[sizeof(*hdr) + 1], data, size);
+		injmessages_coalesced++;
+		return IOS_OK;
+	}
+
+	msg = alloc_hid_input_report_msg(hdr, report_id, data, size);
+	if (!msg) {
+		*queued = NULL;
+		return IOS_ENOMEM;
+	}
+
+	if (is_message_injected(msg))
+		((injmessage *)msg)->tag = tag;
+
+	ret = inject_data_report_to_usb_bulk_in_ready_queue(msg, index);
+
+	/* Still alive only if it's sitting on the ReadyQ */
+	*queued = (is_message_injected(msg) && ((injmessage *)msg)->used) ? msg : NULL;
+	return ret;
+}
+
 /* Main IOCTLV handler */
 
 static int handle_oh1_dev_ioctlv(ipcmessage *recv_msg, ipcmessage **ret_msg, u32 cmd,
@@ -470,7 +895,7 @@ static int handle_oh1_dev_ioctlv(ipcmessage *recv_msg, ipcmessage **ret_msg, u32
 {
 	int ret = 0;
 	void *data;
-	u16 wLength;
+	u16 wLength, len;
 	u8 bEndpoint, bRequest;
 
 	/* Invalidate cache */
@@ -482,10 +907,17 @@ static int handle_oh1_dev_ioctlv(ipcmessage *recv_msg, ipcmessage **ret_msg, u32
 		if (bRequest == EP_HCI_CTRL) {
 			wLength = le16toh(*(u16 *)vector[4].data);
 			data    = vector[6].data;
-			hci_state_handle_hci_cmd_from_host(data, wLength, fwd_to_usb);
+			len = hci_state_handle_hci_cmd_from_host(data, wLength, fwd_to_usb);
 			/* If we don't have to hand it down, we can already ACK it */
-			if (!*fwd_to_usb)
+			if (!*fwd_to_usb) {
 				ret = os_message_queue_ack(recv_msg, wLength);
+			} else if (len != wLength) {
+				/* Entries were dropped from the command, shorten the transfer */
+				*(u16 *)vector[4].data = htole16(len);
+				vector[6].len = len;
+				os_sync_after_write(vector[4].data, sizeof(u16));
+				os_sync_after_write(&vector[6], sizeof(vector[6]));
+			}
 		}
 		break;
 	}
@@ -503,11 +935,12 @@ static int handle_oh1_dev_ioctlv(ipcmessage *recv_msg, ipcmessage **ret_msg, u32
 		} else if (bEndpoint == EP_ACL_DATA_IN) {
 			/* We are given an ACL buffer to fill */
 			wLength = *(u16 *)vector[1].data;
-			ret = handle_bulk_intr_pending_message(recv_msg, wLength, ret_msg,
-							       ready_usb_bulk_in_msg_queue_id,
+			ret = handle_bulk_intr_pending_message(recv_msg, wLength,
+							       hci_state_get_acl_data_pkt_size(), ret_msg,
+							       &usb_bulk_in_ready_sched,
 							       pending_usb_bulk_in_msg_queue_id,
-							       &usb_bulk_in_hand_down_msg,
-							       &usb_bulk_in_hand_down_msg_pending,
+							       usb_bulk_in_hand_down_msgs,
+							       ARRAY_SIZE(usb_bulk_in_hand_down_msgs),
 							       fwd_to_usb);
 		}
 		break;
@@ -517,11 +950,12 @@ static int handle_oh1_dev_ioctlv(ipcmessage *recv_msg, ipcmessage **ret_msg, u32
 		if (bEndpoint == EP_HCI_EVENT) {
 			wLength = *(u16 *)vector[1].data;
 			/* We are given a HCI buffer to fill */
-			ret = handle_bulk_intr_pending_message(recv_msg, wLength, ret_msg,
-							       ready_usb_intr_msg_queue_id,
+			ret = handle_bulk_intr_pending_message(recv_msg, wLength,
+							       HCI_EVENT_PKT_SIZE, ret_msg,
+							       &usb_intr_ready_sched,
 							       pending_usb_intr_msg_queue_id,
-							       &usb_intr_hand_down_msg,
-							       &usb_intr_hand_down_msg_pending,
+							       usb_intr_hand_down_msgs,
+							       ARRAY_SIZE(usb_intr_hand_down_msgs),
 							       fwd_to_usb);
 		}
 		break;
@@ -545,64 +979,164 @@ static inline void copy_data_to_ipcmessage(ipcmessage *dst, const void *src, u16
 	os_sync_after_write(dst_data, len);
 }
 
-static inline void configure_hand_down_msg(ipcmessage *msg, int fd, u16 wLength)
+static void init_hand_down_msgs(hand_down_msg *msgs, u32 count, u8 *data, u16 data_size,
+			       u8 endpoint, u32 command)
+{
+	for (int i = 0; i < count; i++) {
+		msgs[i].data = data + i * data_size;
+		msgs[i].data_size = data_size;
+		msgs[i].endpoint = endpoint;
+		msgs[i].pending = false;
+		msgs[i].vectors[0].data = &msgs[i].endpoint;
+		msgs[i].vectors[0].len = sizeof(msgs[i].endpoint);
+		msgs[i].vectors[1].data = &msgs[i].length;
+		msgs[i].vectors[1].len = sizeof(msgs[i].length);
+		msgs[i].vectors[2].data = msgs[i].data;
+		msgs[i].vectors[2].len = data_size;
+		msgs[i].msg.command = IOS_IOCTLV;
+		msgs[i].msg.result = IOS_OK;
+		msgs[i].msg.fd = 0; /* Filled dynamically */
+		msgs[i].msg.ioctlv.command = command;
+		msgs[i].msg.ioctlv.num_in = 2;
+		msgs[i].msg.ioctlv.num_io = 1;
+		msgs[i].msg.ioctlv.vector = msgs[i].vectors;
+	}
+}
+
+static inline hand_down_msg *get_free_hand_down_msg(hand_down_msg *msgs, u32 count)
 {
-	assert(wLength <= HAND_DOWN_MSG_DATA_SIZE);
+	for (int i = 0; i < count; i++) {
+		if (!msgs[i].pending)
+			return &msgs[i];
+	}
+	return NULL;
+}
 
-	*(u16 *)msg->ioctlv.vector[1].data = wLength;
-	msg->ioctlv.vector[2].len = wLength;
-	msg->fd = fd;
+static inline hand_down_msg *get_hand_down_msg(hand_down_msg *msgs, u32 count,
+					       const ipcmessage *msg)
+{
+	if (((uintptr_t)msg < (uintptr_t)msgs) || ((uintptr_t)msg >= (uintptr_t)&msgs[count]))
+		return NULL;
+	return &msgs[((uintptr_t)msg - (uintptr_t)msgs) / sizeof(*msgs)];
+}
 
-	os_sync_before_read(msg->ioctlv.vector[2].data, wLength);
+/* The message is back from OH1 and out of the real ReadyQ, it can be handed down again */
+static inline void release_hand_down_msg(const ipcmessage *msg)
+{
+	hand_down_msg *hand_down;
+
+	if ((hand_down = get_hand_down_msg(usb_intr_hand_down_msgs,
+					   ARRAY_SIZE(usb_intr_hand_down_msgs), msg)) ||
+	    (hand_down = get_hand_down_msg(usb_bulk_in_hand_down_msgs,
+					   ARRAY_SIZE(usb_bulk_in_hand_down_msgs), msg)))
+		hand_down->pending = false;
+}
+
+static inline bool is_acl_data_in_msg(const ipcmessage *msg)
+{
+	return (msg->command == IOS_IOCTLV) &&
+	       (msg->ioctlv.command == USBV0_IOCTLV_BLKMSG) &&
+	       (*(u8 *)msg->ioctlv.vector[0].data == EP_ACL_DATA_IN);
+}
+
+static inline void configure_hand_down_msg(hand_down_msg *msg, int fd, u16 wLength)
+{
+	assert(wLength <= msg->data_size);
+
+	msg->length = wLength;
+	msg->vectors[2].len = wLength;
+	msg->msg.fd = fd;
+	msg->pending = true;
+
+	os_sync_before_read(msg->data, wLength);
+}
+
+/* Data size of a ReadyQ message, or the error of a completed hand down message */
+static inline int ready_msg_size(const void *ready_msg)
+{
+	if (is_message_injected(ready_msg))
+		return ((const injmessage *)ready_msg)->size;
+	return ((const ipcmessage *)ready_msg)->result;
+}
+
+static inline bool ready_msg_fits(const ipcmessage *pend_msg, const void *ready_msg)
+{
+	return ready_msg_size(ready_msg) <= (int)pend_msg->ioctlv.vector[2].len;
 }
 
 static inline int copy_and_ack_ipcmessage(ipcmessage *pend_msg, void *ready_msg)
 {
-	int retval;
+	int retval = ready_msg_size(ready_msg);
 	void *ready_data;
 
-	if (is_message_injected(ready_msg)) {
+	if (is_message_injected(ready_msg))
 		ready_data = ((injmessage *)ready_msg)->data;
-		retval = ((injmessage *)ready_msg)->size;
-		copy_data_to_ipcmessage(pend_msg, ready_data, retval);
-		/* If it was a message we injected ourselves, we have to deallocate it */
-		os_heap_free(injmessages_heap_id, ready_msg);
-	} else {
+	else
 		ready_data = ((ipcmessage *)ready_msg)->ioctlv.vector[2].data;
-		retval = ((ipcmessage *)ready_msg)->result;
-		/* If retval is positive, it contains the data size, an error otherwise */
-		if (retval > 0)
+
+	if (retval > 0) {
+		/* The host buffer is too small for the message: drop it, like an USB overflow */
+		if (!ready_msg_fits(pend_msg, ready_msg))
+			retval = IOS_EINVAL;
+		else
 			copy_data_to_ipcmessage(pend_msg, ready_data, retval);
 	}
 
+	/* If it was a message we injected ourselves, we have to deallocate it */
+	if (is_message_injected(ready_msg))
+		injmessage_free(ready_msg);
+	else
+		release_hand_down_msg(ready_msg);
+
 	/* Finally, we can ACK the message! */
 	return os_message_queue_ack(pend_msg, retval);
 }
 
-static int handle_bulk_intr_pending_message(ipcmessage *pend_msg, u16 size, ipcmessage **ret_msg,
-					    int ready_queue_id, int pending_queue_id,
-					    ipcmessage *hand_down_msg, bool *hand_down_msg_pending,
+static int handle_bulk_intr_pending_message(ipcmessage *pend_msg, u16 size, u16 max_size,
+					    ipcmessage **ret_msg, ready_sched_t *sched, int pending_queue_id,
+					    hand_down_msg *hand_down_msgs, u32 num_hand_down_msgs,
 					    bool *fwd_to_usb)
 {
 	int ret;
 	void *ready_msg;
+	hand_down_msg *hand_down;
+
+	/* The device never sends more than max_size bytes (0 if unknown yet) at once */
+	if (max_size && (size > max_size))
+		size = max_size;
 
 	/* Fast-path: check if we already have a message ready to be delivered */
-	ret = os_message_queue_receive(ready_queue_id, &ready_msg, IOS_MESSAGE_NOBLOCK);
+	ret = ready_sched_receive(sched, &ready_msg);
 	if (ret == IOS_OK) {
 		ret = copy_and_ack_ipcmessage(pend_msg, ready_msg);
 		/* We have already ACKed it, we don't have to hand it down to OH1 */
 		*fwd_to_usb = false;
+
+		/* Keep receiving from the device while the injected messages keep the ReadyQ busy,
+		 * so that the real traffic is there to take its turn */
+		hand_down = get_free_hand_down_msg(hand_down_msgs, num_hand_down_msgs);
+		if (hand_down && (size <= hand_down->data_size)) {
+			configure_hand_down_msg(hand_down, pend_msg->fd, size);
+			*ret_msg = &hand_down->msg;
+			*fwd_to_usb = true;
+		}
 	} else {
+		if (size > hand_down_msgs[0].data_size) {
+			/* Too big for our buffers, hand it down untouched. The completion is
+			 * caught by OH1_IOS_ResourceReply_hook, which patches and ACKs it. */
+			return IOS_OK;
+		}
+
 		/* Push the received message to the PendingQ */
 		ret = os_message_queue_send(pending_queue_id, pend_msg, IOS_MESSAGE_NOBLOCK);
-		if ((ret == IOS_OK) && !*hand_down_msg_pending) {
-			/* Hand down to OH1 a copy of the message for it to fill it from real USB data */
-			configure_hand_down_msg(hand_down_msg, pend_msg->fd, size);
-			*ret_msg = hand_down_msg;
-			*hand_down_msg_pending = true;
+		hand_down = get_free_hand_down_msg(hand_down_msgs, num_hand_down_msgs);
+		if ((ret == IOS_OK) && hand_down) {
+			/* Hand down to OH1 a copy of the message for it to fill it from real USB data.
+			 * The ReadyQ is empty, so no completed hand down message is waiting there. */
+			configure_hand_down_msg(hand_down, pend_msg->fd, size);
+			*ret_msg = &hand_down->msg;
 		} else {
-			/* We already have a hand down message to OH1 USB pending... */
+			/* All our hand down messages to OH1 USB are pending... */
 			*fwd_to_usb = false;
 		}
 	}
@@ -610,18 +1144,24 @@ static int handle_bulk_intr_pending_message(ipcmessage *pend_msg, u16 size, ipcm
 	return ret;
 }
 
-static int handle_bulk_intr_ready_message(void *ready_msg, int pending_queue_id, int ready_queue_id)
+static int handle_bulk_intr_ready_message(void *ready_msg, int pending_queue_id, ready_queue_t *ready_q)
 {
 	int ret;
 	ipcmessage *pend_msg;
 
 	/* Fast-path: check if we have a PendingQ message to fill */
 	ret = os_message_queue_receive(pending_queue_id, &pend_msg, IOS_MESSAGE_NOBLOCK);
+	if ((ret == IOS_OK) && !ready_msg_fits(pend_msg, ready_msg)) {
+		/* Too small, put it back to the front of the PendingQ to keep the order */
+		os_message_queue_send_now(pending_queue_id, pend_msg, IOS_MESSAGE_NOBLOCK);
+		ret = IOS_EQUEUEEMPTY;
+	}
 	if (ret == IOS_OK) {
+		ready_class_delivered[ready_q->class]++;
 		ret = copy_and_ack_ipcmessage(pend_msg, ready_msg);
 	} else {
 		/* Push message to ReadyQ. We store the return value/size to the "result" field */
-		ret = os_message_queue_send(ready_queue_id, ready_msg, IOS_MESSAGE_NOBLOCK);
+		ret = ready_queue_send(ready_q, ready_msg);
 	}
 
 	return ret;
@@ -629,7 +1169,7 @@ static int handle_bulk_intr_ready_message(void *ready_msg, int pending_queue_id,
 
 /* Hooked functions */
 
-static int OH1_IOS_ReceiveMessage_hook(int queueid, ipcmessage **ret_msg, u32 flags)
+int OH1_IOS_ReceiveMessage_hook(int queueid, ipcmessage **ret_msg, u32 flags)
 {
 	int ret;
 	uintptr_t recv_data;
@@ -650,8 +1190,16 @@ static int OH1_IOS_ReceiveMessage_hook(int queueid, ipcmessage **ret_msg, u32 fl
 		} else if (recv_data == 0xcafef00d) {
 			*ret_msg = (ipcmessage *)0xcafef00d;
 			break;
-		} else if (recv_data == (uintptr_t)&periodic_timer_cookie) {
+		} else if (recv_data == PERIODIC_TIMER_COOKIE) {
 			fake_wiimote_mgr_tick_devices();
+			hci_state_tick();
+			fwd_to_usb = false;
+		} else if (recv_data == INPUT_WAKEUP_COOKIE) {
+			/* Clear it first, so that newer input changes post a new wake-up */
+			input_wakeup_pending = false;
+			/* If the host has no buffer to fill, the report will leave on the next tick */
+			if (usb_bulk_in_buffer_pending())
+				fake_wiimote_mgr_handle_input_wakeup();
 			fwd_to_usb = false;
 		} else {
 			recv_msg = (ipcmessage *)recv_data;
@@ -683,14 +1231,15 @@ static int OH1_IOS_ReceiveMessage_hook(int queueid, ipcmessage **ret_msg, u32 fl
 	return ret;
 }
 
-static int OH1_IOS_ResourceReply_hook(ipcmessage *ready_msg, int retval)
+int OH1_IOS_ResourceReply_hook(ipcmessage *ready_msg, int retval)
 {
 	int ret;
 	ioctlv *vector;
 	void *data;
+	hand_down_msg *hand_down;
 
-	if (ready_msg == &usb_intr_hand_down_msg) {
-		usb_intr_hand_down_msg_pending = 0;
+	if ((hand_down = get_hand_down_msg(usb_intr_hand_down_msgs,
+					   ARRAY_SIZE(usb_intr_hand_down_msgs), ready_msg))) {
 		ensure_initalized();
 		assert(ready_msg->command == IOS_IOCTLV);
 		assert(ready_msg->ioctlv.command == USBV0_IOCTLV_INTRMSG);
@@ -698,14 +1247,17 @@ static int OH1_IOS_ResourceReply_hook(ipcmessage *ready_msg, int retval)
 		if (retval > 0) {
 			vector = ready_msg->ioctlv.vector;
 			data = vector[2].data;
-			hci_state_handle_hci_event_from_controller(data, retval);
+			retval = hci_state_handle_hci_event_from_controller(data, retval, vector[2].len);
 		}
 		ready_msg->result = retval;
 		ret = handle_bulk_intr_ready_message(ready_msg, pending_usb_intr_msg_queue_id,
-						     ready_usb_intr_msg_queue_id);
+						     &ready_usb_intr_real_msg_queue);
+		/* Delivered messages were released when copied, dropped ones are released here */
+		if (ret < 0)
+			hand_down->pending = false;
 		return ret;
-	} else if (ready_msg == &usb_bulk_in_hand_down_msg) {
-		usb_bulk_in_hand_down_msg_pending = 0;
+	} else if ((hand_down = get_hand_down_msg(usb_bulk_in_hand_down_msgs,
+						  ARRAY_SIZE(usb_bulk_in_hand_down_msgs), ready_msg))) {
 		ensure_initalized();
 		vector = ready_msg->ioctlv.vector;
 		assert(ready_msg->command == IOS_IOCTLV);
@@ -718,8 +1270,15 @@ static int OH1_IOS_ResourceReply_hook(ipcmessage *ready_msg, int retval)
 		}
 		ready_msg->result = retval;
 		ret = handle_bulk_intr_ready_message(ready_msg, pending_usb_bulk_in_msg_queue_id,
-						     ready_usb_bulk_in_msg_queue_id);
+						     &ready_usb_bulk_in_real_msg_queue);
+		if (ret < 0)
+			hand_down->pending = false;
 		return ret;
+	} else if (is_acl_data_in_msg(ready_msg)) {
+		/* Oversize ACL IN buffer from the host that we handed down untouched */
+		if (retval > 0)
+			hci_state_handle_acl_data_in_response_from_controller(ready_msg->ioctlv.vector[2].data,
+									      retval);
 	}
 
 	return os_message_queue_ack(ready_msg, retval);
@@ -736,7 +1295,7 @@ static int ensure_initalized(void)
 					      ARRAY_SIZE(ready_usb_intr_msg_queue_data));
 		if (ret < 0)
 			return ret;
-		ready_usb_intr_msg_queue_id = ret;
+		ready_usb_intr_msg_queue.id = ret;
 
 		ret = os_message_queue_create(pending_usb_intr_msg_queue_data,
 					      ARRAY_SIZE(pending_usb_intr_msg_queue_data));
@@ -748,7 +1307,28 @@ static int ensure_initalized(void)
 					      ARRAY_SIZE(ready_usb_bulk_in_msg_queue_data));
 		if (ret < 0)
 			return ret;
-		ready_usb_bulk_in_msg_queue_id = ret;
+		ready_usb_bulk_in_msg_queue.id = ret;
+
+		ret = os_message_queue_create(ready_usb_intr_real_msg_queue_data,
+					      ARRAY_SIZE(ready_usb_intr_real_msg_queue_data));
+		if (ret < 0)
+			return ret;
+		ready_usb_intr_real_msg_queue.id = ret;
+
+		ret = os_message_queue_create(ready_usb_bulk_in_real_msg_queue_data,
+					      ARRAY_SIZE(ready_usb_bulk_in_real_msg_queue_data));
+		if (ret < 0)
+			return ret;
+		ready_usb_bulk_in_real_msg_queue.id = ret;
+
+		for (int i = 0; i < MAX_FAKE_WIIMOTES; i++) {
+			ret = os_message_queue_create(ready_usb_bulk_in_data_msg_queue_data[i],
+						      READY_DATA_QUEUE_SIZE);
+			if (ret < 0)
+				return ret;
+			ready_usb_bulk_in_data_msg_queues[i].id = ret;
+			ready_usb_bulk_in_data_msg_queues[i].class = READY_CLASS_ACL_DATA;
+		}
 
 		ret = os_message_queue_create(pending_usb_bulk_in_msg_queue_data,
 					      ARRAY_SIZE(pending_usb_bulk_in_msg_queue_data));
@@ -757,15 +1337,16 @@ static int ensure_initalized(void)
 		pending_usb_bulk_in_msg_queue_id = ret;
 
 		periodic_timer_id = os_create_timer(PERIODC_TIMER_PERIOD, PERIODC_TIMER_PERIOD,
-						    orig_msg_queueid, (u32)&periodic_timer_cookie);
+						    orig_msg_queueid, PERIODIC_TIMER_COOKIE);
 		if (ret < 0)
 			return ret;
 
-		/* Initialize heaps for inject messages */
-		ret = os_heap_create(injmessages_heap_data, sizeof(injmessages_heap_data));
-		if (ret < 0)
-			return ret;
-		injmessages_heap_id = ret;
+		init_hand_down_msgs(usb_intr_hand_down_msgs, ARRAY_SIZE(usb_intr_hand_down_msgs),
+				    &usb_intr_hand_down_data[0][0], HAND_DOWN_INTR_DATA_SIZE,
+				    EP_HCI_EVENT, USBV0_IOCTLV_INTRMSG);
+		init_hand_down_msgs(usb_bulk_in_hand_down_msgs, ARRAY_SIZE(usb_bulk_in_hand_down_msgs),
+				    &usb_bulk_in_hand_down_data[0][0], HAND_DOWN_BULK_IN_DATA_SIZE,
+				    EP_ACL_DATA_IN, USBV0_IOCTLV_BLKMSG);
 
 		/* Initialize global state */
 		hci_state_init();
@@ -800,11 +1381,11 @@ static s32 Patch_OH1UsbModule(void)
 
 	/* Patch IOS_ReceiveMessage syscall wrapper to jump to our function */
 	DCWrite32(addr_recv, 0x4B004718);
-	DCWrite32(addr_recv + 4, (u32)OH1_IOS_ReceiveMessage_hook);
+	DCWrite32(addr_recv + 4, (uintptr_t)OH1_IOS_ReceiveMessage_hook);
 
 	/* Patch IOS_ResourceReply syscall wrapper to jump to our function */
 	DCWrite32(addr_reply, 0x4B004718);
-	DCWrite32(addr_reply + 4, (u32)OH1_IOS_ResourceReply_hook);
+	DCWrite32(addr_reply + 4, (uintptr_t)OH1_IOS_ResourceReply_hook);
 
 	return 0;
 }
@@ -832,8 +1413,9 @@ static int patch_conf_bt_dinf(void)
 	for (int i = 0; i < conf_pads.num_registered; i++)
 		DEBUG("  registered[%d]: \"%s\"\n", i, conf_pads.registered[i].name);
 
-	/* Give at least the last two entries (out of 10) for fake Wiimotes */
-	count = conf_pads.num_registered > 8 ? 2 : (CONF_PAD_MAX_REGISTERED - conf_pads.num_registered);
+	/* Give at least the last MAX_FAKE_WIIMOTES entries (out of 10) for fake Wiimotes */
+	count = conf_pads.num_registered > (CONF_PAD_MAX_REGISTERED - MAX_FAKE_WIIMOTES) ?
+		MAX_FAKE_WIIMOTES : (CONF_PAD_MAX_REGISTERED - conf_pads.num_registered);
 	start = CONF_PAD_MAX_REGISTERED - count;
 	for (int i = 0; i < count; i++) {
 		bdaddr = FAKE_WIIMOTE_BDADDR(i);
@@ -120,11 +120,11 @@ static inline int ds3_request_data(usb_input_device_t *device)
 							   sizeof(device->usb_async_resp));
 }
 
-static int ds3_set_leds_rumble(usb_input_device_t *device, u8 led)
+static int ds3_set_leds_rumble(usb_input_device_t *device, u8 led, bool async)
 {
 	static const u8 led_pattern[] = {0x0, 0x02, 0x04, 0x08, 0x10, 0x12, 0x14, 0x18};
 
-	u8 buf[] ATTRIBUTE_ALIGN(32) = {
+	static const u8 output_report[] = {
 		0x00,                         /* Padding */
 		0x00, 0x00, 0x00, 0x00,       /* Rumble (r, r, l, l) */
 		0x00, 0x00, 0x00, 0x00,       /* Padding */
@@ -135,14 +135,26 @@ static int ds3_set_leds_rumble(usb_input_device_t *device, u8 led)
 		0xff, 0x27, 0x10, 0x00, 0x32, /* LED_1 */
 		0x00, 0x00, 0x00, 0x00, 0x00  /* LED_5 (not soldered) */
 	};
+	static_assert(sizeof(output_report) <= MEMBER_SIZE(usb_input_device_t, usb_async_output));
 
+	u8 sync_buf[sizeof(output_report)] ATTRIBUTE_ALIGN(32);
+	u8 *buf = async ? device->usb_async_output : sync_buf;
+
+	memcpy(buf, output_report, sizeof(output_report));
 	buf[9] = led_pattern[led % ARRAY_SIZE(led_pattern)];
 
+	if (async)
+		return usb_device_driver_issue_output_ctrl_transfer_async(device,
+							USB_REQTYPE_INTERFACE_SET,
+							USB_REQ_SETREPORT,
+							(USB_REPTYPE_OUTPUT << 8) | 0x01, 0,
+							buf, sizeof(output_report));
+
 	return usb_device_driver_issue_ctrl_transfer(device,
 						     USB_REQTYPE_INTERFACE_SET,
 						     USB_REQ_SETREPORT,
 						     (USB_REPTYPE_OUTPUT << 8) | 0x01, 0,
-						     buf, sizeof(buf));
+						     buf, sizeof(output_report));
 }
 
 int ds3_driver_ops_init(usb_input_device_t *device)
@@ -167,13 +179,13 @@ int ds3_driver_ops_init(usb_input_device_t *device)
 
 int ds3_driver_ops_disconnect(usb_input_device_t *device)
 {
-	ds3_set_leds_rumble(device, 0);
+	ds3_set_leds_rumble(device, 0, false);
 	return 0;
 }
 
 int ds3_driver_ops_slot_changed(usb_input_device_t *device, u8 slot)
 {
-	return ds3_set_leds_rumble(device, slot);
+	return ds3_set_leds_rumble(device, slot, true);
 }
 
 int ds3_driver_ops_usb_async_resp(usb_input_device_t *device)
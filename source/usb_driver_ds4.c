@@ -109,9 +109,11 @@ static inline void ds4_map_buttons(const struct ds4_input_report *input, u16 *bu
 		*buttons |= WPAD_BUTTON_PLUS;
 }
 
-static int ds4_set_leds_rumble(usb_input_device_t *device, u8 r, u8 g, u8 b)
+static int ds4_set_leds_rumble(usb_input_device_t *device, u8 r, u8 g, u8 b, bool async)
 {
-	u8 buf[] ATTRIBUTE_ALIGN(32) = {
+	u8 sync_buf[11] ATTRIBUTE_ALIGN(32);
+	u8 *buf = async ? device->usb_async_output : sync_buf;
+	const u8 output_report[] = {
 		0x05, // Report ID
 		0x03, 0x00, 0x00,
 		0x00, // Fast motor
@@ -120,8 +122,15 @@ static int ds4_set_leds_rumble(usb_input_device_t *device, u8 r, u8 g, u8 b)
 		0x00, // LED on duration
 		0x00  // LED off duration
 	};
+	static_assert(sizeof(output_report) == sizeof(sync_buf));
 
-	return usb_device_driver_issue_intr_transfer(device, 1, buf, sizeof(buf));
+	memcpy(buf, output_report, sizeof(output_report));
+
+	if (async)
+		return usb_device_driver_issue_output_intr_transfer_async(device, buf,
+									  sizeof(output_report));
+
+	return usb_device_driver_issue_intr_transfer(device, 1, buf, sizeof(output_report));
 }
 
 static inline int ds4_request_data(usb_input_device_t *device)
@@ -143,7 +152,7 @@ int ds4_driver_ops_init(usb_input_device_t *device)
 
 int ds4_driver_ops_disconnect(usb_input_device_t *device)
 {
-	ds4_set_leds_rumble(device, 0, 0, 0);
+	ds4_set_leds_rumble(device, 0, 0, 0, false);
 	return 0;
 }
 
@@ -163,7 +172,7 @@ int ds4_driver_ops_slot_changed(usb_input_device_t *device, u8 slot)
 	   g = colors[slot][1],
 	   b = colors[slot][2];
 
-	return ds4_set_leds_rumble(device, r, g, b);
+	return ds4_set_leds_rumble(device, r, g, b, true);
 }
 
 int ds4_driver_ops_usb_async_resp(usb_input_device_t *device)
@@ -53,6 +53,8 @@ struct usb_hid_v5_transfer {
 static_assert(sizeof(struct usb_hid_v5_transfer) == 64);
 
 static usb_input_device_t usb_devices[MAX_FAKE_WIIMOTES];
+/* Slots holding a valid device. Only used by the USB HID worker. */
+static u32 usb_devices_used;
 
 static const usb_device_driver_t usb_device_drivers[] = {
 	{SONY_VID, DS3_PID,   ds3_driver_ops_init, ds3_driver_ops_disconnect,
@@ -70,15 +72,24 @@ static u32 queue_data[32] ATTRIBUTE_ALIGN(32);
 static int queue_id = -1;
 
 /* Async notification messages */
-static areply notification_messages[2] = {0};
+static areply notification_messages[4] = {0};
 #define MESSAGE_DEVCHANGE	&notification_messages[0]
 #define MESSAGE_ATTACHFINISH	&notification_messages[1]
+#define MESSAGE_OUTPUT		&notification_messages[2]
+#define MESSAGE_DISCONNECT	&notification_messages[3]
+
+/* Only one MESSAGE_OUTPUT and one MESSAGE_DISCONNECT can be in flight */
+static volatile bool output_wakeup_pending;
+static volatile bool disconnect_wakeup_pending;
 
 static inline usb_input_device_t *get_usb_device_for_dev_id(u32 dev_id)
 {
-	for (int i = 0; i < ARRAY_SIZE(usb_devices); i++) {
-		if (usb_devices[i].valid && (usb_devices[i].dev_id == dev_id))
-			return &usb_devices[i];
+	usb_input_device_t *device;
+
+	for (u32 mask = usb_devices_used; mask; mask &= mask - 1) {
+		device = &usb_devices[__builtin_ctz(mask)];
+		if (device->dev_id == dev_id)
+			return device;
 	}
 
 	return NULL;
@@ -86,12 +97,29 @@ static inline usb_input_device_t *get_usb_device_for_dev_id(u32 dev_id)
 
 static inline usb_input_device_t *get_free_usb_device_slot(void)
 {
-	for (int i = 0; i < ARRAY_SIZE(usb_devices); i++) {
-		if (!usb_devices[i].valid)
-			return &usb_devices[i];
+	u32 free = ~usb_devices_used & (BIT(ARRAY_SIZE(usb_devices)) - 1);
+
+	/* The completion of an output transfer still in flight from the previous device would
+	 * be taken for the new one's, so wait for it before reusing the slot */
+	for (u32 mask = free; mask; mask &= mask - 1) {
+		if (usb_devices[__builtin_ctz(mask)].output_in_flight)
+			free &= ~BIT(__builtin_ctz(mask));
 	}
 
-	return NULL;
+	if (!free)
+		return NULL;
+
+	return &usb_devices[__builtin_ctz(free)];
+}
+
+static inline usb_input_device_t *get_usb_device_for_message(const areply *message)
+{
+	uintptr_t offset = (uintptr_t)message - (uintptr_t)usb_devices;
+
+	if (offset >= sizeof(usb_devices))
+		return NULL;
+
+	return &usb_devices[offset / sizeof(usb_devices[0])];
 }
 
 static inline bool is_usb_device_connected(u32 dev_id)
@@ -267,6 +295,54 @@ int usb_device_driver_issue_intr_transfer_async(usb_input_device_t *device, int
 					      queue_id, &device->usb_async_resp_msg);
 }
 
+int usb_device_driver_issue_output_ctrl_transfer_async(usb_input_device_t *device, u8 requesttype,
+						       u8 request, u16 value, u16 index, void *data,
+						       u16 length)
+{
+	return usb_hid_v5_ctrl_transfer_async(device->host_fd, device->dev_id, requesttype, request,
+					      value, index, length, data, queue_id,
+					      &device->usb_async_output_msg);
+}
+
+int usb_device_driver_issue_output_intr_transfer_async(usb_input_device_t *device, void *data,
+						       u16 length)
+{
+	return usb_hid_v5_intr_transfer_async(device->host_fd, device->dev_id, 1, length, data,
+					      queue_id, &device->usb_async_output_msg);
+}
+
+/* Output and disconnection command queue (OH1 thread -> USB HID worker) */
+
+static void usb_hid_worker_wakeup(areply *message, volatile bool *wakeup_pending)
+{
+	if (!*wakeup_pending) {
+		*wakeup_pending = true;
+		if (os_message_queue_send(queue_id, message, IOS_MESSAGE_NOBLOCK) != IOS_OK)
+			*wakeup_pending = false;
+	}
+}
+
+static void usb_device_issue_pending_output(usb_input_device_t *device)
+{
+	int ret;
+	u8 slot;
+
+	/* Only one output transfer in flight per device. If the state changes meanwhile,
+	 * only the latest one is sent once it completes. */
+	if (!device->valid || device->disconnect_pending || device->output_in_flight ||
+	    !device->output_pending)
+		return;
+
+	device->output_pending = false;
+	barrier();
+	slot = device->output_slot;
+
+	if (device->driver->slot_changed) {
+		ret = device->driver->slot_changed(device, slot);
+		device->output_in_flight = (ret == IOS_OK);
+	}
+}
+
 static int usb_device_ops_assigned(void *usrdata, fake_wiimote_t *wiimote)
 {
 	usb_input_device_t *device = usrdata;
@@ -282,15 +358,11 @@ static int usb_device_ops_assigned(void *usrdata, fake_wiimote_t *wiimote)
 	return 0;
 }
 
-static int usb_device_ops_disconnect(void *usrdata)
+/* Turns the device off and gives it back to USB_HID (USB HID worker) */
+static void usb_device_release(usb_input_device_t *device)
 {
-	int ret = 0;
-	usb_input_device_t *device = usrdata;
-
-	DEBUG("usb_device_ops_disconnect\n");
-
 	if (device->driver->disconnect)
-		ret = device->driver->disconnect(device);
+		device->driver->disconnect(device);
 
 	/* Suspend the device */
 	usb_hid_v5_suspend_resume(device->host_fd, device->dev_id, 0, 0);
@@ -300,21 +372,33 @@ static int usb_device_ops_disconnect(void *usrdata)
 
 	/* Set this device as not valid */
 	device->valid = false;
+	usb_devices_used &= ~BIT(device - usb_devices);
+}
 
-	return ret;
+static int usb_device_ops_disconnect(void *usrdata)
+{
+	usb_input_device_t *device = usrdata;
+
+	DEBUG("usb_device_ops_disconnect\n");
+
+	/* Called from the OH1 thread: never block on USB here, let the worker release it */
+	device->disconnect_pending = true;
+	usb_hid_worker_wakeup(MESSAGE_DISCONNECT, &disconnect_wakeup_pending);
+
+	return 0;
 }
 
 static int usb_device_ops_set_leds(void *usrdata, int leds)
 {
-	int slot;
 	usb_input_device_t *device = usrdata;
 
 	DEBUG("usb_device_ops_set_leds\n");
 
-	if (device->driver->slot_changed) {
-		slot = __builtin_ffs(leds);
-		return device->driver->slot_changed(device, slot);
-	}
+	/* Called from the OH1 thread: never block on USB here, let the worker send it */
+	device->output_slot = __builtin_ffs(leds);
+	barrier();
+	device->output_pending = true;
+	usb_hid_worker_wakeup(MESSAGE_OUTPUT, &output_wakeup_pending);
 
 	return 0;
 }
@@ -341,10 +425,8 @@ static void handle_device_change_reply(int host_fd, areply *reply)
 		return;
 
 	/* First look for disconnections */
-	for (int i = 0; i < ARRAY_SIZE(usb_devices); i++) {
-		device = &usb_devices[i];
-		if (!device->valid)
-			continue;
+	for (u32 mask = usb_devices_used; mask; mask &= mask - 1) {
+		device = &usb_devices[__builtin_ctz(mask)];
 
 		found = false;
 		for (int j = 0; j < reply->result; j++) {
@@ -362,6 +444,7 @@ static void handle_device_change_reply(int host_fd, areply *reply)
 			fake_wiimote_mgr_remove_input_device(device->wiimote);
 			/* Set this device as not valid */
 			device->valid = false;
+			usb_devices_used &= ~BIT(device - usb_devices);
 		}
 	}
 
@@ -405,19 +488,23 @@ static void handle_device_change_reply(int host_fd, areply *reply)
 			continue;
 		}
 
-		/* Get a fake Wiimote from the manager */
-		if (!fake_wiimote_mgr_add_input_device(device, &input_device_usb_ops)) {
-			usb_hid_v5_release(host_fd, dev_id);
-			continue;
-		}
-
 		/* We have ownership, populate the device info */
 		device->host_fd = host_fd;
 		device->dev_id = dev_id;
 		device->driver = driver;
-		/* We will get the assigned a fake Wiimote on the assigned() callback */
-		device->wiimote = NULL;
+		device->output_pending = false;
+		device->disconnect_pending = false;
+
+		/* Get a fake Wiimote from the manager. The driver is initialized on the
+		 * assigned() callback, once the fake Wiimote is connected to the host. */
+		device->wiimote = fake_wiimote_mgr_add_input_device(device, &input_device_usb_ops);
+		if (!device->wiimote) {
+			usb_hid_v5_release(host_fd, dev_id);
+			continue;
+		}
+
 		device->valid = true;
+		usb_devices_used |= BIT(device - usb_devices);
 
 	}
 
@@ -434,8 +521,11 @@ static int usb_hid_worker(void *)
 
 	DEBUG("usb_hid_worker thread started\n");
 
-	for (int i = 0; i < ARRAY_SIZE(usb_devices); i++)
+	for (int i = 0; i < ARRAY_SIZE(usb_devices); i++) {
 		usb_devices[i].valid = false;
+		usb_devices[i].output_in_flight = false;
+	}
+	usb_devices_used = 0;
 
 	/* USB_HID supports 16 handles, libogc uses handle 0, so we use handle 15...*/
 	ret = os_open("/dev/usb/hid", 15);
@@ -468,14 +558,29 @@ static int usb_hid_worker(void *)
 			ret = os_ioctl_async(host_fd, USBV5_IOCTL_GETDEVICECHANGE, NULL, 0,
 					     device_change_devices, sizeof(device_change_devices),
 					     queue_id, MESSAGE_DEVCHANGE);
+		} else if (message == MESSAGE_OUTPUT) {
+			/* Clear it first, so that newer output requests post a new message */
+			output_wakeup_pending = false;
+			for (u32 mask = usb_devices_used; mask; mask &= mask - 1)
+				usb_device_issue_pending_output(&usb_devices[__builtin_ctz(mask)]);
+		} else if (message == MESSAGE_DISCONNECT) {
+			disconnect_wakeup_pending = false;
+			for (u32 mask = usb_devices_used; mask; mask &= mask - 1) {
+				device = &usb_devices[__builtin_ctz(mask)];
+				if (device->disconnect_pending)
+					usb_device_release(device);
+			}
 		} else {
 			/* Find if this is the reply to a USB async req issued by a device driver */
-			for (int i = 0; i < ARRAY_SIZE(usb_devices); i++) {
-				device = &usb_devices[i];
-				if (device->valid && (message == &device->usb_async_resp_msg)) {
-					if (device->driver->usb_async_resp)
-						device->driver->usb_async_resp(device);
-				}
+			device = get_usb_device_for_message(message);
+			if (device && device->valid && !device->disconnect_pending &&
+			    (message == &device->usb_async_resp_msg)) {
+				if (device->driver->usb_async_resp)
+					device->driver->usb_async_resp(device);
+			} else if (device && (message == &device->usb_async_output_msg)) {
+				/* Also for a device gone meanwhile, to free its slot */
+				device->output_in_flight = false;
+				usb_device_issue_pending_output(device);
 			}
 		}
 	}
@@ -196,6 +196,8 @@ static const sbox_t sboxes_1st_party[] = {
 
 static inline u8 ror8(u8 word, unsigned int shift)
 {
+	/* Dolphin passes the shift modulo 8: the callers pass a whole sbox byte */
+	shift %= 8;
 	return (word >> shift) | (word << (8 - shift));
 }
 
@@ -258,13 +260,56 @@ void wiimote_crypto_generate_key_from_extension_key_data(struct wiimote_encrypti
 		if (memcmp(key, check_key, sizeof(key)) == 0)
 			break;
 	}
+	/* Key data not generated by WPAD: stay within sboxes_1st_party */
+	if (idx == 7)
+		idx = 0;
 
 	generate_tables(ext_key->ft, ext_key->sb, rand, key,
 			sboxes_1st_party[idx], sboxes_1st_party[idx + 1]);
 }
 
+/* Subtracts each byte of b from the same byte of a, without borrows between bytes */
+static inline u32 sub_bytes(u32 a, u32 b)
+{
+	return ((a | 0x80808080) - (b & 0x7f7f7f7f)) ^ ((a ^ ~b) & 0x80808080);
+}
+
+/* Loads an 8-byte table rotated so that byte i of the result is table[(i + n) % 8] */
+static inline u64 load_rotated(const u8 table[static 8], u32 n)
+{
+	u64 t;
+	u32 shift = (n % 8) * 8;
+
+	memcpy(&t, table, sizeof(t));
+	if (shift == 0)
+		return t;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	return (t << shift) | (t >> (64 - shift));
+#else
+	return (t >> shift) | (t << (64 - shift));
+#endif
+}
+
 void wiimote_crypto_encrypt(u8 *data, const struct wiimote_encryption_key_t *key, u32 addr, u32 size)
 {
-	for (u32 i = 0; i < size; ++i, ++data)
-		data[i] = (data[i] - key->ft[addr % 8]) ^ key->sb[addr % 8];
+	u32 ft_w[2], sb_w[2], w;
+	u64 t;
+	u32 i;
+
+	/* Rotate the tables so that data[i] is encrypted with word (i / 4) % 2 */
+	t = load_rotated(key->ft, addr);
+	memcpy(ft_w, &t, sizeof(ft_w));
+	t = load_rotated(key->sb, addr);
+	memcpy(sb_w, &t, sizeof(sb_w));
+
+	/* 4 bytes at a time. Words are loaded and stored the same way for data and tables,
+	 * so the byte order doesn't matter */
+	for (i = 0; i + 4 <= size; i += 4) {
+		memcpy(&w, &data[i], sizeof(w));
+		w = sub_bytes(w, ft_w[(i / 4) & 1]) ^ sb_w[(i / 4) & 1];
+		memcpy(&data[i], &w, sizeof(w));
+	}
+
+	for (; i < size; i++)
+		data[i] = (data[i] - key->ft[(addr + i) % 8]) ^ key->sb[(addr + i) % 8];
 }